@@ -0,0 +1,35 @@
+#!/bin/sh
+# Compare two results of bench/run.sh.
+#
+# Usage: bench/compare.sh old.json new.json [percent]
+#
+# Prints the minimum times of both runs and their ratio for every format
+# and operation, and exits with status 1 if any operation got slower by
+# more than percent (default 10).
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 old.json new.json [percent]" >&2
+	exit 2
+fi
+
+awk -v limit=${3:-10} '
+function field(line, name,   s) {
+	s = substr(line, index(line, "\"" name "\": ") + length(name) + 4)
+	sub(/^"/, "", s)
+	sub(/["},].*/, "", s)
+	return s
+}
+/"op":/ {
+	key = field($0, "format") " / " field($0, "op")
+	if (FNR == NR) {
+		old[key] = field($0, "min_us")
+	} else if (key in old) {
+		new = field($0, "min_us")
+		ratio = (old[key] > 0 ? new / old[key] : 1)
+		flag = (ratio > 1 + limit / 100 ? "  SLOWER" : "")
+		printf "%-32s %10d %10d %6.2f%s\n", key, old[key], new, ratio, flag
+		if (flag != "") slower = 1
+	}
+}
+END { exit slower }
+' "$1" "$2"
@@ -0,0 +1,320 @@
+/*
+ * Microbenchmark of the internals of cpmfs.c.
+ *
+ * cpmfs.c is included here, so its static functions can be called
+ * directly.  They run against superblocks built in core with directories
+ * of 64 to 2048 entries and 255 to 65535 blocks; sector I/O goes to a
+ * driver that only copies a buffer.  For every function the time and the
+ * number of allocations per call are printed; allocations are counted by
+ * replacing malloc, calloc and realloc, which needs glibc, elsewhere the
+ * column shows "-".
+ *
+ * Usage: microbench [-j] [-t milliseconds]
+ */
+#include "config.h"
+
+#include <sys/stat.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpmfs.c"
+
+#include "getopt_.h"
+
+const char cmd[] = "microbench";
+
+/* count every allocation of the process, whoever calls the allocator */
+static unsigned long allocs;
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+	++allocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	++allocs;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	++allocs;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+#else
+#define COUNT_ALLOCS 0
+#endif
+
+/* Bytes per sector and sectors per track of the in-core superblocks */
+#define SECLENGTH 512
+#define SECTRK 64
+
+static volatile long sink;
+static double minTime = 0.1;
+static int json;
+static const char *sep = "";
+
+/*
+ * The bench driver serves every sector from one buffer.
+ */
+static unsigned char sectorData[SECLENGTH];
+
+static const char *benchReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	memcpy(buf, sectorData, this->secLength);
+	return NULL;
+}
+
+static const char *benchWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	memcpy(sectorData, buf, this->secLength);
+	return NULL;
+}
+
+static const struct DeviceDriver benchDriver = {
+	"bench",
+	1,
+	0,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	benchReadSector,
+	benchWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
+
+/*
+ * makeSuper -- build a superblock with a directory filled to 3/4
+ */
+static void makeSuper(struct cpmSuperBlock *d, int maxdir, int blocks) {
+	int i, j, block, used;
+
+	memset(d, 0, sizeof(*d));
+	d->secLength = SECLENGTH;
+	d->sectrk = SECTRK;
+	d->blksiz = 4096;
+	d->maxdir = maxdir;
+	d->dirblks = (maxdir * 32 + d->blksiz - 1) / d->blksiz;
+	d->boottrk = 2;
+	d->size = blocks;
+	d->tracks = d->boottrk + ((long)blocks * (d->blksiz / d->secLength) + SECTRK - 1) / SECTRK;
+	d->type = CPMFS_DR22;
+	d->extents = ((d->size > 256 ? 8 : 16) * d->blksiz) / 16384;
+	d->skewtab = malloc(d->sectrk * sizeof(int));
+	for (i = 0; i < d->sectrk; ++i) {
+		d->skewtab[i] = i;
+	}
+	d->alvSize = (blocks + INTBITS - 1) / INTBITS;
+	d->alv = malloc(d->alvSize * sizeof(int));
+	d->dir = malloc(d->dirblks * d->blksiz);
+	memset(d->dir, 0xe5, d->dirblks * d->blksiz);
+	d->dev.driver = &benchDriver;
+	d->dev.opened = 1;
+	d->dev.sectorCache = NULL;
+	d->dev.secLength = d->secLength;
+	d->dev.sectrk = d->sectrk;
+	d->dev.tracks = d->tracks;
+	used = maxdir * 3 / 4;
+	block = d->dirblks;
+	for (i = 0; i < used; ++i) {
+		struct PhysDirectoryEntry *e = &d->dir[i];
+		char name[12];
+
+		e->status = i % 4;
+		snprintf(name, sizeof(name), "F%07d", i);
+		memcpy(e->name, name, 8);
+		memcpy(e->ext, "DAT", 3);
+		e->extnol = e->extnoh = e->lrc = 0;
+		e->blkcnt = 0x80;
+		memset(e->pointers, 0, 16);
+		for (j = 0; j < 16 && block < blocks; ++j) {
+			e->pointers[j] = block & 0xff;
+			if (d->size > 256) {
+				e->pointers[++j] = block >> 8;
+			}
+			++block;
+		}
+	}
+}
+
+/*
+ * freeSuper -- release a superblock built by makeSuper
+ */
+static void freeSuper(struct cpmSuperBlock *d) {
+	free(d->skewtab);
+	free(d->alv);
+	free(d->dir);
+}
+
+/*
+ * now -- monotonic time in seconds
+ */
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * report -- print the result of one benchmark
+ */
+static void report(const char *name, int maxdir, int blocks, double seconds, long ops, unsigned long allocated) {
+	if (json) {
+		printf("%s\n  {\"function\": \"%s\", \"maxdir\": %d, \"blocks\": %d, \"ns_per_op\": %.1f, \"allocs_per_op\": ",
+			sep, name, maxdir, blocks, seconds * 1e9 / ops);
+		if (COUNT_ALLOCS) printf("%.2f}", (double)allocated / ops);
+		else printf("null}");
+		sep = ",";
+	} else {
+		printf("%-22s %6d %6d %12.1f ", name, maxdir, blocks, seconds * 1e9 / ops);
+		if (COUNT_ALLOCS) printf("%8.2f\n", (double)allocated / ops);
+		else printf("%8s\n", "-");
+	}
+}
+
+/*
+ * Each benchmark runs its body ops times.  The number of ops is doubled
+ * until the run takes at least minTime.
+ */
+#define BENCH(name, maxdir, blocks, setup, body) \
+	do { \
+		long ops, op; \
+		double start, seconds; \
+		unsigned long allocated; \
+		\
+		for (ops = 16;; ops *= 2) { \
+			setup; \
+			allocs = 0; \
+			start = now(); \
+			for (op = 0; op < ops; ++op) { \
+				body; \
+			} \
+			seconds = now() - start; \
+			allocated = allocs; \
+			if (seconds >= minTime) { \
+				break; \
+			} \
+		} \
+		report(name, maxdir, blocks, seconds, ops, allocated); \
+	} while (0)
+
+/*
+ * benchDirectory -- functions whose cost depends on the directory
+ */
+static void benchDirectory(int maxdir, int blocks) {
+	struct cpmSuperBlock d;
+	unsigned char buf[4096];
+	int *alv;
+	int used;
+
+	makeSuper(&d, maxdir, blocks);
+	used = maxdir * 3 / 4;
+	BENCH("findFileExtent hit", maxdir, blocks, ,
+		sink += findFileExtent(&d, op % 4, d.dir[op % used].name, d.dir[op % used].ext, 0, -1));
+	BENCH("findFileExtent miss", maxdir, blocks, ,
+		sink += findFileExtent(&d, 0, (const unsigned char *)"NOTHERE ", (const unsigned char *)"DAT", 0, -1));
+	BENCH("alvInit", maxdir, blocks, ,
+		alvInit(&d));
+	alvInit(&d);
+	alv = malloc(d.alvSize * sizeof(int));
+	memcpy(alv, d.alv, d.alvSize * sizeof(int));
+	BENCH("allocBlock", maxdir, blocks, memcpy(d.alv, alv, d.alvSize * sizeof(int)),
+		if ((sink = allocBlock(&d)) == -1) memcpy(d.alv, alv, d.alvSize * sizeof(int)));
+	free(alv);
+	BENCH("readBlock", maxdir, blocks, ,
+		sink += readBlock(&d, op % blocks, buf, 0, -1));
+	freeSuper(&d);
+}
+
+/*
+ * benchNames -- name matching and time conversion
+ */
+static void benchNames(void) {
+	static const char *names[] = { "00f0000042.dat", "03hello.com", "00readme.txt", "15x.y" };
+	static const char *patterns[] = { "*.dat", "3:h?llo.*", "*", "0:*.c*" };
+	static const unsigned char name1[] = "HELLO   ", name2[] = "HELLO   ";
+	struct cpmPattern compiled[4];
+	struct dsEntry entry;
+	int days, hour, min, i;
+	time_t t = 1700000000;
+
+	BENCH("isMatching", 0, 0, ,
+		sink += isMatching(0, name1, (const unsigned char *)"COM", 0, name2, (const unsigned char *)"COM"));
+	for (i = 0; i < 4; ++i) {
+		cpmPatternCompile(&compiled[i], patterns[i]);
+	}
+	BENCH("cpmPatternCompile", 0, 0, ,
+		cpmPatternCompile(&compiled[op % 4], patterns[op % 4]));
+	BENCH("cpmPatternMatch", 0, 0, ,
+		sink += cpmPatternMatch(&compiled[(op / 4) % 4], names[op % 4]));
+	BENCH("match", 0, 0, ,
+		sink += match(names[op % 4], patterns[(op / 4) % 4]));
+	BENCH("cpm2unix_time", 0, 0, ,
+		sink += cpm2unix_time(16000 + op % 1000, 0x12, 0x34));
+	BENCH("unix2cpm_time", 0, 0, ,
+		unix2cpm_time(t + op * 60, &days, &hour, &min); sink += days);
+	unix2ds_time(t, &entry);
+	BENCH("ds2unix_time", 0, 0, ,
+		sink += ds2unix_time(&entry));
+	BENCH("unix2ds_time", 0, 0, ,
+		unix2ds_time(t + op * 60, &entry));
+}
+
+int main(int argc, char *argv[]) {
+	static const int dirs[] = { 64, 256, 1024, 2048 };
+	static const int sizes[] = { 255, 4096, 65535 };
+	int c, i, j, usage = 0;
+
+	while ((c = getopt(argc, argv, "jt:h?")) != EOF) {
+		switch (c) {
+		case 'j':
+			json = 1;
+			break;
+		case 't':
+			minTime = atoi(optarg) / 1000.0;
+			break;
+		case 'h':
+		case '?':
+			usage = 1;
+			break;
+		}
+	}
+	if (usage || optind != argc) {
+		fprintf(stderr, "Usage: %s [-j] [-t milliseconds]\n", cmd);
+		exit(1);
+	}
+	if (json) {
+		printf("{\n\"results\": [");
+	} else {
+		printf("%-22s %6s %6s %12s %8s\n", "function", "maxdir", "blocks", "ns/op", "allocs/op");
+	}
+	benchNames();
+	for (i = 0; i < (int)(sizeof(dirs) / sizeof(dirs[0])); ++i) {
+		for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); ++j) {
+			benchDirectory(dirs[i], sizes[j]);
+		}
+	}
+	if (json) {
+		printf("\n]\n}\n");
+	}
+	exit(0);
+}
@@ -0,0 +1,139 @@
+#!/bin/sh
+# End-to-end benchmark of the tools over a representative set of formats.
+#
+# Usage: bench/run.sh [bindir [runs]] > results.json
+#
+# For every format an image is filled with files of a fixed, skewed size
+# distribution, fragmented by removing every sixth file and writing them
+# again in reverse order, so they straddle the holes of the others, and
+# each tool is timed RUNS times.  Results
+# are JSON, one result object per line, so two runs can be compared with
+# bench/compare.sh.  File sizes depend only on a fixed seed, so results
+# of different commits are comparable.
+
+BIN=`cd ${1:-\`dirname $0\`/../src} && pwd`
+DISKDEFS=`cd \`dirname $0\`/.. && pwd`/diskdefs
+RUNS=${2:-5}
+WORK=`mktemp -d ${TMPDIR:-/tmp}/cpmbench.XXXXXX`
+trap 'rm -rf "$WORK"' 0
+
+# 8" SSSD, Amstrad, 8 MB hard disk, 32 MB hard disk with 2048 entries
+FORMATS="ibm-3740 cpcdata sdcard bench-2048"
+
+cp "$DISKDEFS" "$WORK/diskdefs" || exit 1
+cat >> "$WORK/diskdefs" <<EOF
+
+diskdef bench-2048
+  seclen 512
+  tracks 2048
+  sectrk 32
+  blocksize 4096
+  maxdir 2048
+  skew 0
+  boottrk 2
+  os 2.2
+end
+EOF
+cd "$WORK" || exit 1
+
+now() {
+	date +%s%N
+}
+
+# sizes -- print "name size" for files filling about 60% of a format
+sizes() {
+	awk -v format=$1 -v diskdefs=diskdefs 'BEGIN {
+		while ((getline line < diskdefs) > 0) {
+			split(line, w)
+			if (w[1] == "diskdef") { found = (w[2] == format) }
+			if (found && w[1] == "seclen") seclen = w[2]
+			if (found && w[1] == "tracks") tracks = w[2]
+			if (found && w[1] == "sectrk") sectrk = w[2]
+			if (found && w[1] == "blocksize") blksiz = w[2]
+			if (found && w[1] == "boottrk") boottrk = w[2]
+			if (found && w[1] == "maxdir") maxdir = w[2]
+		}
+		blocks = int(seclen * sectrk * (tracks - boottrk) / blksiz * 0.6)
+		entries = int(maxdir * 0.6)
+		split("com txt dat bas", ext, " ")
+		srand(3740)
+		for (n = 0; blocks > 0 && entries > 0; ++n) {
+			# mostly small files, a few large ones
+			size = int(128 * exp(rand() * rand() * 9))
+			if (size > blocks * blksiz / 8) size = int(blocks * blksiz / 8) + 1
+			blocks -= int((size + blksiz - 1) / blksiz)
+			entries -= int((size + 8 * blksiz - 1) / (8 * blksiz))
+			printf "f%04d.%s %d\n", n, ext[n % 4 + 1], size
+		}
+	}'
+}
+
+# fill -- make the image of a format, print the number of files
+fill() {
+	rm -rf files && mkdir files || exit 1
+	sizes $1 > sizes
+	while read name size; do
+		head -c $size /dev/urandom > files/$name
+	done < sizes
+	$BIN/mkfs.cpm -f $1 base.img || exit 1
+	# copy every third file first, then fragment by removing every sixth
+	# file and refilling in reverse order, as first fit would put them
+	# back into their own holes in the same order
+	awk 'NR % 3 == 1 { print "files/" $1 }' sizes > first
+	awk 'NR % 3 != 1 { print "files/" $1 }' sizes > rest
+	awk 'NR % 6 == 1 { print "files/" $1 }' sizes > again
+	$BIN/cpmcp -f $1 base.img `cat first` 0: || exit 1
+	$BIN/cpmcp -f $1 base.img `cat rest` 0: || exit 1
+	$BIN/cpmrm -f $1 base.img `sed 's,^files/,0:,' again` || exit 1
+	$BIN/cpmcp -f $1 base.img `sort -r again` 0: || exit 1
+	fragmented=`$BIN/fsck.cpm -f $1 -n base.img | sed -n 's/.*(\([0-9.]*\)% non-contig.*/\1/p'`
+	case "$fragmented" in
+	""|0.0)
+		echo "$0: image of $1 is not fragmented" >&2
+		exit 1
+		;;
+	esac
+	wc -l < sizes | tr -d ' '
+}
+
+# run -- time a command RUNS times; the image is fresh for every run
+run() {
+	op=$1
+	shift
+	total=0
+	min=
+	r=0
+	while [ $r -lt $RUNS ]; do
+		cp base.img image.img
+		rm -rf out && mkdir out
+		start=`now`
+		"$@" > /dev/null 2>&1 || { echo "$0: $op on $format failed" >&2; exit 1; }
+		end=`now`
+		us=`expr \( $end - $start \) / 1000`
+		total=`expr $total + $us`
+		if [ -z "$min" ] || [ $us -lt $min ]; then
+			min=$us
+		fi
+		r=`expr $r + 1`
+	done
+	printf '%s\n  {"format": "%s", "files": %d, "op": "%s", "min_us": %d, "mean_us": %d}' \
+		"$sep" $format $files "$op" $min `expr $total / $RUNS`
+	sep=,
+}
+
+commit=`cd \`dirname $DISKDEFS\` && git rev-parse --short HEAD 2>/dev/null`
+printf '{\n"commit": "%s",\n"date": "%s",\n"runs": %d,\n"results": [' \
+	"$commit" "`date -u +%Y-%m-%dT%H:%M:%SZ`" $RUNS
+sep=
+for format in $FORMATS; do
+	files=`fill $format` || exit 1
+	run "mkfs.cpm" $BIN/mkfs.cpm -f $format new.img
+	run "cpmls" $BIN/cpmls -f $format image.img
+	run "cpmls -l" $BIN/cpmls -f $format -l image.img
+	run "cpmcp to unix" $BIN/cpmcp -f $format image.img '0:*' out
+	run "cpmcp to cp/m" $BIN/cpmcp -f $format image.img `cat again` 1:
+	run "cpmrm wildcard" $BIN/cpmrm -f $format image.img '0:*.txt'
+	run "fsck.cpm -n" $BIN/fsck.cpm -f $format -n image.img
+	rm -f new.img
+done
+printf '\n]\n}\n'
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Compare the synchronous POSIX backend (-T sync) with the io_uring
+# backend on a cold page cache.
+#
+# Usage: bench/uring.sh [bindir [format [runs]]]
+#
+# The page cache of the image is dropped before every run with
+# `dd iflag=nocache', so no root privileges are needed.
+
+BIN=`cd ${1:-\`dirname $0\`/../src} && pwd`
+DISKDEFS=`cd \`dirname $0\`/.. && pwd`/diskdefs
+FORMAT=${2:-sdcard}
+RUNS=${3:-5}
+WORK=`mktemp -d ${TMPDIR:-/tmp}/cpmbench.XXXXXX`
+trap 'rm -rf "$WORK"' 0
+
+cp "$DISKDEFS" "$WORK" || exit 1
+cd "$WORK" || exit 1
+
+$BIN/mkfs.cpm -f $FORMAT image || exit 1
+i=0
+while [ $i -lt 100 ]; do
+	head -c `expr \( $i % 13 + 1 \) \* 5000` /dev/urandom > f$i.dat
+	i=`expr $i + 1`
+done
+$BIN/cpmcp -f $FORMAT image f*.dat 0: || exit 1
+mkdir out
+
+now() {
+	date +%s%N
+}
+
+drop() {
+	sync
+	dd if=image iflag=nocache count=0 status=none
+}
+
+run() {
+	label=$1
+	shift
+	total=0
+	r=0
+	while [ $r -lt $RUNS ]; do
+		drop
+		start=`now`
+		"$@" > /dev/null || exit 1
+		end=`now`
+		total=`expr $total + \( $end - $start \) / 1000`
+		r=`expr $r + 1`
+	done
+	printf "%-22s %-8s %10d us\n" "$label" "$backend" `expr $total / $RUNS`
+}
+
+for backend in sync uring; do
+	if [ $backend = sync ]; then
+		T="-T sync"
+	else
+		T=
+	fi
+	run "cpmls -l" $BIN/cpmls $T -f $FORMAT -l image
+	run "cpmcp to unix" $BIN/cpmcp $T -f $FORMAT image '0:*' out
+	run "fsck.cpm -n" $BIN/fsck.cpm $T -f $FORMAT -n image
+done
@@ -0,0 +1,412 @@
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "getopt_.h"
+#include "cpmfs.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+const char cmd[] = "cpmbuild";
+
+/* A file of the manifest */
+struct buildFile {
+	char name[2 + 8 + 1 + 3 + 1]; /* 00foobarxy.zzy\0 */
+	char *path;
+	cpm_attr_t attr;
+	time_t mtime;                 /* 0 for the time of the build */
+};
+
+/* The manifest */
+static struct {
+	char *format;
+	char *boot[4];
+	char *label;
+	int timeStamps;
+	time_t time;
+	struct buildFile *file;
+	int files;
+} build;
+
+/*
+ * fail -- report an error in the manifest and exit
+ */
+static void fail(const char *manifest, int line, const char *msg, const char *arg) {
+	fprintf(stderr, "%s: %s:%d: %s %s\n", cmd, manifest, line, msg, arg);
+	exit(1);
+}
+
+/*
+ * parseTime -- read a time as YYYY-MM-DD[THH:MM[:SS]] or @seconds, in UTC
+ */
+static time_t parseTime(const char *s) {
+	struct tm tms;
+	char c;
+
+	if (*s == '@') {
+		return strtol(s + 1, NULL, 10);
+	}
+	memset(&tms, 0, sizeof(tms));
+	if (sscanf(s, "%d-%d-%d%c", &tms.tm_year, &tms.tm_mon, &tms.tm_mday, &c) == 3
+		|| sscanf(s, "%d-%d-%dT%d:%d%c", &tms.tm_year, &tms.tm_mon, &tms.tm_mday, &tms.tm_hour, &tms.tm_min, &c) == 5
+		|| sscanf(s, "%d-%d-%dT%d:%d:%d%c", &tms.tm_year, &tms.tm_mon, &tms.tm_mday, &tms.tm_hour, &tms.tm_min, &tms.tm_sec, &c) == 6) {
+		tms.tm_year -= 1900;
+		tms.tm_mon -= 1;
+		return mktime(&tms);
+	}
+	return -1;
+}
+
+/*
+ * parseAttr -- read attributes as cpmchattr(1) takes them
+ */
+static cpm_attr_t parseAttr(const char *s) {
+	cpm_attr_t attr = 0;
+
+	for (; *s; ++s) {
+		switch (tolower((unsigned char)*s)) {
+		case '1':
+			attr |= CPM_ATTR_F1;
+			break;
+		case '2':
+			attr |= CPM_ATTR_F2;
+			break;
+		case '3':
+			attr |= CPM_ATTR_F3;
+			break;
+		case '4':
+			attr |= CPM_ATTR_F4;
+			break;
+		case 'r':
+			attr |= CPM_ATTR_RO;
+			break;
+		case 's':
+			attr |= CPM_ATTR_SYS;
+			break;
+		case 'a':
+			attr |= CPM_ATTR_ARCV;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return attr;
+}
+
+/*
+ * hostPath -- a host file name, relative to the directory of the manifest
+ */
+static char *hostPath(const char *manifest, const char *name) {
+	const char *slash = strrchr(manifest, '/');
+	size_t dir = (*name == '/' || slash == NULL ? 0 : slash - manifest + 1);
+	char *path;
+
+	if ((path = malloc(dir + strlen(name) + 1)) == NULL) {
+		fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+		exit(1);
+	}
+	memcpy(path, manifest, dir);
+	strcpy(path + dir, name);
+	return path;
+}
+
+/*
+ * readManifest -- read the manifest, one keyword and its values per line
+ */
+static void readManifest(const char *manifest) {
+	FILE *fp;
+	char line[1024];
+	int ln, boots = 0;
+
+	if ((fp = fopen(manifest, "r")) == NULL) {
+		fprintf(stderr, "%s: can not open %s: %s\n", cmd, manifest, strerror(errno));
+		exit(1);
+	}
+	for (ln = 1; fgets(line, sizeof(line), fp); ++ln) {
+		char *argv[8], *s;
+		int argc;
+
+		if ((s = strchr(line, '#'))) {
+			*s = '\0';
+		}
+		for (argc = 0, s = strtok(line, " \t\r\n"); s && argc < 8; s = strtok(NULL, " \t\r\n")) {
+			argv[argc++] = s;
+		}
+		if (argc == 0) {
+			continue;
+		}
+		if (s) {
+			fail(manifest, ln, "too many values for", argv[0]);
+		}
+		if (strcmp(argv[0], "file") == 0) {
+			struct buildFile *f;
+			const char *name;
+			int user, i;
+
+			if (argc < 3 || argc % 2 == 0) {
+				fail(manifest, ln, "expected", "file user:name host-file [attr ...] [mtime ...]");
+			}
+			if (isdigit((unsigned char)argv[1][0]) && argv[1][1] == ':') {
+				user = argv[1][0] - '0';
+				name = argv[1] + 2;
+			} else if (isdigit((unsigned char)argv[1][0]) && isdigit((unsigned char)argv[1][1]) && argv[1][2] == ':') {
+				user = (argv[1][0] - '0') * 10 + argv[1][1] - '0';
+				name = argv[1] + 3;
+			} else {
+				fail(manifest, ln, "no user number in", argv[1]);
+			}
+			if (*name == '\0' || strlen(name) > 8 + 1 + 3) {
+				fail(manifest, ln, "not a CP/M file name:", argv[1]);
+			}
+			if ((build.file = realloc(build.file, (build.files + 1) * sizeof(struct buildFile))) == NULL) {
+				fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+				exit(1);
+			}
+			f = build.file + build.files++;
+			sprintf(f->name, "%02d", user);
+			strcpy(f->name + 2, name);
+			f->path = hostPath(manifest, argv[2]);
+			f->attr = 0;
+			f->mtime = 0;
+			for (i = 3; i < argc; i += 2) {
+				if (strcmp(argv[i], "attr") == 0) {
+					if ((f->attr = parseAttr(argv[i + 1])) == -1) {
+						fail(manifest, ln, "unknown attributes", argv[i + 1]);
+					}
+				} else if (strcmp(argv[i], "mtime") == 0) {
+					if ((f->mtime = parseTime(argv[i + 1])) == -1) {
+						fail(manifest, ln, "invalid time", argv[i + 1]);
+					}
+				} else {
+					fail(manifest, ln, "unknown file option", argv[i]);
+				}
+			}
+			continue;
+		}
+		if (argc != 2) {
+			fail(manifest, ln, "expected one value for", argv[0]);
+		}
+		if (strcmp(argv[0], "format") == 0) {
+			build.format = strdup(argv[1]);
+		} else if (strcmp(argv[0], "boot") == 0) {
+			if (boots == 4) {
+				fail(manifest, ln, "more than four", "boot files");
+			}
+			build.boot[boots++] = hostPath(manifest, argv[1]);
+		} else if (strcmp(argv[0], "label") == 0) {
+			build.label = strdup(argv[1]);
+		} else if (strcmp(argv[0], "timestamps") == 0) {
+			if (strcmp(argv[1], "on") == 0) {
+				build.timeStamps = 1;
+			} else if (strcmp(argv[1], "off") == 0) {
+				build.timeStamps = 0;
+			} else {
+				fail(manifest, ln, "expected on or off, not", argv[1]);
+			}
+		} else if (strcmp(argv[0], "time") == 0) {
+			if ((build.time = parseTime(argv[1])) == -1) {
+				fail(manifest, ln, "invalid time", argv[1]);
+			}
+		} else {
+			fail(manifest, ln, "unknown keyword", argv[0]);
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * readBoot -- read the boot files into boot tracks filled with 0xe5
+ */
+static char *readBoot(const struct cpmSuperBlock *drive) {
+	size_t bootTrackSize, used;
+	char *bootTracks;
+	int i;
+
+	bootTrackSize = drive->boottrk * drive->secLength * drive->sectrk;
+	if ((bootTracks = malloc(bootTrackSize ? bootTrackSize : 1)) == NULL) {
+		fprintf(stderr, "%s: can not allocate boot track buffer: %s\n", cmd, strerror(errno));
+		exit(1);
+	}
+	memset(bootTracks, 0xe5, bootTrackSize);
+	for (used = 0, i = 0; i < 4 && build.boot[i]; ++i) {
+		ssize_t size;
+		int fd;
+
+		if ((fd = open(build.boot[i], O_BINARY | O_RDONLY)) == -1) {
+			fprintf(stderr, "%s: can not open %s: %s\n", cmd, build.boot[i], strerror(errno));
+			exit(1);
+		}
+		if ((size = read(fd, bootTracks + used, bootTrackSize - used)) == -1) {
+			fprintf(stderr, "%s: can not read %s: %s\n", cmd, build.boot[i], strerror(errno));
+			exit(1);
+		}
+		if (size % drive->secLength) {
+			size = (size | (drive->secLength - 1)) + 1;
+		}
+		used += size;
+		close(fd);
+	}
+	return bootTracks;
+}
+
+/*
+ * addFile -- copy a host file to the image
+ */
+static int addFile(struct cpmInode *root, const struct buildFile *f) {
+	struct cpmInode ino;
+	struct cpmFile file;
+	struct utimbuf times;
+	char buf[16384];
+	ssize_t got;
+	int fd;
+
+	if ((fd = open(f->path, O_BINARY | O_RDONLY)) == -1) {
+		fprintf(stderr, "%s: can not open %s: %s\n", cmd, f->path, strerror(errno));
+		return -1;
+	}
+	if (cpmCreat(root, f->name, &ino, 0666) == -1) {
+		fprintf(stderr, "%s: can not create %s: %s\n", cmd, f->name, boo);
+		close(fd);
+		return -1;
+	}
+	cpmOpen(&ino, &file, O_WRONLY);
+	while ((got = read(fd, buf, sizeof(buf))) > 0) {
+		if (cpmWrite(&file, buf, got) != got) {
+			fprintf(stderr, "%s: can not write %s: %s\n", cmd, f->name, boo);
+			got = -2;
+			break;
+		}
+	}
+	if (got == -1) {
+		fprintf(stderr, "%s: can not read %s: %s\n", cmd, f->path, strerror(errno));
+	}
+	cpmClose(&file);
+	close(fd);
+	if (got < 0) {
+		return -1;
+	}
+	times.actime = times.modtime = (f->mtime ? f->mtime : build.time);
+	cpmUtime(&ino, &times);
+	if (f->attr && cpmAttrSet(&ino, f->attr) == -1) {
+		fprintf(stderr, "%s: can not set attributes of %s: %s\n", cmd, f->name, boo);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *err, *epoch;
+	const char *image;
+	int c, i, usage = 0;
+	struct cpmSuperBlock drive, super;
+	struct cpmInode root;
+	char *bootTracks;
+	unsigned char *area;
+	size_t length, pos, trkbytes;
+
+	argc = cpmStatsArgs(argc, argv);
+	while ((c = getopt(argc, argv, "h?")) != EOF) {
+		switch (c) {
+		case 'h':
+		case '?':
+			usage = 1;
+			break;
+		}
+	}
+	if (optind != (argc - 2)) {
+		usage = 1;
+	}
+
+	if (usage) {
+		fprintf(stderr, "Usage: %s manifest image\n", cmd);
+		exit(1);
+	}
+	image = argv[optind + 1];
+
+	/* all times are UTC, so builds do not depend on the time zone */
+	setenv("TZ", "UTC0", 1);
+	tzset();
+	if (!(build.format = getenv("CPMTOOLSFMT"))) {
+		build.format = FORMAT;
+	}
+	build.label = "unlabeled";
+	/* the first day of CP/M time stamps, unless the build tells */
+	build.time = ((epoch = getenv("SOURCE_DATE_EPOCH")) ? strtol(epoch, NULL, 10) : 252460800);
+	readManifest(argv[optind]);
+	cpmSetClock(build.time);
+
+	drive.dev.opened = 0;
+	if (cpmReadSuper(&drive, &root, build.format, 0) == -1) {
+		fprintf(stderr, "%s: cannot read format %s (%s)\n", cmd, build.format, boo);
+		exit(1);
+	}
+	bootTracks = readBoot(&drive);
+	area = cpmFormat(&drive, build.label, bootTracks, build.timeStamps, &length);
+	if (area == NULL) {
+		fprintf(stderr, "%s: can not make new file system: %s\n", cmd, boo);
+		exit(1);
+	}
+	free(bootTracks);
+
+	/* build the image in core, it is written out once when unmounted */
+	err = Device_open(&drive.dev, image, O_CREAT | O_TRUNC | O_RDWR, "mem");
+	if (err == NULL) {
+		drive.dev.stats = (drive.stats ? &drive.stats->dev : NULL);
+		err = Device_setGeometry(&drive.dev, drive.secLength, drive.sectrk, drive.tracks, drive.offset, drive.libdskGeometry);
+	}
+	trkbytes = drive.secLength * drive.sectrk;
+	for (pos = 0; err == NULL && pos < length; pos += drive.secLength) {
+		err = Device_writeSector(&drive.dev, pos / trkbytes, (pos % trkbytes) / drive.secLength, area + pos);
+	}
+	if (err) {
+		fprintf(stderr, "%s: cannot write %s (%s)\n", cmd, image, err);
+		unlink(image);
+		exit(1);
+	}
+	free(area);
+
+	/* mount the image still in core */
+	super.dev = drive.dev;
+	if (cpmReadSuper(&super, &root, build.format, 0) == -1) {
+		fprintf(stderr, "%s: cannot read superblock (%s)\n", cmd, boo);
+		exit(1);
+	}
+	if (drive.stats) {
+		/* go on counting for the whole run */
+		free(super.stats);
+		super.stats = drive.stats;
+		super.dev.stats = &super.stats->dev;
+	}
+	/* a new file system fills from the start, so each file is contiguous */
+	for (i = 0; i < build.files; ++i) {
+		if (addFile(&root, build.file + i) == -1) {
+			Device_close(&super.dev);
+			unlink(image);
+			exit(1);
+		}
+	}
+	/* the image is only written now, so a failure here leaves no image */
+	if (cpmSync(&super) == -1) {
+		fprintf(stderr, "%s: can not write %s: %s\n", cmd, image, boo);
+		Device_close(&super.dev);
+		unlink(image);
+		exit(1);
+	}
+	if ((err = Device_close(&super.dev))) {
+		fprintf(stderr, "%s: can not write %s: %s\n", cmd, image, err);
+		unlink(image);
+		exit(1);
+	}
+	cpmUmount(&super);
+	exit(0);
+}
@@ -16,17 +16,19 @@ int main(int argc, char *argv[]) {
 	const char *format;
 	const char *devopts = NULL;
 	int uppercase = 0;
-	int c, i, usage = 0, exitcode = 0;
+	int c, usage = 0, exitcode = 0;
 	struct cpmSuperBlock drive;
 	struct cpmInode root;
-	int gargc;
-	char **gargv;
 	const char *attrs;
+	cpm_attr_t keep, set;
+	unsigned int n;
+	int m;
 	/*}}}*/
 
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "T:f:uh?")) != EOF) {
 		switch (c) {
 		case 'T':
@@ -64,73 +66,62 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "%s: cannot read superblock (%s)\n", cmd, boo);
 		exit(1);
 	}
-	cpmglob(optind, argc, argv, &root, &gargc, &gargv);
-	for (i = 0; i < gargc; ++i) {
-		struct cpmInode ino;
-		int rc;
-		cpm_attr_t attrib;
-		unsigned int n;
-		int m;
-
-		rc = cpmNamei(&root, gargv[i], &ino) == -1;
-		if (rc) goto error;
-		rc = cpmAttrGet(&ino, &attrib);
-		if (rc) goto error;
-		m = 0;
-		for (n = 0; n < strlen(attrs); n++) {
-			int mask = 0;
-			switch (attrs[n]) {
-			case 'n':
-			case 'N':
-				mask = 0;
-				attrib = 0;
-				break;
-			case 'm':
-			case 'M':
-				mask = 0;
-				m = !m;
-				break;
-			case '1':
-				mask = CPM_ATTR_F1;
-				break;
-			case '2':
-				mask = CPM_ATTR_F2;
-				break;
-			case '3':
-				mask = CPM_ATTR_F3;
-				break;
-			case '4':
-				mask = CPM_ATTR_F4;
-				break;
-			case 'r':
-			case 'R':
-				mask = CPM_ATTR_RO;
-				break;
-			case 's':
-			case 'S':
-				mask = CPM_ATTR_SYS;
-				break;
-			case 'a':
-			case 'A':
-				mask = CPM_ATTR_ARCV;
-				break;
-			default:
-				fprintf(stderr, "%s: Unknown attribute %c\n", cmd, attrs[n]);
-				exit(1);
-			}
-			if (m) {
-				attrib &= ~mask;
-			} else {
-				attrib |= mask;
-			}
+	/* the attributes become (attributes & keep) | set */
+	keep = ~0;
+	set = 0;
+	m = 0;
+	for (n = 0; n < strlen(attrs); n++) {
+		int mask = 0;
+		switch (attrs[n]) {
+		case 'n':
+		case 'N':
+			mask = 0;
+			keep = set = 0;
+			break;
+		case 'm':
+		case 'M':
+			mask = 0;
+			m = !m;
+			break;
+		case '1':
+			mask = CPM_ATTR_F1;
+			break;
+		case '2':
+			mask = CPM_ATTR_F2;
+			break;
+		case '3':
+			mask = CPM_ATTR_F3;
+			break;
+		case '4':
+			mask = CPM_ATTR_F4;
+			break;
+		case 'r':
+		case 'R':
+			mask = CPM_ATTR_RO;
+			break;
+		case 's':
+		case 'S':
+			mask = CPM_ATTR_SYS;
+			break;
+		case 'a':
+		case 'A':
+			mask = CPM_ATTR_ARCV;
+			break;
+		default:
+			fprintf(stderr, "%s: Unknown attribute %c\n", cmd, attrs[n]);
+			exit(1);
 		}
-		rc = cpmAttrSet(&ino, attrib);
-		if (rc) {
-error:
-			fprintf(stderr, "%s: can not set attributes for %s: %s\n", cmd, gargv[i], boo);
-			exitcode = 1;
+		if (m) {
+			keep &= ~mask;
+			set &= ~mask;
+		} else {
+			set |= mask;
 		}
 	}
+	if (cpmAttrSetAll(&root, argc - optind, argv + optind, keep, set) == -1) {
+		fprintf(stderr, "%s: can not set attributes: %s\n", cmd, boo);
+		exitcode = 1;
+	}
 	cpmUmount(&drive);
 	exit(exitcode);
 }
@@ -17,16 +17,15 @@ int main(int argc, char *argv[]) {
 	const char *format;
 	const char *devopts = NULL;
 	int uppercase = 0;
-	int c, i, usage = 0, exitcode = 0;
+	int c, usage = 0, exitcode = 0;
 	struct cpmSuperBlock drive;
 	struct cpmInode root;
-	int gargc;
-	char **gargv;
 	unsigned int mode;
 
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "T:f:uh?")) != EOF) {
 		switch (c) {
 		case 'T':
@@ -66,17 +65,11 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "%s: cannot read superblock (%s)\n", cmd, boo);
 		exit(1);
 	}
-	cpmglob(optind, argc, argv, &root, &gargc, &gargv);
-	for (i = 0; i < gargc; ++i) {
-		struct cpmInode ino;
-
-		if (cpmNamei(&root, gargv[i], &ino) == -1) {
-			fprintf(stderr, "%s: can not find %s: %s\n", cmd, gargv[i], boo);
-			exitcode = 1;
-		} else if (cpmChmod(&ino, mode) == -1) {
-			fprintf(stderr, "%s: Failed to set attributes for %s: %s\n", cmd, gargv[i], boo);
-			exitcode = 1;
-		}
+	/* as cpmChmod, only the write permission makes a difference */
+	if (cpmAttrSetAll(&root, argc - optind, argv + optind, ~CPM_ATTR_RO,
+		(mode & (S_IWUSR | S_IWGRP | S_IWOTH)) ? 0 : CPM_ATTR_RO) == -1) {
+		fprintf(stderr, "%s: Failed to set attributes: %s\n", cmd, boo);
+		exitcode = 1;
 	}
 	cpmUmount(&drive);
 	exit(exitcode);
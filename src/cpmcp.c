@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range */
+#endif
 #include "config.h"
 
 #include <sys/stat.h>
@@ -9,10 +12,17 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "getopt_.h"
 #include "cpmfs.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 const char cmd[] = "cpmcp";
 static int text = 0;
 static int preserve = 0;
@@ -32,26 +42,174 @@ static int userNumber(const char *s) {
 	return -1;
 }
 
+/**
+ * Copy a run of a file from the image file to a UNIX file.
+ * Holes are seeked over up to their last byte on regular files and
+ * written as zeros to others.  Past the end of a short image file the run
+ * reads as zeros, as from the device.
+ * @param in    The image file.
+ * @param out   The UNIX file, written at its current position.
+ * @param run   The run.
+ * @param seek  Nonzero if out is a regular file, so holes can be seeked over.
+ * @param plain Nonzero if out appends, so it is only written to.
+ * @returns NULL for success, else an error message.
+ */
+static const char *copyRun(int in, int out, const struct cpmFileRun *run, int seek, int plain) {
+	char buf[4096];
+	off_t pos = run->physical, left = run->length;
+	ssize_t res;
+	int eof = 0;
+
+	if (run->physical == -1) {
+		memset(buf, 0, sizeof(buf));
+		if (seek && lseek(out, left - 1, SEEK_CUR) != -1) {
+			left = 1;
+		}
+		for (; left > 0; left -= res) {
+			if ((res = write(out, buf, left < (off_t)sizeof(buf) ? left : (off_t)sizeof(buf))) == -1) {
+				return strerror(errno);
+			}
+		}
+		return NULL;
+	}
+	for (; left > 0; left -= res) {
+		res = -1;
+		if (eof) {
+			if ((res = write(out, buf, left < (off_t)sizeof(buf) ? left : (off_t)sizeof(buf))) == -1) {
+				return strerror(errno);
+			}
+			continue;
+		}
+#ifdef __linux__
+		if (!plain) {
+			/* in the kernel, or as a reflink of the blocks */
+			res = copy_file_range(in, &pos, out, NULL, left, 0);
+			if (res == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP
+				|| errno == EBADF)) {
+				/* pipes and sockets */
+				res = sendfile(out, in, &pos, left);
+			}
+			if (res == -1 && errno != EINVAL && errno != ENOSYS && errno != EBADF) {
+				return strerror(errno);
+			}
+		}
+#endif
+		if (res == -1) {
+			if ((res = pread(in, buf, left < (off_t)sizeof(buf) ? left : (off_t)sizeof(buf), pos)) > 0) {
+				res = write(out, buf, res);
+			}
+			if (res == -1) {
+				return strerror(errno);
+			}
+			pos += res;
+		}
+		if (res == 0) {
+			memset(buf, 0, sizeof(buf));
+			eof = 1;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Copy one file in binary mode straight from the image file to UNIX.
+ * @param ino  The inode of the file.
+ * @param dest The UNIX filename, - for standard output.
+ * @returns 0 if the device has no image file to copy from, 1 for success,
+ *          -1 for error.
+ */
+static int rawToUnix(struct cpmInode *ino, const char *dest) {
+	struct cpmFileRun *run;
+	const char *err = NULL;
+	struct stat st;
+	int runs, i, in, out, seek, plain;
+
+	if ((in = Device_rawFd(&ino->sb->dev)) == -1 || (runs = cpmFileMap(ino, &run)) == -1) {
+		return 0;
+	}
+	if (strcmp(dest, "-") == 0) {
+		/* whatever stdio buffered so far goes first */
+		fflush(stdout);
+		out = STDOUT_FILENO;
+	} else if ((out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) == -1) {
+		fprintf(stderr, "%s: can not create %s: %s\n", cmd, dest, strerror(errno));
+		free(run);
+		return -1;
+	}
+	/* appending output ignores the file position, so it only takes writes */
+	seek = (fstat(out, &st) == 0 && S_ISREG(st.st_mode));
+	plain = ((fcntl(out, F_GETFL) & O_APPEND) != 0);
+	for (i = 0; i < runs && err == NULL; ++i) {
+		err = copyRun(in, out, &run[i], seek && !plain, plain);
+	}
+	free(run);
+	if (err) {
+		fprintf(stderr, "%s: can not write %s: %s\n", cmd, dest, err);
+		if (out != STDOUT_FILENO) {
+			close(out);
+		}
+		return -1;
+	}
+	if (out != STDOUT_FILENO && close(out) == -1) {
+		fprintf(stderr, "%s: can not close %s: %s\n", cmd, dest, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Set the timestamps of a UNIX file to those of a CP/M file, if it has any.
+ * @param ino  The inode of the CP/M file.
+ * @param dest The UNIX filename.
+ * @returns 0 for success, 1 for error.
+ */
+static int preserveTimes(const struct cpmInode *ino, const char *dest) {
+	struct utimbuf ut;
+
+	if (!ino->atime && !ino->mtime) {
+		return 0;
+	}
+	if (ino->atime) {
+		ut.actime = ino->atime;
+	} else {
+		time(&ut.actime);
+	}
+	if (ino->mtime) {
+		ut.modtime = ino->mtime;
+	} else {
+		time(&ut.modtime);
+	}
+	if (utime(dest, &ut) == -1) {
+		fprintf(stderr, "%s: can change timestamps of %s: %s\n", cmd, dest, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
 /**
  * Copy one file from CP/M to UNIX.
  * @param root The inode for the root directory.
  * @param src  The CP/M filename in 00aaaaaaaabbb format.
- * @param dest The UNIX filename.
+ * @param dest The UNIX filename, - for standard output.
  * @returns 0 for success, 1 for error.
  */
 static int cpmToUnix(const struct cpmInode *root, const char *src, const char *dest) {
 	struct cpmInode ino;
 	int exitcode = 0;
+	FILE *ufp = (strcmp(dest, "-") == 0 ? stdout : NULL);
 
 	if (cpmNamei(root, src, &ino) == -1) {
 		fprintf(stderr, "%s: can not open `%s': %s\n", cmd, src, boo);
 		exitcode = 1;
+	} else if (!text && (exitcode = rawToUnix(&ino, dest)) != 0) {
+		exitcode = (exitcode == -1 || (preserve && ufp != stdout && preserveTimes(&ino, dest)));
 	} else {
 		struct cpmFile file;
-		FILE *ufp;
 
 		cpmOpen(&ino, &file, O_RDONLY);
-		ufp = fopen(dest, text ? "w" : "wb");
+		if (ufp == NULL) {
+			ufp = fopen(dest, text ? "w" : "wb");
+		}
 		if (ufp == NULL) {
 			fprintf(stderr, "%s: can not create %s: %s\n", cmd, dest, strerror(errno));
 			exitcode = 1;
@@ -109,29 +267,14 @@ endwhile:
 				exitcode = 1;
 				ohno = 1;
 			}
-			if (fclose(ufp) == EOF && !ohno) {
+			if ((ufp == stdout ? fflush(ufp) : fclose(ufp)) == EOF && !ohno) {
 				fprintf(stderr, "%s: can not close %s: %s\n", cmd, dest, strerror(errno));
 				exitcode = 1;
 				ohno = 1;
 			}
-			if (preserve && !ohno && (ino.atime || ino.mtime)) {
-				struct utimbuf ut;
-
-				if (ino.atime) {
-					ut.actime = ino.atime;
-				} else {
-					time(&ut.actime);
-				}
-				if (ino.mtime) {
-					ut.modtime = ino.mtime;
-				} else {
-					time(&ut.modtime);
-				}
-				if (utime(dest, &ut) == -1) {
-					fprintf(stderr, "%s: can change timestamps of %s: %s\n", cmd, dest, strerror(errno));
-					exitcode = 1;
-					ohno = 1;
-				}
+			if (preserve && !ohno && ufp != stdout && preserveTimes(&ino, dest)) {
+				exitcode = 1;
+				ohno = 1;
 			}
 		}
 		cpmClose(&file);
@@ -163,6 +306,7 @@ int main(int argc, char *argv[]) {
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "T:f:ptuh?")) != EOF) {
 		switch (c) {
 		case 'T':
@@ -201,7 +345,10 @@ int main(int argc, char *argv[]) {
 			}
 		}
 		todir = ((argc - optind) > 2);
-		if (stat(argv[argc - 1], &statbuf) == -1) {
+		if (strcmp(argv[argc - 1], "-") == 0) {
+			/* all files go to standard output */
+			todir = 0;
+		} else if (stat(argv[argc - 1], &statbuf) == -1) {
 			if (todir) {
 				usage();
 			}
@@ -225,6 +372,12 @@ int main(int argc, char *argv[]) {
 		}
 		if (*(strchr(argv[argc - 1], ':') + 1) == '\0') {
 			todir = 1;
+			/* standard input has no name to copy */
+			for (i = optind; i < (argc - 1); ++i) {
+				if (strcmp(argv[i], "-") == 0) {
+					usage();
+				}
+			}
 		}
 		readcpm = 0;
 	} else {
@@ -245,7 +398,7 @@ int main(int argc, char *argv[]) {
 
 		cpmglob(optind, argc - 1, argv, &root, &gargc, &gargv);
 		/* trying to copy multiple files to a file? */
-		if (gargc > 1 && !todir) {
+		if (gargc > 1 && !todir && strcmp(last, "-")) {
 			usage();
 		}
 		for (i = 0; i < gargc; ++i) {
@@ -279,14 +432,14 @@ int main(int argc, char *argv[]) {
 			char *translate;
 			struct stat st;
 
-			ufp = fopen(argv[i], "rb");
+			ufp = (strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb"));
 			if (ufp == NULL) /* cry a little */ {
 				fprintf(stderr, "%s: can not open %s: %s\n", cmd, argv[i], strerror(errno));
 				exitcode = 1;
 				continue;
 			}
 
-			stat(argv[i], &st);
+			fstat(fileno(ufp), &st);
 
 			if (todir) {
 				dest = strrchr(argv[i], '/');
@@ -314,40 +467,56 @@ int main(int argc, char *argv[]) {
 			} else {
 				struct cpmFile file;
 				int ohno = 0;
-				char buf[4096 + 1];
+				char buf[16384 + 1];
 
+				/* the length is not known in advance, blocks are
+				 * allocated as the data arrives */
 				cpmOpen(&ino, &file, O_WRONLY);
 				do {
 					int j;
 
-					for (j = 0; j < (sizeof(buf) / 2) && (c = getc(ufp)) != EOF; ++j) {
-						if (text && c == '\n') {
-							buf[j++] = '\r';
+					if (text) {
+						for (j = 0; j < (sizeof(buf) / 2) && (c = getc(ufp)) != EOF; ++j) {
+							if (c == '\n') {
+								buf[j++] = '\r';
+							}
+							buf[j] = c;
+						}
+						if (c == EOF) {
+							buf[j++] = '\032';
 						}
-						buf[j] = c;
+					} else {
+						/* a whole extent at a time */
+						j = fread(buf, 1, sizeof(buf) - 1, ufp);
+						c = (j == sizeof(buf) - 1 ? 0 : EOF);
 					}
-					if (text && c == EOF) {
-						buf[j++] = '\032';
+					if (c == EOF && ferror(ufp)) {
+						fprintf(stderr, "%s: can not read %s: %s\n", cmd, argv[i], strerror(errno));
+						ohno = 1;
+						exitcode = 1;
+						break;
 					}
 					if (cpmWrite(&file, buf, j) != j) {
-						fprintf(stderr, "%s: can not write %s: %s\n", cmd, dest, boo);
+						fprintf(stderr, "%s: can not write %s: %s\n", cmd, cpmname, boo);
 						ohno = 1;
 						exitcode = 1;
 						break;
 					}
 				} while (c != EOF);
 				if (cpmClose(&file) == EOF && !ohno) /* I just can't hold back the tears */ {
-					fprintf(stderr, "%s: can not close %s: %s\n", cmd, dest, boo);
+					fprintf(stderr, "%s: can not close %s: %s\n", cmd, cpmname, boo);
 					exitcode = 1;
 				}
-				if (preserve && !ohno) {
+				if (preserve && !ohno && ufp != stdin) {
 					struct utimbuf times;
 					times.actime = st.st_atime;
 					times.modtime = st.st_mtime;
 					cpmUtime(&ino, &times);
 				}
 			}
-			fclose(ufp);
+			if (ufp != stdin) {
+				fclose(ufp);
+			}
 		}
 	}
 	cpmUmount(&super);
@@ -0,0 +1,175 @@
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "getopt_.h"
+#include "device.h"
+
+const char cmd[] = "cpmdedup";
+
+/* The largest chunk, in KiB; the driver keeps a few in memory */
+#define DEDUP_MAX_CHUNK 16384
+
+/* The images to ingest, taken by the workers in turn */
+static struct {
+	pthread_mutex_t lock;
+	char **image;
+	int images, next;
+	const char *store;
+	unsigned chunkSize;
+	struct DedupStats stats;
+	int failed;
+} work = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * baseName -- the name of the manifest of an image
+ */
+static const char *baseName(const char *image) {
+	const char *name = strrchr(image, '/');
+
+	return (name ? name + 1 : image);
+}
+
+/*
+ * namecmp -- compare two images by the name of their manifest
+ */
+static int namecmp(const void *a, const void *b) {
+	return strcmp(baseName(*(char *const *)a), baseName(*(char *const *)b));
+}
+
+/*
+ * worker -- ingest images until none are left
+ */
+static void *worker(void *arg) {
+	for (;;) {
+		struct DedupStats stats;
+		char manifest[4096];
+		const char *image, *name, *err;
+
+		pthread_mutex_lock(&work.lock);
+		image = (work.next < work.images ? work.image[work.next++] : NULL);
+		pthread_mutex_unlock(&work.lock);
+		if (image == NULL) {
+			return NULL;
+		}
+		name = baseName(image);
+		snprintf(manifest, sizeof(manifest), "%s/%s", work.store, name);
+		memset(&stats, 0, sizeof(stats));
+		err = Dedup_ingest(image, manifest, work.chunkSize, &stats);
+		pthread_mutex_lock(&work.lock);
+		if (err) {
+			fprintf(stderr, "%s: can not store %s: %s\n", cmd, image, err);
+			work.failed = 1;
+		}
+		work.stats.chunks += stats.chunks;
+		work.stats.stored += stats.stored;
+		work.stats.bytes += stats.bytes;
+		work.stats.storedBytes += stats.storedBytes;
+		pthread_mutex_unlock(&work.lock);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *err;
+	int c, i, usage = 0, restore = 0, jobs = 4;
+	pthread_t *thread;
+	char **sorted;
+	long value;
+	char *end;
+
+	work.chunkSize = 4096;
+	while ((c = getopt(argc, argv, "c:j:rh?")) != EOF) {
+		switch (c) {
+		case 'c':
+			value = strtol(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' || value <= 0 || value > DEDUP_MAX_CHUNK) {
+				usage = 1;
+			} else {
+				work.chunkSize = value * 1024;
+			}
+			break;
+		case 'j':
+			if ((jobs = strtol(optarg, NULL, 0)) < 1) {
+				usage = 1;
+			}
+			break;
+		case 'r':
+			restore = 1;
+			break;
+		case 'h':
+		case '?':
+			usage = 1;
+			break;
+		}
+	}
+	if (restore ? optind != (argc - 2) : optind > (argc - 2)) {
+		usage = 1;
+	}
+
+	if (usage) {
+		fprintf(stderr, "Usage: %s [-c chunk-KiB] [-j jobs] store image ...\n", cmd);
+		fprintf(stderr, "       %s -r manifest image\n", cmd);
+		exit(1);
+	}
+	if (restore) {
+		if ((err = Dedup_restore(argv[optind], argv[optind + 1]))) {
+			fprintf(stderr, "%s: can not restore %s: %s\n", cmd, argv[optind], err);
+			exit(1);
+		}
+		exit(0);
+	}
+	work.store = argv[optind++];
+	work.image = argv + optind;
+	work.images = argc - optind;
+	/* the manifests are named after the images, so one would replace another */
+	if ((sorted = malloc(work.images * sizeof(char *))) == NULL) {
+		fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+		exit(1);
+	}
+	memcpy(sorted, work.image, work.images * sizeof(char *));
+	qsort(sorted, work.images, sizeof(char *), namecmp);
+	for (i = 1; i < work.images; ++i) {
+		if (namecmp(&sorted[i - 1], &sorted[i]) == 0) {
+			fprintf(stderr, "%s: %s and %s would have the same manifest\n", cmd, sorted[i - 1], sorted[i]);
+			exit(1);
+		}
+	}
+	free(sorted);
+	if (mkdir(work.store, 0777) == -1 && errno != EEXIST) {
+		fprintf(stderr, "%s: can not create %s: %s\n", cmd, work.store, strerror(errno));
+		exit(1);
+	}
+	if (jobs > work.images) {
+		jobs = work.images;
+	}
+	if ((thread = malloc(jobs * sizeof(pthread_t))) == NULL) {
+		fprintf(stderr, "%s: can not allocate threads: %s\n", cmd, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < jobs; ++i) {
+		if (pthread_create(&thread[i], NULL, worker, NULL)) {
+			break;
+		}
+	}
+	if (i == 0) {
+		/* no threads, work alone */
+		worker(NULL);
+	}
+	while (i > 0) {
+		pthread_join(thread[--i], NULL);
+	}
+	free(thread);
+	printf("%d images, %lu chunks of %llu bytes, %lu new chunks of %llu bytes, ",
+		work.images, work.stats.chunks, work.stats.bytes, work.stats.stored, work.stats.storedBytes);
+	if (work.stats.storedBytes) {
+		printf("dedup ratio %.2f\n", (double)work.stats.bytes / work.stats.storedBytes);
+	} else {
+		/* everything was in the store already */
+		printf("all chunks shared\n");
+	}
+	exit(work.failed);
+}
@@ -0,0 +1,245 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "getopt_.h"
+#include "cpmfs.h"
+
+const char cmd[] = "cpmdiff";
+
+/* What differs between two files of the same name */
+#define DIFF_SIZE    1
+#define DIFF_ATTR    2
+#define DIFF_TIME    4
+#define DIFF_CONTENT 8
+
+static const char *const diffName[] = { "size", "attributes", "time", "content" };
+
+static int json = 0;
+static int entries = 0;
+
+/*
+ * filecmp -- compare two files by name, which sorts them by user first
+ */
+static int filecmp(const void *a, const void *b) {
+	return strcmp(((const struct cpmDirStat *)a)->name, ((const struct cpmDirStat *)b)->name);
+}
+
+/*
+ * mount -- open an image and list its files sorted by name
+ */
+static int mount(struct cpmSuperBlock *super, const char *image, const char *format,
+		const char *devopts, struct cpmDirStat **files) {
+	struct cpmInode root;
+	const char *err;
+	int n;
+
+	if ((err = Device_open(&super->dev, image, O_RDONLY, devopts))) {
+		fprintf(stderr, "%s: cannot open %s (%s)\n", cmd, image, err);
+		exit(2);
+	}
+	if (cpmReadSuper(super, &root, format, 0) == -1) {
+		fprintf(stderr, "%s: cannot read superblock of %s (%s)\n", cmd, image, boo);
+		exit(2);
+	}
+	if ((n = cpmStatAll(&root, files)) == -1) {
+		fprintf(stderr, "%s: cannot read directory of %s (%s)\n", cmd, image, boo);
+		exit(2);
+	}
+	qsort(*files, n, sizeof(struct cpmDirStat), filecmp);
+	return n;
+}
+
+/*
+ * sameContent -- compare two files of equal size block by block
+ */
+static int sameContent(struct cpmInode *a, struct cpmInode *b) {
+	struct cpmFile fa, fb;
+	size_t len = a->sb->blksiz > b->sb->blksiz ? a->sb->blksiz : b->sb->blksiz;
+	char *bufa, *bufb;
+	ssize_t ra, rb;
+	int same = 1;
+
+	if ((bufa = malloc(2 * len)) == NULL) {
+		fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+		exit(2);
+	}
+	bufb = bufa + len;
+	cpmOpen(a, &fa, O_RDONLY);
+	cpmOpen(b, &fb, O_RDONLY);
+	do {
+		ra = cpmRead(&fa, bufa, len);
+		rb = cpmRead(&fb, bufb, len);
+		if (ra == -1 || rb == -1) {
+			fprintf(stderr, "%s: cannot read file (%s)\n", cmd, boo);
+			exit(2);
+		}
+		if (ra != rb || memcmp(bufa, bufb, ra)) {
+			same = 0;
+		}
+	} while (same && ra > 0);
+	cpmClose(&fa);
+	cpmClose(&fb);
+	free(bufa);
+	return same;
+}
+
+/*
+ * compare -- find what differs between two files, reading them only if
+ * the directory can not tell
+ */
+static int compare(struct cpmInode *a, struct cpmInode *b, int times) {
+	int diff = 0;
+
+	if (a->size != b->size) {
+		diff |= DIFF_SIZE;
+	}
+	if (a->attr != b->attr || a->mode != b->mode) {
+		diff |= DIFF_ATTR;
+	}
+	if (times && (a->mtime != b->mtime || a->atime != b->atime || a->ctime != b->ctime)) {
+		diff |= DIFF_TIME;
+	}
+	if (diff == 0 && a->size > 0 && !sameContent(a, b)) {
+		diff |= DIFF_CONTENT;
+	}
+	return diff;
+}
+
+/*
+ * putName -- print a file name as user:name, quoted for JSON if needed
+ */
+static void putName(const char *name) {
+	const char *s;
+
+	if (json) {
+		putchar('"');
+	}
+	printf("%d:", (name[0] - '0') * 10 + name[1] - '0');
+	for (s = name + 2; *s; ++s) {
+		if (json && (*s == '"' || *s == '\\')) {
+			putchar('\\');
+		}
+		if (json && (unsigned char)*s < ' ') {
+			printf("\\u%04x", (unsigned char)*s);
+		} else {
+			putchar(*s);
+		}
+	}
+	if (json) {
+		putchar('"');
+	}
+}
+
+/*
+ * report -- print an added (+), removed (-) or changed (M) file
+ */
+static void report(int status, const char *name, int diff) {
+	int i, n;
+
+	if (json) {
+		printf("%s\n  {\"status\": \"%s\", \"name\": ", entries ? "," : "",
+			status == '+' ? "added" : status == '-' ? "removed" : "changed");
+		putName(name);
+		if (status == 'M') {
+			printf(", \"differs\": [");
+			for (i = n = 0; i < 4; ++i) {
+				if (diff & (1 << i)) {
+					printf("%s\"%s\"", n++ ? ", " : "", diffName[i]);
+				}
+			}
+			putchar(']');
+		}
+		putchar('}');
+	} else {
+		printf("%c ", status);
+		putName(name);
+		for (i = 0; i < 4; ++i) {
+			if (diff & (1 << i)) {
+				printf(" %s", diffName[i]);
+			}
+		}
+		putchar('\n');
+	}
+	++entries;
+}
+
+int main(int argc, char *argv[]) {
+	const char *format, *format2 = NULL;
+	const char *devopts = NULL;
+	int c, usage = 0, times = 1;
+	struct cpmSuperBlock super1, super2;
+	struct cpmDirStat *files1, *files2;
+	int n1, n2, i1, i2;
+
+	if (!(format = getenv("CPMTOOLSFMT"))) {
+		format = FORMAT;
+	}
+	argc = cpmStatsArgs(argc, argv);
+	while ((c = getopt(argc, argv, "T:f:F:jth?")) != EOF) {
+		switch (c) {
+		case 'T':
+			devopts = optarg;
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 'F':
+			format2 = optarg;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 't':
+			times = 0;
+			break;
+		case 'h':
+		case '?':
+			usage = 1;
+			break;
+		}
+	}
+	if (optind != (argc - 2)) {
+		usage = 1;
+	}
+
+	if (usage) {
+		fprintf(stderr, "Usage: %s [-f format] [-F format] [-j] [-t] image1 image2\n", cmd);
+		exit(2);
+	}
+	n1 = mount(&super1, argv[optind], format, devopts, &files1);
+	n2 = mount(&super2, argv[optind + 1], format2 ? format2 : format, devopts, &files2);
+
+	/* both lists are sorted, so one pass matches them */
+	if (json) {
+		putchar('[');
+	}
+	for (i1 = i2 = 0; i1 < n1 || i2 < n2;) {
+		int cmp = (i1 == n1 ? 1 : i2 == n2 ? -1 : strcmp(files1[i1].name, files2[i2].name));
+
+		if (cmp < 0) {
+			report('-', files1[i1++].name, 0);
+		} else if (cmp > 0) {
+			report('+', files2[i2++].name, 0);
+		} else {
+			int diff = compare(&files1[i1].ino, &files2[i2].ino, times);
+
+			if (diff) {
+				report('M', files1[i1].name, diff);
+			}
+			++i1;
+			++i2;
+		}
+	}
+	if (json) {
+		printf("%s]\n", entries ? "\n" : "");
+	}
+	free(files1);
+	free(files2);
+	cpmUmount(&super1);
+	cpmUmount(&super2);
+	exit(entries ? 1 : 0);
+}
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -47,6 +48,9 @@
 char const *boo;
 static mode_t s_ifdir = 1;
 static mode_t s_ifreg = 1;
+static int statsFormat; /* statistics asked for on the command line, 2 for JSON */
+static FILE *traceFile;  /* Chrome trace events go here if CPMTOOLS_TRACE is set */
+static time_t fixedClock; /* the time of all changes if set by cpmSetClock */
 extern int autoReadSuper(struct cpmSuperBlock *d, char const *format);
 
 /* "inline" avoids the "defined but not used" warning */
@@ -130,6 +134,29 @@ static int splitFilename(char const *fullname, int type,
 	return 0;
 }
 
+/*
+ * unixName -- convert the name of a directory entry to UNIX style
+ */
+static int unixName(const struct cpmSuperBlock *sb, const struct PhysDirectoryEntry *cur, char *buf) {
+	char *bufp;
+	int i, hasext;
+
+	buf[0] = '0' + cur->status / 10;
+	buf[1] = '0' + cur->status % 10;
+	for (bufp = buf + 2, i = 0; i < 8 && (cur->name[i] & 0x7f) != ' '; ++i) {
+		*bufp++ = sb->uppercase ? cur->name[i] & 0x7f : tolower(cur->name[i] & 0x7f);
+	}
+	for (hasext = 0, i = 0; i < 3 && (cur->ext[i] & 0x7f) != ' '; ++i) {
+		if (!hasext) {
+			*bufp++ = '.';
+			hasext = 1;
+		}
+		*bufp++ = sb->uppercase ? cur->ext[i] & 0x7f : tolower(cur->ext[i] & 0x7f);
+	}
+	*bufp = '\0';
+	return bufp - buf;
+}
+
 /*
  * isMatching -- do two file names match?
  */
@@ -288,6 +315,17 @@ static void unix2ds_time(time_t now, struct dsEntry *entry) {
 	}
 }
 
+/*
+ * clockTime -- the time of a change
+ */
+static void clockTime(time_t *t) {
+	if (fixedClock) {
+		*t = fixedClock;
+	} else {
+		time(t);
+	}
+}
+
 /* allocation vector bitmap functions */
 
 /*
@@ -297,6 +335,9 @@ static void alvInit(const struct cpmSuperBlock *d) {
 	int i, j, offset, block;
 
 	assert(d != NULL);
+	if (d->stats) {
+		++d->stats->alvInits;
+	}
 	/* clean bitmap */
 	memset(d->alv, 0, d->alvSize * sizeof(int));
 
@@ -366,9 +407,9 @@ static int allocBlock(const struct cpmSuperBlock *drive) {
 /* logical block I/O */
 
 /*
- * readBlock -- read a (partial) block
+ * queueReadBlock -- queue reading a (partial) block
  */
-static int readBlock(const struct cpmSuperBlock *d, int blockno,
+static int queueReadBlock(const struct cpmSuperBlock *d, int blockno,
 				unsigned char *buffer, int start, int end) {
 	int sect, track, counter;
 
@@ -397,7 +438,7 @@ static int readBlock(const struct cpmSuperBlock *d, int blockno,
 #ifdef CPMFS_DEBUG
 			fprintf(stderr, "readBlock: read sector %d/%d\n", d->skewtab[sect], track);
 #endif
-			err = Device_readSector(&d->dev, track, d->skewtab[sect],
+			err = Device_queueRead(&d->dev, track, d->skewtab[sect],
 					buffer + (d->secLength * counter));
 			if (err) {
 				boo = err;
@@ -414,9 +455,9 @@ static int readBlock(const struct cpmSuperBlock *d, int blockno,
 }
 
 /*
- * writeBlock -- write a (partial) block
+ * queueWriteBlock -- queue writing a (partial) block
  */
-static int writeBlock(const struct cpmSuperBlock *d, int blockno,
+static int queueWriteBlock(const struct cpmSuperBlock *d, int blockno,
 			const unsigned char *buffer, int start, int end) {
 	int sect, track, counter;
 
@@ -436,7 +477,7 @@ static int writeBlock(const struct cpmSuperBlock *d, int blockno,
 		char const *err;
 
 		if (counter >= start) {
-			err = Device_writeSector(&d->dev, track, d->skewtab[sect],
+			err = Device_queueWrite(&d->dev, track, d->skewtab[sect],
 					buffer + (d->secLength * counter));
 			if (err) {
 				boo = err;
@@ -452,6 +493,127 @@ static int writeBlock(const struct cpmSuperBlock *d, int blockno,
 	return 0;
 }
 
+/*
+ * Tracing writes one Chrome Trace Event ("ph": "X") per call of the traced
+ * functions, to be loaded into chrome://tracing or Perfetto.  When it is
+ * off, a traced call costs one test of traceFile.
+ */
+#define TRACE_START() (traceFile ? Device_clock() : 0)
+
+/*
+ * traceString -- write a JSON string
+ */
+static void traceString(const char *s) {
+	putc('"', traceFile);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(traceFile, "\\%c", *s);
+		} else if ((unsigned char)*s < ' ') {
+			fprintf(traceFile, "\\u%04x", (unsigned char)*s);
+		} else {
+			putc(*s, traceFile);
+		}
+	}
+	putc('"', traceFile);
+}
+
+/*
+ * traceSpan -- write the event of a call that began at start
+ */
+static void traceSpan(const char *name, long long start, const char *file, const char *args, ...) {
+	long long end = Device_clock();
+	va_list ap;
+
+	fprintf(traceFile, ",\n{\"name\": \"%s\", \"cat\": \"cpmfs\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1, \"args\": {",
+		name, start / 1e3, (end - start) / 1e3);
+	if (file) {
+		fputs("\"file\": ", traceFile);
+		traceString(file);
+		fputs(", ", traceFile);
+	}
+	va_start(ap, args);
+	vfprintf(traceFile, args, ap);
+	va_end(ap);
+	fputs("}}", traceFile);
+}
+
+/*
+ * traceClose -- end the trace at exit
+ */
+static void traceClose(void) {
+	fputs("\n]\n", traceFile);
+	fclose(traceFile);
+	traceFile = NULL;
+}
+
+/*
+ * traceInit -- start tracing if CPMTOOLS_TRACE names a file
+ */
+static void traceInit(void) {
+	static int tried;
+	const char *env;
+
+	if (tried) {
+		return;
+	}
+	tried = 1;
+	if ((env = getenv("CPMTOOLS_TRACE")) == NULL || *env == '\0') {
+		return;
+	}
+	if ((traceFile = fopen(env, "w")) == NULL) {
+		fprintf(stderr, "%s: can not open trace file %s: %s\n", cmd, env, strerror(errno));
+		return;
+	}
+	fputs("[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": ", traceFile);
+	traceString(cmd);
+	fputs("}}", traceFile);
+	atexit(traceClose);
+}
+
+/*
+ * completeBlocks -- wait for all queued block transfers
+ */
+static int completeBlocks(const struct cpmSuperBlock *d, int status) {
+	char const *err;
+
+	err = Device_complete(&d->dev);
+	if (err && status == 0) {
+		boo = err;
+		return -1;
+	}
+	return status;
+}
+
+/*
+ * readBlock -- read a (partial) block
+ */
+static int readBlock(const struct cpmSuperBlock *d, int blockno,
+				unsigned char *buffer, int start, int end) {
+	long long t = TRACE_START();
+	int res;
+
+	res = completeBlocks(d, queueReadBlock(d, blockno, buffer, start, end));
+	if (traceFile) {
+		traceSpan("readBlock", t, NULL, "\"block\": %d, \"start\": %d, \"end\": %d, \"result\": %d", blockno, start, end, res);
+	}
+	return res;
+}
+
+/*
+ * writeBlock -- write a (partial) block
+ */
+static int writeBlock(const struct cpmSuperBlock *d, int blockno,
+			const unsigned char *buffer, int start, int end) {
+	long long t = TRACE_START();
+	int res;
+
+	res = completeBlocks(d, queueWriteBlock(d, blockno, buffer, start, end));
+	if (traceFile) {
+		traceSpan("writeBlock", t, NULL, "\"block\": %d, \"start\": %d, \"end\": %d, \"result\": %d", blockno, start, end, res);
+	}
+	return res;
+}
+
 /* directory management */
 
 /*
@@ -460,6 +622,10 @@ static int writeBlock(const struct cpmSuperBlock *d, int blockno,
 static int findFileExtent(const struct cpmSuperBlock *sb, int user,
 			unsigned char const *name, unsigned char const *ext,
 			int start, int extno) {
+	if (sb->stats) {
+		++sb->stats->findFileExtentCalls;
+		sb->stats->entriesScanned -= start;
+	}
 	boo = "file already exists";
 	for (; start < sb->maxdir; ++start) {
 		if (((unsigned char)sb->dir[start].status) <= (sb->type & CPMFS_HI_USER ? 31 : 15) &&
@@ -468,9 +634,15 @@ static int findFileExtent(const struct cpmSuperBlock *sb, int user,
 				sb->extents) == (extno / sb->extents)) &&
 			isMatching(user, name, ext, sb->dir[start].status,
 				sb->dir[start].name, sb->dir[start].ext)) {
+			if (sb->stats) {
+				sb->stats->entriesScanned += start + 1;
+			}
 			return start;
 		}
 	}
+	if (sb->stats) {
+		sb->stats->entriesScanned += start;
+	}
 	boo = "file not found";
 	return -1;
 }
@@ -577,9 +749,9 @@ static void updateDsStamps(const struct cpmInode *ino, int extent) {
 }
 
 /*
- * readTimeStamps -- read CP/M time stamp
+ * readTimeStamps -- read CP/M time stamp, MP/M ones from the XFCB if not -1
  */
-static int readTimeStamps(struct cpmInode *i, int lowestExt) {
+static int readTimeStamps(struct cpmInode *i, int lowestExt, int xfcb) {
 	struct PhysDirectoryEntry *date;
 	int protectMode = 0;
 	time_t xtime = 0;
@@ -604,15 +776,11 @@ static int readTimeStamps(struct cpmInode *i, int lowestExt) {
 			protectMode = (unsigned char)date->pointers[13];
 			break;
 		}
-	} else if (i->sb->type & CPMFS_MPM_DATES) {
-		int x = findFileExtent(i->sb, i->sb->dir[i->ino].status + 16,
-			i->sb->dir[i->ino].name, i->sb->dir[i->ino].ext, 0, -1);
-		if (x != -1) {
-			date = i->sb->dir + x;
-			xtime = getCpmStampField(&date->pointers[8]);
-			i->mtime = getCpmStampField(&date->pointers[12]);
-			protectMode = (unsigned char)date->extnol;
-		}
+	} else if ((i->sb->type & CPMFS_MPM_DATES) && xfcb != -1) {
+		date = i->sb->dir + xfcb;
+		xtime = getCpmStampField(&date->pointers[8]);
+		i->mtime = getCpmStampField(&date->pointers[12]);
+		protectMode = (unsigned char)date->extnol;
 	}
 	if (i->sb->cnotatime) {
 		i->ctime = xtime;
@@ -642,111 +810,237 @@ static void readDsStamps(struct cpmInode *i, int lowestExt) {
 }
 
 /*
- * match -- match filename against a pattern
+ * cpmPatternCompile -- compile a wildcard pattern for cpmPatternMatch
+ *
+ * Patterns are matched against the names cpmReaddir returns, which start
+ * with two digits of user number.  Without a user number ("x:" or "xx:")
+ * any user matches.  A pattern of the form name.ext, where a '*' may only
+ * end a field, is compiled into a template of the 8+3 fields of the name,
+ * much like a wildcard FCB; any other pattern is matched as a whole.
  */
-static int recmatch(char const *a, char const *pattern) {
-	int first = 1;
+void cpmPatternCompile(struct cpmPattern *p, char const *pattern) {
+	char const *dot;
+	int i, j, len;
 
-	assert(a);
+	assert(p);
 	assert(pattern);
-	while (*pattern) {
-		switch (*pattern) {
-		case '*':
-			if (*a == '.' && first) {
-				return 1;
-			}
-			++pattern;
-			while (*a) {
-				if (recmatch(a, pattern)) {
-					return 1;
-				} else {
-					++a;
-				}
-			}
-			break;
-		case '?':
-			if (*a) {
-				++a;
-				++pattern;
-			} else {
-				return 0;
+	assert(strlen(pattern) < 255);
+	if (isdigit(*pattern) && *(pattern + 1) == ':') {
+		p->user[0] = '0';
+		p->user[1] = *pattern;
+		pattern += 2;
+	} else if (isdigit(*pattern) && isdigit(*(pattern + 1)) && *(pattern + 2) == ':') {
+		p->user[0] = *pattern;
+		p->user[1] = *(pattern + 1);
+		pattern += 3;
+	} else {
+		p->user[0] = p->user[1] = '?';
+	}
+	for (i = 0; pattern[i]; ++i) {
+		p->glob[i] = tolower(pattern[i]);
+	}
+	p->glob[i] = '\0';
+
+	/* try to compile a field template */
+	p->fields = 0;
+	if ((dot = strchr(p->glob, '.')) == NULL || strchr(dot + 1, '.')) {
+		return;
+	}
+	memset(p->field, '\0', sizeof(p->field));
+	for (j = 0; j < 2; ++j) {
+		char const *f = (j == 0 ? p->glob : dot + 1);
+		int width = (j == 0 ? 8 : 3);
+
+		len = (j == 0 ? dot - p->glob : (int)strlen(dot + 1));
+		for (i = 0; i < len; ++i) {
+			if (f[i] == '*' && i != len - 1) {
+				return;
 			}
-			break;
-		default:
-			if (tolower(*a) == tolower(*pattern)) {
-				++a;
-				++pattern;
-			} else {
-				return 0;
+		}
+		if ((len && f[len - 1] == '*' ? len - 1 : len) > width) {
+			return;
+		}
+		memcpy(p->field + (j == 0 ? 0 : 8), f, len > width ? width : len);
+	}
+	p->fields = 1;
+}
+
+/*
+ * fieldMatch -- match one field of a name against its template
+ */
+static int fieldMatch(char const *t, int width, char const *s, int len) {
+	int i;
+
+	for (i = 0; i < width; ++i) {
+		if (t[i] == '*') {
+			return 1;
+		}
+		if (t[i] == '\0') {
+			return i == len;
+		}
+		if (i >= len || (t[i] != '?' && t[i] != tolower(s[i]))) {
+			return 0;
+		}
+	}
+	return len == width;
+}
+
+/*
+ * globMatch -- match a name against a whole pattern
+ */
+static int globMatch(char const *s, char const *p) {
+	char const *star = NULL, *resume = NULL;
+
+	while (*s) {
+		if (*p == '*') {
+			/* as always, "**" takes the rest of a name with a dot */
+			if (p[1] == '*' && strchr(s, '.')) {
+				return 1;
 			}
+			star = ++p;
+			resume = s;
+		} else if (*p && (*p == '?' || *p == tolower(*s))) {
+			++p;
+			++s;
+		} else if (star) {
+			p = star;
+			s = ++resume;
+		} else {
+			return 0;
 		}
-		first = 0;
 	}
-	return (*pattern == '\0' && *a == '\0');
+	while (*p == '*') {
+		++p;
+	}
+	return (*p == '\0');
 }
 
-int match(char const *a, char const *pattern) {
-	int user;
-	char pat[257];
+/*
+ * cpmPatternMatch -- match a file name against a compiled pattern
+ */
+int cpmPatternMatch(const struct cpmPattern *p, char const *name) {
+	char const *dot;
 
-	assert(a);
-	assert(pattern);
-	assert(strlen(pattern) < 255);
-	if (isdigit(*pattern) && *(pattern + 1) == ':') {
-		user = (*pattern - '0');
-		pattern += 2;
-	} else if (isdigit(*pattern) && isdigit(*(pattern + 1)) && *(pattern + 2) == ':') {
-		user = (10 * (*pattern - '0') + (*(pattern + 1) - '0'));
-		pattern += 3;
-	} else {
-		user = -1;
+	assert(p);
+	assert(name);
+	if (name[0] == '\0' || name[1] == '\0'
+		|| (p->user[0] != '?' && (name[0] != p->user[0] || name[1] != p->user[1]))) {
+		return 0;
 	}
-	if (user == -1) {
-		sprintf(pat, "??%s", pattern);
-	} else {
-		sprintf(pat, "%02d%s", user, pattern);
+	name += 2;
+	if (p->fields && (dot = strchr(name, '.')) != NULL && strchr(dot + 1, '.') == NULL
+		&& dot - name <= 8 && strlen(dot + 1) <= 3) {
+		return fieldMatch(p->field, 8, name, dot - name)
+			&& fieldMatch(p->field + 8, 3, dot + 1, strlen(dot + 1));
+	} else if (p->fields && dot == NULL) {
+		return 0;
 	}
-	return recmatch(a, pat);
+	return globMatch(name, p->glob);
+}
+
+/*
+ * match -- match filename against a pattern
+ */
+int match(char const *a, char const *pattern) {
+	struct cpmPattern p;
+
+	cpmPatternCompile(&p, pattern);
+	return cpmPatternMatch(&p, a);
 }
 
 
 /*
  * cpmglob -- expand CP/M style wildcards
+ *
+ * The directory is read once and every name is matched against all
+ * patterns.  The names are returned in the order of the patterns and in
+ * one allocation, which cpmglobfree releases.
  */
 void cpmglob(int optin, int argc, char *const argv[], struct cpmInode *root,
 					int *gargc, char ***gargv) {
-	struct cpmFile dir;
-	int entries, dirsize = 0;
-	struct cpmDirent *dirent = NULL;
-	int gargcap = 0, i, j;
+	static const char *const special[] = { ".", "..", "[passwd]", "[label]" };
+	int entries, files;
+	struct cpmDirStat *dirent;
+	const char **entry;
+	struct cpmPattern *pattern;
+	int patterns, hits = 0, hitcap = 0, i, j;
+	int *hit = NULL, *first;
+	char **name, **result, *arena;
+	size_t bytes = 0;
 
 	*gargv = NULL;
 	*gargc = 0;
-	cpmOpendir(root, &dir);
+	patterns = (argc > optin ? argc - optin : 0);
+	if (patterns == 0) {
+		return;
+	}
+	pattern = malloc(sizeof(struct cpmPattern) * patterns);
+	for (i = 0; i < patterns; ++i) {
+		cpmPatternCompile(&pattern[i], argv[optin + i]);
+	}
+
+	/* the names cpmReaddir would return */
+	if ((files = cpmStatAll(root, &dirent)) == -1) {
+		files = 0;
+	}
+	entry = malloc(sizeof(char *) * (files + 4));
 	entries = 0;
-	dirsize = 8;
-	dirent = malloc(sizeof(struct cpmDirent) * dirsize);
-	while (cpmReaddir(&dir, &dirent[entries])) {
-		++entries;
-		if (entries == dirsize) {
-			dirent = realloc(dirent, sizeof(struct cpmDirent) * (dirsize *= 2));
-		}
-	}
-	for (i = optin; i < argc; ++i) {
-		int found;
-
-		for (j = 0, found = 0; j < entries; ++j) {
-			if (match(dirent[j].name, argv[i])) {
-				if (*gargc == gargcap) {
-					*gargv = realloc(*gargv, sizeof(char *) *
-						(gargcap ? (gargcap *= 2) : (gargcap = 16)));
+	entry[entries++] = special[0];
+	entry[entries++] = special[1];
+	if (root->sb->passwdLength) {
+		entry[entries++] = special[2];
+	}
+	if (root->sb->labelLength) {
+		entry[entries++] = special[3];
+	}
+	for (j = 0; j < files; ++j) {
+		entry[entries++] = dirent[j].name;
+	}
+
+	/* one pass over the directory, hit collects pattern and entry pairs */
+	first = calloc(patterns + 1, sizeof(int));
+	name = calloc(entries + 1, sizeof(char *));
+	for (j = 0; j < entries; ++j) {
+		for (i = 0; i < patterns; ++i) {
+			if (cpmPatternMatch(&pattern[i], entry[j])) {
+				if (hits == hitcap) {
+					hit = realloc(hit, sizeof(int) * 2 * (hitcap ? (hitcap *= 2) : (hitcap = 16)));
 				}
-				(*gargv)[*gargc] = strcpy(malloc(strlen(dirent[j].name) + 1), dirent[j].name);
-				++*gargc;
-				++found;
+				hit[2 * hits] = i;
+				hit[2 * hits + 1] = j;
+				++hits;
+				++first[i + 1];
+				if (name[j] == NULL) {
+					name[j] = (char *)entry[j];
+					bytes += strlen(entry[j]) + 1;
+				}
+			}
+		}
+	}
+	if (hits) {
+		/* the pointers sorted by pattern, followed by each name once */
+		result = malloc(sizeof(char *) * hits + bytes);
+		arena = (char *)(result + hits);
+		for (i = 0; i < patterns; ++i) {
+			first[i + 1] += first[i];
+		}
+		for (j = 0; j < hits; ++j) {
+			int e = hit[2 * j + 1];
+
+			if (name[e] == entry[e]) {
+				name[e] = strcpy(arena, entry[e]);
+				arena += strlen(arena) + 1;
 			}
+			result[first[hit[2 * j]]++] = name[e];
 		}
+		*gargv = result;
+		*gargc = hits;
 	}
+	free(hit);
+	free(name);
+	free(first);
+	free(pattern);
+	free(entry);
 	free(dirent);
 }
 
@@ -754,16 +1048,11 @@ void cpmglob(int optin, int argc, char *const argv[], struct cpmInode *root,
  * cpmglobfree -- free expanded wildcards
  */
 void cpmglobfree(char **dirent, int entries) {
-	int d;
-
 	if (!entries) {
 		return;
 	}
 	assert(dirent);
 	assert(entries > 0);
-	for (d = 0; d < entries; ++d) {
-		free(dirent[d]);
-	}
 	free(dirent);
 }
 
@@ -1081,11 +1370,14 @@ int cpmCheckDs(struct cpmSuperBlock *sb) {
 	/* Read ds file in its entirety */
 	off = 0;
 	for (i = dsoffset; i < dsoffset + dsblks; i++) {
-		if (readBlock(sb, i, ((unsigned char *)sb->ds) + off, 0, -1) == -1) {
-			return -1;
+		if (queueReadBlock(sb, i, ((unsigned char *)sb->ds) + off, 0, -1) == -1) {
+			break;
 		}
 		off += sb->blksiz;
 	}
+	if (completeBlocks(sb, i < dsoffset + dsblks ? -1 : 0) == -1) {
+		return -1;
+	}
 
 	/* Verify checksums */
 	buf = (unsigned char *)sb->ds;
@@ -1108,10 +1400,86 @@ int cpmCheckDs(struct cpmSuperBlock *sb) {
 	return 0;
 }
 
+/*
+ * cpmStatsArgs -- take --stats and --stats=json out of the arguments
+ */
+int cpmStatsArgs(int argc, char *argv[]) {
+	int i, j;
+
+	for (i = j = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--stats") == 0) {
+			statsFormat = 1;
+		} else if (strcmp(argv[i], "--stats=json") == 0) {
+			statsFormat = 2;
+		} else {
+			if (strcmp(argv[i], "--") == 0) {
+				while (i < argc) {
+					argv[j++] = argv[i++];
+				}
+				break;
+			}
+			argv[j++] = argv[i];
+		}
+	}
+	argv[j] = NULL;
+	return j;
+}
+
+/*
+ * statsInit -- start counting if asked for
+ */
+static void statsInit(struct cpmSuperBlock *d) {
+	const char *env;
+	int format = statsFormat;
+
+	d->stats = NULL;
+	if (format == 0 && (env = getenv("CPMTOOLS_STATS")) && *env && strcmp(env, "0")) {
+		format = (strcmp(env, "json") == 0 ? 2 : 1);
+	}
+	if (format == 0 || (d->stats = malloc(sizeof(struct cpmStats))) == NULL) {
+		return;
+	}
+	memset(d->stats, 0, sizeof(struct cpmStats));
+	d->stats->json = (format == 2);
+	d->stats->start = Device_clock();
+	d->dev.stats = &d->stats->dev;
+}
+
+/*
+ * statsReport -- print the statistics on stderr
+ */
+static void statsReport(const struct cpmSuperBlock *sb, unsigned long hits, unsigned long misses) {
+	const struct cpmStats *s = sb->stats;
+	double io, core;
+
+	io = s->dev.ioNanos / 1e6;
+	core = (Device_clock() - s->start) / 1e6 - io;
+	if (s->json) {
+		fprintf(stderr, "{\"tool\": \"%s\", \"sector_reads\": %lu, \"sector_writes\": %lu, "
+			"\"bytes_read\": %llu, \"bytes_written\": %llu, \"device_syscalls\": %lu, "
+			"\"cache_hits\": %lu, \"cache_misses\": %lu, "
+			"\"find_file_extent_calls\": %lu, \"entries_scanned\": %lu, \"alv_inits\": %lu, "
+			"\"directory_syncs\": %lu, \"ds_syncs\": %lu, \"io_ms\": %.3f, \"core_ms\": %.3f}\n",
+			cmd, s->dev.reads, s->dev.writes, s->dev.bytesRead, s->dev.bytesWritten, s->dev.syscalls,
+			hits, misses, s->findFileExtentCalls, s->entriesScanned, s->alvInits,
+			s->dirSyncs, s->dsSyncs, io, core);
+		return;
+	}
+	fprintf(stderr, "%s: %lu sector reads (%llu bytes), %lu sector writes (%llu bytes), %lu device system calls\n",
+		cmd, s->dev.reads, s->dev.bytesRead, s->dev.writes, s->dev.bytesWritten, s->dev.syscalls);
+	fprintf(stderr, "%s: sector cache %lu hits, %lu misses\n", cmd, hits, misses);
+	fprintf(stderr, "%s: %lu findFileExtent calls scanning %lu entries, %lu alvInit\n",
+		cmd, s->findFileExtentCalls, s->entriesScanned, s->alvInits);
+	fprintf(stderr, "%s: %lu directory and %lu DateStamper syncs\n", cmd, s->dirSyncs, s->dsSyncs);
+	fprintf(stderr, "%s: %.3f ms device I/O, %.3f ms core\n", cmd, io, core);
+}
+
 /*
  * cpmReadSuper -- get DPB and init in-core data for drive
  */
 int cpmReadSuper(struct cpmSuperBlock *d, struct cpmInode *root, char const *format, int uppercase) {
+	traceInit();
+	statsInit(d);
 	while (s_ifdir && !S_ISDIR(s_ifdir)) {
 		s_ifdir <<= 1;
 	}
@@ -1201,11 +1569,14 @@ int cpmReadSuper(struct cpmSuperBlock *d, struct cpmInode *root, char const *for
 		blocks = (d->maxdir * 32 + d->blksiz - 1) / d->blksiz;
 		entry = 0;
 		for (i = 0; i < blocks; ++i) {
-			if (readBlock(d, i, (unsigned char *)(d->dir + entry), 0, -1) == -1) {
-				return -1;
+			if (queueReadBlock(d, i, (unsigned char *)(d->dir + entry), 0, -1) == -1) {
+				break;
 			}
 			entry += (d->blksiz / 32);
 		}
+		if (completeBlocks(d, i < blocks ? -1 : 0) == -1) {
+			return -1;
+		}
 	}
 
 	alvInit(d);
@@ -1329,6 +1700,10 @@ static int syncDs(const struct cpmSuperBlock *sb) {
 		int dsoffset, dsblks, dsrecs, off, i;
 		unsigned char *buf;
 
+		if (sb->stats) {
+			++sb->stats->dsSyncs;
+		}
+
 		dsrecs = (sb->maxdir + 7) / 8;
 
 		/* Re-calculate checksums */
@@ -1347,44 +1722,84 @@ static int syncDs(const struct cpmSuperBlock *sb) {
 
 		off = 0;
 		for (i = dsoffset; i < dsoffset + dsblks; i++) {
-			if (writeBlock(sb, i, ((unsigned char *)(sb->ds)) + off, 0, -1) == -1) {
-				return -1;
+			if (queueWriteBlock(sb, i, ((unsigned char *)(sb->ds)) + off, 0, -1) == -1) {
+				break;
 			}
 			off += sb->blksiz;
 		}
+		if (completeBlocks(sb, i < dsoffset + dsblks ? -1 : 0) == -1) {
+			return -1;
+		}
 	}
 	return 0;
 }
 
 /*
- * cpmSync -- write directory back
+ * syncSuper -- write directory back
  */
-int cpmSync(struct cpmSuperBlock *sb) {
+static int syncSuper(struct cpmSuperBlock *sb) {
+	char const *err;
+
 	if (sb->dirtyDirectory) {
 		int i, blocks, entry;
 
+		if (sb->stats) {
+			++sb->stats->dirSyncs;
+		}
 		blocks = (sb->maxdir * 32 + sb->blksiz - 1) / sb->blksiz;
 		entry = 0;
 		for (i = 0; i < blocks; ++i) {
-			if (writeBlock(sb, i, (unsigned char *)(sb->dir + entry), 0, -1) == -1) {
-				return -1;
+			if (queueWriteBlock(sb, i, (unsigned char *)(sb->dir + entry), 0, -1) == -1) {
+				break;
 			}
 			entry += (sb->blksiz / 32);
 		}
+		if (completeBlocks(sb, i < blocks ? -1 : 0) == -1) {
+			return -1;
+		}
 		sb->dirtyDirectory = 0;
 	}
 	if (sb->type & CPMFS_DS_DATES) {
 		syncDs(sb);
 	}
+	err = Device_sync(&sb->dev);
+	if (err) {
+		boo = err;
+		return -1;
+	}
 	return 0;
 }
 
+/*
+ * cpmSync -- write directory back
+ */
+int cpmSync(struct cpmSuperBlock *sb) {
+	long long t = TRACE_START();
+	int dirty = sb->dirtyDirectory, res;
+
+	res = syncSuper(sb);
+	if (traceFile) {
+		traceSpan("cpmSync", t, NULL, "\"dirty\": %d, \"result\": %d", dirty, res);
+	}
+	return res;
+}
+
 /*
  * cpmUmount -- free super block
  */
 void cpmUmount(struct cpmSuperBlock *sb) {
-	cpmSync(sb);
-	Device_close(&sb->dev);
+	unsigned long hits = 0, misses = 0;
+
+	/* without a device, as for mkfs.cpm, there is nothing to write */
+	if (sb->dev.opened) {
+		cpmSync(sb);
+		Device_cacheStats(&sb->dev, &hits, &misses);
+		Device_close(&sb->dev);
+	}
+	if (sb->stats) {
+		statsReport(sb, hits, misses);
+		free(sb->stats);
+	}
 	if (sb->type & CPMFS_DS_DATES) {
 		free(sb->ds);
 	}
@@ -1396,126 +1811,199 @@ void cpmUmount(struct cpmSuperBlock *sb) {
 	}
 }
 
+/*
+ * cpmSetClock -- use a fixed time for all changes, 0 for the current time
+ */
+void cpmSetClock(time_t t) {
+	fixedClock = t;
+}
+
+/*
+ * formatRecord -- where a 128 byte record of the data area is in the system area
+ */
+static unsigned char *formatRecord(const struct cpmSuperBlock *drive, unsigned char *area, long record) {
+	long n = drive->sectrk * drive->boottrk + record * 128 / drive->secLength;
+
+	return area + ((n / drive->sectrk) * drive->sectrk + drive->skewtab[n % drive->sectrk]) * (long)drive->secLength
+		+ record * 128 % drive->secLength;
+}
 
 /*
- * cpmNamei -- map name to inode
+ * cpmFormat -- make the system area of a new file system
+ *
+ * drive has the geometry of its format, as read by cpmReadSuper without
+ * a device.  The system area is the image from its offset on: boottrk
+ * tracks of bootTracks and a directory of free entries, in whole tracks,
+ * returned in a buffer of *length bytes that the caller writes and frees.
+ * CP/M 3 file systems get a label.  With timeStamps, CP/M 3 and P2DOS
+ * directories get time stamp entries; other file systems get the
+ * !!!TIME&.DAT file of DateStamper in the blocks after the directory.
  */
-int cpmNamei(const struct cpmInode *dir, char const *filename, struct cpmInode *i) {
-	/* variables */
-	int user;
-	unsigned char name[8], extension[3];
-	int highestExtno, highestExt = -1, lowestExtno, lowestExt = -1;
-	int protectMode = 0;
-	int extent;
-	int block;
+unsigned char *cpmFormat(const struct cpmSuperBlock *drive, const char *label, const char *bootTracks, int timeStamps, size_t *length) {
+	unsigned char rec[128], *area, *e;
+	size_t trkbytes, bytes, i;
+	int ds, dsoffset = 0, dsrecs = 0, dsblks = 0;
+
+	ds = (timeStamps && !(drive->type == CPMFS_P2DOS || drive->type == CPMFS_DR3));
+	bytes = drive->maxdir * 32;
+	if (ds) {
+		/* as cpmCheckDs finds them */
+		dsoffset = (drive->maxdir * 32 + (drive->blksiz - 1)) / drive->blksiz;
+		dsrecs = (drive->maxdir + 7) / 8;
+		dsblks = (dsrecs * 128 + (drive->blksiz - 1)) / drive->blksiz;
+		if (dsblks > (drive->size > 256 ? 8 : 16)) {
+			boo = "directory too large for DateStamper";
+			return NULL;
+		}
+		bytes = (size_t)(dsoffset + dsblks) * drive->blksiz;
+	}
+	trkbytes = (size_t)drive->secLength * drive->sectrk;
+	*length = ((bytes + trkbytes - 1) / trkbytes + drive->boottrk) * trkbytes;
+	if ((area = malloc(*length)) == NULL) {
+		boo = strerror(errno);
+		return NULL;
+	}
+
+	/* boot tracks, then every record a free directory entry */
+	memcpy(area, bootTracks, trkbytes * drive->boottrk);
+	memset(rec, 0xe5, 128);
+	if (timeStamps && (drive->type == CPMFS_P2DOS || drive->type == CPMFS_DR3)) {
+		rec[3 * 32] = 0x21;
+	}
+	for (i = trkbytes * drive->boottrk; i < *length; i += 128) {
+		memcpy(area + i, rec, 128);
+	}
+
+	e = formatRecord(drive, area, 0);
+	if (drive->type == CPMFS_DR3) {
+		e[0] = 0x20;
+		for (i = 0; i < 11 && *label; ++i, ++label) {
+			e[1 + i] = toupper(*label & 0x7f);
+		}
+		while (i < 11) {
+			e[1 + i++] = ' ';
+		}
+		e[12] = timeStamps ? 0x11 : 0x01; /* label set and first time stamp is creation date */
+		memset(&e[13], 0, 1 + 2 + 8);
+		if (timeStamps) {
+			time_t now;
+			int min, hour, days;
+
+			/* Stamp label. */
+			clockTime(&now);
+			unix2cpm_time(now, &days, &hour, &min);
+			e[24] = e[28] = days & 0xff;
+			e[25] = e[29] = days >> 8;
+			e[26] = e[30] = hour;
+			e[27] = e[31] = min;
+		}
+	}
+	if (ds) {
+		static const char sig[] = "!!!TIME";
+		long first = (long)dsoffset * drive->blksiz / 128;
+		int j, k, last = (dsrecs * 128 - 1) / 16384;
+
+		/* the first directory entry is the file with the records after the directory */
+		struct PhysDirectoryEntry *f = (struct PhysDirectoryEntry *)e;
+
+		memset(f, 0, 32);
+		memcpy(f->name, "!!!TIME&", 8);
+		memcpy(f->ext, "DAT", 3);
+		f->extnol = EXTENTL(last);
+		f->extnoh = EXTENTH(last);
+		f->blkcnt = ((dsrecs * 128 - 1) % 16384) / 128 + 1;
+		for (j = 0; j < dsblks; ++j) {
+			if (drive->size > 256) {
+				f->pointers[2 * j] = (dsoffset + j) & 0xff;
+				f->pointers[2 * j + 1] = (dsoffset + j) >> 8;
+			} else {
+				f->pointers[j] = dsoffset + j;
+			}
+		}
+		for (j = 0; j < dsblks * drive->blksiz / 128; ++j) {
+			unsigned char *r = formatRecord(drive, area, first + j);
+			unsigned cksum = 0;
 
-#ifdef CPMFS_DEBUG
-	fprintf(stderr, "cpmNamei: map %s\n", filename);
-#endif
-	if (!S_ISDIR(dir->mode)) {
-		boo = "No such file";
-		return -1;
+			memset(r, 0, 128);
+			if (j >= dsrecs) {
+				continue;
+			}
+			for (k = 0; k < 7; ++k) {
+				r[15 + 16 * k] = sig[k];
+			}
+			for (k = 0; k < 127; ++k) {
+				cksum += r[k];
+			}
+			r[127] = cksum & 0xff;
+		}
 	}
-	if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) /* root directory */ {
-		*i = *dir;
-		return 0;
-	} else if (strcmp(filename, "[passwd]") == 0 && dir->sb->passwdLength) /* access passwords */ {
-		i->attr = 0;
-		i->ino = dir->sb->maxdir + 1;
-		i->mode = s_ifreg | 0444;
-		i->sb = dir->sb;
-		i->atime = i->mtime = i->ctime = 0;
-		i->size = i->sb->passwdLength;
-		return 0;
-	} else if (strcmp(filename, "[label]") == 0 && dir->sb->labelLength) /* access label */ {
-		i->attr = 0;
-		i->ino = dir->sb->maxdir + 2;
-		i->mode = s_ifreg | 0444;
-		i->sb = dir->sb;
-		i->atime = i->mtime = i->ctime = 0;
-		i->size = i->sb->labelLength;
-		return 0;
-	}
-
-	if (splitFilename(filename, dir->sb->type, name, extension, &user) == -1) {
-		return -1;
-	}
-	/* find highest and lowest extent */
-	i->size = 0;
-	extent = -1;
-	highestExtno = -1;
-	lowestExtno = 2049;
-	while ((extent = findFileExtent(dir->sb, user, name, extension, extent + 1, -1)) != -1) {
-		int extno = EXTENT(dir->sb->dir[extent].extnol, dir->sb->dir[extent].extnoh);
+	return area;
+}
 
-		if (extno > highestExtno) {
-			highestExtno = extno;
-			highestExt = extent;
-		}
-		if (extno < lowestExtno) {
-			lowestExtno = extno;
-			lowestExt = extent;
-		}
-	}
+/*
+ * inodeFromExtents -- fill in the inode of a file from its extents
+ */
+static void inodeFromExtents(struct cpmSuperBlock *sb, struct cpmInode *i,
+			int lowestExt, int highestExt, int highestExtno, int xfcb) {
+	int protectMode;
+	int block;
 
-	if (highestExtno == -1) {
-		return -1;
-	}
 	/* calculate size */
 	i->size = highestExtno * 16384;
-	if (dir->sb->size <= 256) {
+	if (sb->size <= 256) {
 		for (block = 15; block >= 0; --block) {
-			if (dir->sb->dir[highestExt].pointers[block]) {
+			if (sb->dir[highestExt].pointers[block]) {
 				break;
 			}
 		}
 	} else {
 		for (block = 7; block >= 0; --block) {
-			if (dir->sb->dir[highestExt].pointers[2 * block] || dir->sb->dir[highestExt].pointers[2 * block + 1]) {
+			if (sb->dir[highestExt].pointers[2 * block] || sb->dir[highestExt].pointers[2 * block + 1]) {
 				break;
 			}
 		}
 	}
-	if (dir->sb->dir[highestExt].blkcnt) {
-		i->size += ((dir->sb->dir[highestExt].blkcnt & 0xff) - 1) * 128;
-		if (dir->sb->type & CPMFS_ISX) {
-			i->size += (128 - dir->sb->dir[highestExt].lrc);
+	if (sb->dir[highestExt].blkcnt) {
+		i->size += ((sb->dir[highestExt].blkcnt & 0xff) - 1) * 128;
+		if (sb->type & CPMFS_ISX) {
+			i->size += (128 - sb->dir[highestExt].lrc);
 		} else {
-			i->size += dir->sb->dir[highestExt].lrc ? (dir->sb->dir[highestExt].lrc & 0xff) : 128;
+			i->size += sb->dir[highestExt].lrc ? (sb->dir[highestExt].lrc & 0xff) : 128;
 		}
 	}
 #ifdef CPMFS_DEBUG
-	fprintf(stderr, "cpmNamei: size=%ld\n", (long)i->size);
+	fprintf(stderr, "inodeFromExtents: size=%ld\n", (long)i->size);
 #endif
 
 	i->ino = lowestExt;
 	i->mode = s_ifreg;
-	i->sb = dir->sb;
+	i->sb = sb;
+	i->xfcb = xfcb;
 
 	/* read timestamps */
-	protectMode = readTimeStamps(i, lowestExt);
+	protectMode = readTimeStamps(i, lowestExt, xfcb);
 
 	/* Determine the inode attributes */
 	i->attr = 0;
-	if (dir->sb->dir[lowestExt].name[0] & 0x80) {
+	if (sb->dir[lowestExt].name[0] & 0x80) {
 		i->attr |= CPM_ATTR_F1;
 	}
-	if (dir->sb->dir[lowestExt].name[1] & 0x80) {
+	if (sb->dir[lowestExt].name[1] & 0x80) {
 		i->attr |= CPM_ATTR_F2;
 	}
-	if (dir->sb->dir[lowestExt].name[2] & 0x80) {
+	if (sb->dir[lowestExt].name[2] & 0x80) {
 		i->attr |= CPM_ATTR_F3;
 	}
-	if (dir->sb->dir[lowestExt].name[3] & 0x80) {
+	if (sb->dir[lowestExt].name[3] & 0x80) {
 		i->attr |= CPM_ATTR_F4;
 	}
-	if (dir->sb->dir[lowestExt].ext [0] & 0x80) {
+	if (sb->dir[lowestExt].ext [0] & 0x80) {
 		i->attr |= CPM_ATTR_RO;
 	}
-	if (dir->sb->dir[lowestExt].ext [1] & 0x80) {
+	if (sb->dir[lowestExt].ext [1] & 0x80) {
 		i->attr |= CPM_ATTR_SYS;
 	}
-	if (dir->sb->dir[lowestExt].ext [2] & 0x80) {
+	if (sb->dir[lowestExt].ext [2] & 0x80) {
 		i->attr |= CPM_ATTR_ARCV;
 	}
 	if (protectMode & 0x20) {
@@ -1528,22 +2016,105 @@ int cpmNamei(const struct cpmInode *dir, char const *filename, struct cpmInode *
 		i->attr |= CPM_ATTR_PWREAD;
 	}
 
-	if (dir->sb->dir[lowestExt].ext[1] & 0x80) {
+	if (sb->dir[lowestExt].ext[1] & 0x80) {
 		i->mode |= 01000;
 	}
 	i->mode |= 0444;
-	if (!(dir->sb->dir[lowestExt].ext[0] & 0x80)) {
+	if (!(sb->dir[lowestExt].ext[0] & 0x80)) {
 		i->mode |= 0222;
 	}
-	if (extension[0] == 'C' && extension[1] == 'O' && extension[2] == 'M') {
+	if ((sb->dir[lowestExt].ext[0] & 0x7f) == 'C' && (sb->dir[lowestExt].ext[1] & 0x7f) == 'O'
+		&& (sb->dir[lowestExt].ext[2] & 0x7f) == 'M') {
 		i->mode |= 0111;
 	}
 
 	readDsStamps(i, lowestExt);
+}
+
+/*
+ * namei -- map name to inode
+ */
+static int namei(const struct cpmInode *dir, char const *filename, struct cpmInode *i) {
+	/* variables */
+	int user;
+	unsigned char name[8], extension[3];
+	int highestExtno, highestExt = -1, lowestExtno, lowestExt = -1;
+	int extent, xfcb;
+
+#ifdef CPMFS_DEBUG
+	fprintf(stderr, "cpmNamei: map %s\n", filename);
+#endif
+	if (!S_ISDIR(dir->mode)) {
+		boo = "No such file";
+		return -1;
+	}
+	if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) /* root directory */ {
+		*i = *dir;
+		return 0;
+	} else if (strcmp(filename, "[passwd]") == 0 && dir->sb->passwdLength) /* access passwords */ {
+		i->attr = 0;
+		i->ino = dir->sb->maxdir + 1;
+		i->mode = s_ifreg | 0444;
+		i->sb = dir->sb;
+		i->atime = i->mtime = i->ctime = 0;
+		i->size = i->sb->passwdLength;
+		return 0;
+	} else if (strcmp(filename, "[label]") == 0 && dir->sb->labelLength) /* access label */ {
+		i->attr = 0;
+		i->ino = dir->sb->maxdir + 2;
+		i->mode = s_ifreg | 0444;
+		i->sb = dir->sb;
+		i->atime = i->mtime = i->ctime = 0;
+		i->size = i->sb->labelLength;
+		return 0;
+	}
 
+	if (splitFilename(filename, dir->sb->type, name, extension, &user) == -1) {
+		return -1;
+	}
+	/* find highest and lowest extent */
+	i->size = 0;
+	extent = -1;
+	highestExtno = -1;
+	lowestExtno = 2049;
+	while ((extent = findFileExtent(dir->sb, user, name, extension, extent + 1, -1)) != -1) {
+		int extno = EXTENT(dir->sb->dir[extent].extnol, dir->sb->dir[extent].extnoh);
+
+		if (extno > highestExtno) {
+			highestExtno = extno;
+			highestExt = extent;
+		}
+		if (extno < lowestExtno) {
+			lowestExtno = extno;
+			lowestExt = extent;
+		}
+	}
+
+	if (highestExtno == -1) {
+		return -1;
+	}
+	xfcb = -1;
+	if (dir->sb->type & CPMFS_MPM_DATES) {
+		xfcb = findFileExtent(dir->sb, user + 16, name, extension, 0, -1);
+	}
+	inodeFromExtents(dir->sb, i, lowestExt, highestExt, highestExtno, xfcb);
 	return 0;
 }
 
+/*
+ * cpmNamei -- map name to inode
+ */
+int cpmNamei(const struct cpmInode *dir, char const *filename, struct cpmInode *i) {
+	long long t = TRACE_START();
+	int res;
+
+	res = namei(dir, filename, i);
+	if (traceFile) {
+		traceSpan("cpmNamei", t, filename, "\"ino\": %ld", res == -1 ? -1L : (long)i->ino);
+	}
+	return res;
+}
+
 /*
  * cpmStatFS -- statfs
  */
@@ -1622,6 +2193,60 @@ int cpmUnlink(const struct cpmInode *dir, char const *fname) {
 	return 0;
 }
 
+/*
+ * cpmUnlinkAll -- remove all files matching any of the patterns
+ *
+ * The directory is scanned once, so are the XFCBs of the files, and the
+ * allocation vector is made once.  Returns the number of directory
+ * entries freed.
+ */
+int cpmUnlinkAll(const struct cpmInode *dir, int patterns, char *const pattern[]) {
+	struct cpmSuperBlock *drive;
+	struct cpmPattern *compiled;
+	char name[2 + 8 + 1 + 3 + 1];
+	int maxuser, freed, i, j;
+
+	if (!S_ISDIR(dir->mode)) {
+		boo = "No such file";
+		return -1;
+	}
+	drive = dir->sb;
+	if ((compiled = malloc(sizeof(struct cpmPattern) * (patterns ? patterns : 1))) == NULL) {
+		boo = strerror(errno);
+		return -1;
+	}
+	for (j = 0; j < patterns; ++j) {
+		cpmPatternCompile(&compiled[j], pattern[j]);
+	}
+	maxuser = (drive->type & CPMFS_HI_USER ? 31 : 15);
+	for (freed = i = 0; i < drive->maxdir; ++i) {
+		struct PhysDirectoryEntry *e = drive->dir + i;
+		int user = e->status;
+
+		if (user > maxuser) {
+			continue;
+		}
+		unixName(drive, e, name);
+		for (j = 0; j < patterns && !cpmPatternMatch(&compiled[j], name); ++j);
+		if (j == patterns && (drive->type & CPMFS_HAS_XFCBS) && user >= 16) {
+			/* the XFCB of a file that goes */
+			name[0] = '0' + (user - 16) / 10;
+			name[1] = '0' + (user - 16) % 10;
+			for (j = 0; j < patterns && !cpmPatternMatch(&compiled[j], name); ++j);
+		}
+		if (j < patterns) {
+			e->status = 0xe5;
+			++freed;
+		}
+	}
+	free(compiled);
+	if (freed) {
+		drive->dirtyDirectory = 1;
+		alvInit(drive);
+	}
+	return freed;
+}
+
 /*
  * cpmRename -- rename
  */
@@ -1682,6 +2307,8 @@ int cpmOpendir(struct cpmInode *dir, struct cpmFile *dirp) {
 	dirp->ino = dir;
 	dirp->pos = 0;
 	dirp->mode = O_RDONLY;
+	dirp->extent = NULL;
+	dirp->extents = 0;
 	return 0;
 }
 
@@ -1691,10 +2318,6 @@ int cpmOpendir(struct cpmInode *dir, struct cpmFile *dirp) {
 int cpmReaddir(struct cpmFile *dir, struct cpmDirent *ent) {
 	/* variables */
 	struct PhysDirectoryEntry *cur = NULL;
-	char buf[2 + 8 + 1 + 3 + 1]; /* 00foobarxy.zzy\0 */
-	char *bufp;
-	int hasext;
-
 
 	if (!(S_ISDIR(dir->ino->mode))) /* error: not a directory */ {
 		boo = "not a directory";
@@ -1760,29 +2383,7 @@ int cpmReaddir(struct cpmFile *dir, struct cpmDirent *ent) {
 				}
 				if (first == (dir->pos - RESERVED_ENTRIES)) {
 					ent->ino = dir->pos - RESERVED_INODES;
-					/* convert file name to UNIX style */
-					buf[0] = '0' + cur->status / 10;
-					buf[1] = '0' + cur->status % 10;
-					for (bufp = buf + 2, i = 0; i < 8 && (cur->name[i] & 0x7f) != ' '; ++i) {
-						*bufp++ = dir->ino->sb->uppercase ?
-							cur->name[i] & 0x7f :
-							tolower(cur->name[i] & 0x7f);
-					}
-					for (hasext = 0, i = 0; i < 3 &&
-							(cur->ext[i] & 0x7f) != ' '; ++i) {
-						if (!hasext) {
-							*bufp++ = '.';
-							hasext = 1;
-						}
-						*bufp++ = dir->ino->sb->uppercase ?
-							cur->ext[i] & 0x7f :
-							tolower(cur->ext[i] & 0x7f);
-					}
-					*bufp = '\0';
-
-					assert(bufp <= buf + sizeof(buf));
-					ent->reclen = bufp - buf;
-					strcpy(ent->name, buf);
+					ent->reclen = unixName(dir->ino->sb, cur, ent->name);
 					ent->off = dir->pos;
 					++dir->pos;
 					return 1;
@@ -1807,6 +2408,208 @@ void cpmStat(const struct cpmInode *ino, struct cpmStat *buf) {
 	buf->ctime = ino->ctime;
 }
 
+/* A file found by cpmStatAll, keyed by its first directory entry */
+struct fileSlot {
+	int first;                    /* -1 if the slot is free */
+	int extents;
+	int lowest, lowestExtno;
+	int highest, highestExtno;
+};
+
+/*
+ * findSlot -- find the slot of a user and name, or the free slot for it
+ */
+static struct fileSlot *findSlot(const struct cpmSuperBlock *sb, struct fileSlot *slot, int slots,
+			int user, unsigned char const *name, unsigned char const *ext) {
+	unsigned int hash = 2166136261u ^ user;
+	int i;
+
+	for (i = 0; i < 8; ++i) {
+		hash = (hash * 16777619u) ^ (name[i] & 0x7f);
+	}
+	for (i = 0; i < 3; ++i) {
+		hash = (hash * 16777619u) ^ (ext[i] & 0x7f);
+	}
+	for (i = hash & (slots - 1);; i = (i + 1) & (slots - 1)) {
+		if (slot[i].first == -1 || isMatching(user, name, ext, sb->dir[slot[i].first].status,
+			sb->dir[slot[i].first].name, sb->dir[slot[i].first].ext)) {
+			return &slot[i];
+		}
+	}
+}
+
+/*
+ * cpmStatAll -- stat all files of a directory in one pass
+ *
+ * Returns the number of files and a table of them in directory order,
+ * which the caller frees.  The inodes are the same cpmNamei returns.
+ */
+int cpmStatAll(const struct cpmInode *dir, struct cpmDirStat **files) {
+	struct cpmSuperBlock *sb = dir->sb;
+	struct fileSlot *slot, *f;
+	int maxuser, slots, count, i;
+
+	*files = NULL;
+	if (!S_ISDIR(dir->mode)) {
+		boo = "not a directory";
+		return -1;
+	}
+	maxuser = (sb->type & CPMFS_HI_USER ? 31 : 15);
+	for (slots = 16; slots < 2 * sb->maxdir; slots *= 2);
+	if ((slot = malloc(sizeof(struct fileSlot) * slots)) == NULL) {
+		boo = strerror(errno);
+		return -1;
+	}
+	for (i = 0; i < slots; ++i) {
+		slot[i].first = -1;
+	}
+
+	/* find lowest and highest extent of all files */
+	for (count = i = 0; i < sb->maxdir; ++i) {
+		const struct PhysDirectoryEntry *e = sb->dir + i;
+		int extno = EXTENT(e->extnol, e->extnoh);
+
+		if ((unsigned char)e->status > maxuser) {
+			continue;
+		}
+		f = findSlot(sb, slot, slots, e->status, e->name, e->ext);
+		if (f->first == -1) {
+			f->first = i;
+			f->extents = 0;
+			f->highestExtno = -1;
+			f->lowestExtno = 2049;
+			++count;
+		}
+		++f->extents;
+		if (extno > f->highestExtno) {
+			f->highestExtno = extno;
+			f->highest = i;
+		}
+		if (extno < f->lowestExtno) {
+			f->lowestExtno = extno;
+			f->lowest = i;
+		}
+	}
+
+	/* make an inode for each file at its lowest extent */
+	if ((*files = malloc(sizeof(struct cpmDirStat) * (count ? count : 1))) == NULL) {
+		boo = strerror(errno);
+		free(slot);
+		return -1;
+	}
+	for (count = i = 0; i < sb->maxdir; ++i) {
+		const struct PhysDirectoryEntry *e = sb->dir + i;
+		struct cpmDirStat *file = *files + count;
+		int xfcb = -1;
+
+		if ((unsigned char)e->status > maxuser
+			|| (f = findSlot(sb, slot, slots, e->status, e->name, e->ext))->lowest != i) {
+			continue;
+		}
+		if (sb->type & CPMFS_MPM_DATES) {
+			xfcb = findSlot(sb, slot, slots, e->status + 16, e->name, e->ext)->first;
+		}
+		unixName(sb, e, file->name);
+		inodeFromExtents(sb, &file->ino, f->lowest, f->highest, f->highestExtno, xfcb);
+		file->extents = f->extents;
+		++count;
+	}
+	free(slot);
+	return count;
+}
+
+/*
+ * extentMapAdd -- enter the directory entry of a physical extent
+ */
+static int extentMapAdd(struct cpmFile *file, int extno, int entry) {
+	if (extno >= file->extents) {
+		int *extent, n = file->extents;
+
+		if ((extent = realloc(file->extent, sizeof(int) * (extno + 1))) == NULL) {
+			return -1;
+		}
+		while (n <= extno) {
+			extent[n++] = -1;
+		}
+		file->extent = extent;
+		file->extents = n;
+	}
+	/* like findFileExtent, the first entry found wins */
+	if (file->extent[extno] == -1) {
+		file->extent[extno] = entry;
+	}
+	return 0;
+}
+
+/*
+ * fileExtent -- find the directory entry of a logical extent of a file
+ */
+static int fileExtent(struct cpmFile *file, int extentno) {
+	const struct cpmSuperBlock *sb = file->ino->sb;
+	int extno = extentno / sb->extents;
+
+	if (file->extent) {
+		if (extno < file->extents && file->extent[extno] != -1) {
+			return file->extent[extno];
+		}
+		boo = "file not found";
+		return -1;
+	}
+	return findFileExtent(sb, sb->dir[file->ino->ino].status, sb->dir[file->ino->ino].name,
+		sb->dir[file->ino->ino].ext, 0, extentno);
+}
+
+/*
+ * extentEnd -- file size up to the end of an extent
+ */
+static off_t extentEnd(const struct cpmSuperBlock *sb, int extent) {
+	const struct PhysDirectoryEntry *e = sb->dir + extent;
+	off_t end;
+
+	end = EXTENT(e->extnol, e->extnoh) * (off_t)16384;
+	if (e->blkcnt) {
+		end += ((e->blkcnt & 0xff) - 1) * 128;
+		if (sb->type & CPMFS_ISX) {
+			end += (128 - e->lrc);
+		} else {
+			end += e->lrc ? (e->lrc & 0xff) : 128;
+		}
+	}
+	return end;
+}
+
+/*
+ * extentMapInit -- find the directory entries of all extents of a file
+ *
+ * Without the map, which is only an optimisation, extents are searched
+ * in the directory.
+ */
+static void extentMapInit(struct cpmFile *file) {
+	const struct cpmSuperBlock *sb = file->ino->sb;
+	const struct PhysDirectoryEntry *first;
+	int i, extno;
+
+	file->extent = NULL;
+	file->extents = 0;
+	if (file->ino->ino >= (ino_t)sb->maxdir) {
+		return;
+	}
+	first = sb->dir + file->ino->ino;
+	for (i = 0; i < sb->maxdir; ++i) {
+		if (sb->dir[i].status <= (sb->type & CPMFS_HI_USER ? 31 : 15) &&
+			isMatching(first->status, first->name, first->ext,
+				sb->dir[i].status, sb->dir[i].name, sb->dir[i].ext)) {
+			extno = EXTENT(sb->dir[i].extnol, sb->dir[i].extnoh) / sb->extents;
+			if (extentMapAdd(file, extno, i) == -1) {
+				free(file->extent);
+				file->extent = NULL;
+				file->extents = 0;
+				return;
+			}
+		}
+	}
+}
+
 /*
  * cpmOpen -- open
  */
@@ -1819,6 +2622,7 @@ int cpmOpen(struct cpmInode *ino, struct cpmFile *file, mode_t mode) {
 		file->pos = 0;
 		file->ino = ino;
 		file->mode = mode;
+		extentMapInit(file);
 		return 0;
 	} else {
 		boo = "not a regular file";
@@ -1827,9 +2631,9 @@ int cpmOpen(struct cpmInode *ino, struct cpmFile *file, mode_t mode) {
 }
 
 /*
- * cpmRead -- read
+ * readFile -- read
  */
-ssize_t cpmRead(struct cpmFile *file, char *buf, size_t count) {
+static ssize_t readFile(struct cpmFile *file, char *buf, size_t count) {
 	int findext = 1, findblock = 1, extent = -1, block = -1, extentno = -1, got = 0, nextblockpos = -1, nextextpos = -1;
 	int blocksize = file->ino->sb->blksiz;
 	int extcap;
@@ -1868,11 +2672,7 @@ ssize_t cpmRead(struct cpmFile *file, char *buf, size_t count) {
 
 			if (findext) {
 				extentno = file->pos / 16384;
-				extent = findFileExtent(file->ino->sb,
-					file->ino->sb->dir[file->ino->ino].status,
-					file->ino->sb->dir[file->ino->ino].name,
-					file->ino->sb->dir[file->ino->ino].ext,
-					0, extentno);
+				extent = fileExtent(file, extentno);
 				nextextpos = (file->pos / extcap) * extcap + extcap;
 				findext = 0;
 				findblock = 1;
@@ -1932,9 +2732,25 @@ ssize_t cpmRead(struct cpmFile *file, char *buf, size_t count) {
 }
 
 /*
- * cpmWrite -- write
+ * cpmRead -- read
  */
-ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
+ssize_t cpmRead(struct cpmFile *file, char *buf, size_t count) {
+	long long t = TRACE_START();
+	off_t pos = file->pos;
+	ssize_t res;
+
+	res = readFile(file, buf, count);
+	if (traceFile) {
+		traceSpan("cpmRead", t, NULL, "\"ino\": %ld, \"extent\": %ld, \"pos\": %ld, \"count\": %lu, \"result\": %ld",
+			(long)file->ino->ino, (long)(pos / 16384), (long)pos, (unsigned long)count, (long)res);
+	}
+	return res;
+}
+
+/*
+ * writeFile -- write
+ */
+static ssize_t writeFile(struct cpmFile *file, char const *buf, size_t count) {
 	int findext = 1, findblock = -1, extent = -1, extentno = -1, got = 0, nextblockpos = -1, nextextpos = -1;
 	int blocksize = file->ino->sb->blksiz;
 	int extcap;
@@ -1949,23 +2765,25 @@ ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
 	while (count > 0) {
 		if (findext) {
 			extentno = file->pos / 16384;
-			extent = findFileExtent(file->ino->sb,
-				file->ino->sb->dir[file->ino->ino].status,
-				file->ino->sb->dir[file->ino->ino].name,
-				file->ino->sb->dir[file->ino->ino].ext, 0, extentno);
+			extent = fileExtent(file, extentno);
 			nextextpos = (file->pos / extcap) * extcap + extcap;
 			if (extent == -1) {
 				extent = findFreeExtent(file->ino->sb);
 				if (extent == -1) {
 					return (got == 0 ? -1 : got);
 				}
+				if (file->extent && extentMapAdd(file, extentno / file->ino->sb->extents, extent) == -1) {
+					free(file->extent);
+					file->extent = NULL;
+					file->extents = 0;
+				}
 				file->ino->sb->dir[extent] = file->ino->sb->dir[file->ino->ino];
 				memset(file->ino->sb->dir[extent].pointers, 0, 16);
 				file->ino->sb->dir[extent].extnol = EXTENTL(extentno);
 				file->ino->sb->dir[extent].extnoh = EXTENTH(extentno);
 				file->ino->sb->dir[extent].blkcnt = 0;
 				file->ino->sb->dir[extent].lrc = 0;
-				time(&file->ino->ctime);
+				clockTime(&file->ino->ctime);
 				updateTimeStamps(file->ino, extent);
 				updateDsStamps(file->ino, extent);
 			}
@@ -2000,7 +2818,7 @@ ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
 				 */
 				end = (blocksize - 1) / file->ino->sb->secLength;
 				memset(buffer, 0, blocksize);
-				time(&file->ino->ctime);
+				clockTime(&file->ino->ctime);
 				updateTimeStamps(file->ino, extent);
 				updateDsStamps(file->ino, extent);
 			} else { /* read existing block and set start/end to cover modified parts */
@@ -2008,7 +2826,8 @@ ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
 				end = ((int)(file->pos % blocksize + count) >= blocksize ?
 					blocksize - 1 :
 					(int)(file->pos % blocksize + count - 1)) / file->ino->sb->secLength;
-				if (file->pos % file->ino->sb->secLength) {
+				if (file->pos % file->ino->sb->secLength
+					|| (off_t)(file->pos % blocksize + count) < (off_t)(start + 1) * file->ino->sb->secLength) {
 					if (readBlock(file->ino->sb, block, buffer, start, start) == -1) {
 						if (got == 0) {
 							got = -1;
@@ -2047,33 +2866,19 @@ ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
 		 */
 
 		(void)writeBlock(file->ino->sb, block, buffer, start, end);
-		time(&file->ino->mtime);
-		if (file->ino->sb->size <= 256) {
-			for (last = 15; last >= 0; --last) {
-				if (file->ino->sb->dir[extent].pointers[last]) {
-					break;
-				}
-			}
-		} else {
-			for (last = 14; last > 0; last -= 2) {
-				if (file->ino->sb->dir[extent].pointers[last] ||
-					file->ino->sb->dir[extent].pointers[last + 1]) {
-					last /= 2;
-					break;
-				}
+		clockTime(&file->ino->mtime);
+		/* only writing past its end makes an extent larger */
+		if (file->pos > extentEnd(file->ino->sb, extent)) {
+			last = (file->pos - 1) / 16384;
+			file->ino->sb->dir[extent].extnol = EXTENTL(last);
+			file->ino->sb->dir[extent].extnoh = EXTENTH(last);
+			file->ino->sb->dir[extent].blkcnt = ((file->pos - 1) % 16384) / 128 + 1;
+			if (file->ino->sb->type & CPMFS_EXACT_SIZE) {
+				file->ino->sb->dir[extent].lrc = (128 - (file->pos % 128)) & 0x7F;
+			} else {
+				file->ino->sb->dir[extent].lrc = file->pos % 128;
 			}
 		}
-		if (last > 0) {
-			extentno += (last * blocksize) / extcap;
-		}
-		file->ino->sb->dir[extent].extnol = EXTENTL(extentno);
-		file->ino->sb->dir[extent].extnoh = EXTENTH(extentno);
-		file->ino->sb->dir[extent].blkcnt = ((file->pos - 1) % 16384) / 128 + 1;
-		if (file->ino->sb->type & CPMFS_EXACT_SIZE) {
-			file->ino->sb->dir[extent].lrc = (128 - (file->pos % 128)) & 0x7F;
-		} else {
-			file->ino->sb->dir[extent].lrc = file->pos % 128;
-		}
 		updateTimeStamps(file->ino, extent);
 		updateDsStamps(file->ino, extent);
 
@@ -2086,10 +2891,246 @@ ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
 	return got;
 }
 
+/*
+ * cpmWrite -- write
+ */
+ssize_t cpmWrite(struct cpmFile *file, char const *buf, size_t count) {
+	long long t = TRACE_START();
+	off_t pos = file->pos;
+	ssize_t res;
+
+	res = writeFile(file, buf, count);
+	if (traceFile) {
+		traceSpan("cpmWrite", t, NULL, "\"ino\": %ld, \"extent\": %ld, \"pos\": %ld, \"count\": %lu, \"result\": %ld",
+			(long)file->ino->ino, (long)(pos / 16384), (long)pos, (unsigned long)count, (long)res);
+	}
+	return res;
+}
+
+/*
+ * cpmLseek -- lseek
+ */
+off_t cpmLseek(struct cpmFile *file, off_t offset, int whence) {
+	off_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = file->pos + offset;
+		break;
+	case SEEK_END:
+		pos = file->ino->size + offset;
+		break;
+	default:
+		boo = "invalid argument";
+		return -1;
+	}
+	if (pos < 0 || pos > (off_t)2048 * 16384) {
+		boo = "invalid argument";
+		return -1;
+	}
+	file->pos = pos;
+	return pos;
+}
+
+/*
+ * cpmPread -- read at a position, which does not move the file position
+ */
+ssize_t cpmPread(struct cpmFile *file, char *buf, size_t count, off_t offset) {
+	off_t pos = file->pos;
+	ssize_t res;
+
+	if (cpmLseek(file, offset, SEEK_SET) == -1) {
+		return -1;
+	}
+	res = cpmRead(file, buf, count);
+	file->pos = pos;
+	return res;
+}
+
+/*
+ * cpmPwrite -- write at a position, which does not move the file position
+ */
+ssize_t cpmPwrite(struct cpmFile *file, char const *buf, size_t count, off_t offset) {
+	off_t pos = file->pos;
+	ssize_t res;
+
+	if (cpmLseek(file, offset, SEEK_SET) == -1) {
+		return -1;
+	}
+	res = cpmWrite(file, buf, count);
+	file->pos = pos;
+	return res;
+}
+
+/*
+ * cpmFileMap -- map a file to the sectors of the image
+ *
+ * Returns the number of runs and the runs in file order, which the caller
+ * frees.  A run is as long as both the file and the image are contiguous,
+ * so with skew a run may cover a single sector.  Image offsets are those
+ * of a raw image; they mean nothing for other devices.
+ */
+int cpmFileMap(struct cpmInode *ino, struct cpmFileRun **runs) {
+	struct cpmSuperBlock *sb = ino->sb;
+	struct cpmFile file;
+	struct cpmFileRun *run = NULL, *last;
+	int count = 0, capacity = 0;
+	int sectors = sb->blksiz / sb->secLength;
+	int extcap;
+	off_t pos;
+
+	*runs = NULL;
+	if (!S_ISREG(ino->mode) || ino->ino >= (ino_t)sb->maxdir) {
+		boo = "not a regular file";
+		return -1;
+	}
+	extcap = (sb->size <= 256 ? 16 : 8) * sb->blksiz;
+	if (extcap > 16384) {
+		extcap = 16384 * sb->extents;
+	}
+	if (cpmOpen(ino, &file, O_RDONLY) == -1) {
+		return -1;
+	}
+	for (pos = 0; pos < ino->size; pos += sb->blksiz) {
+		int extent, block = 0, sect;
+
+		if ((extent = fileExtent(&file, pos / 16384)) != -1) {
+			int ptr = (pos % extcap) / sb->blksiz;
+
+			if (sb->size > 256) {
+				ptr *= 2;
+			}
+			block = (unsigned char)sb->dir[extent].pointers[ptr];
+			if (sb->size > 256) {
+				block += ((unsigned char)sb->dir[extent].pointers[ptr + 1]) << 8;
+			}
+		}
+		for (sect = 0; sect < sectors && pos + sect * sb->secLength < ino->size; ++sect) {
+			off_t logical = pos + sect * sb->secLength;
+			off_t length = ino->size - logical < sb->secLength ? ino->size - logical : sb->secLength;
+			off_t physical = -1;
+
+			if (block) {
+				/* the sector as readBlock finds it */
+				int n = block * sectors + sb->sectrk * sb->boottrk + sect;
+
+				physical = ((off_t)(n / sb->sectrk) * sb->sectrk + sb->skewtab[n % sb->sectrk])
+					* sb->secLength + sb->offset;
+			}
+			last = run + count - 1;
+			if (count && (physical == -1 ? last->physical == -1 :
+				last->physical != -1 && last->physical + last->length == physical)) {
+				last->length += length;
+				continue;
+			}
+			if (count == capacity) {
+				struct cpmFileRun *more;
+
+				if ((more = realloc(run, sizeof(struct cpmFileRun) * (capacity ? (capacity *= 2) : (capacity = 16)))) == NULL) {
+					boo = strerror(errno);
+					free(run);
+					cpmClose(&file);
+					return -1;
+				}
+				run = more;
+			}
+			run[count].logical = logical;
+			run[count].length = length;
+			run[count].block = (block ? block : -1);
+			run[count].physical = physical;
+			++count;
+		}
+	}
+	cpmClose(&file);
+	*runs = run;
+	return count;
+}
+
+/*
+ * cpmTruncate -- shorten a file
+ *
+ * Blocks past the new end are freed, as are extents that no longer hold
+ * any, and the extent with the new end gets its record count.  The first
+ * extent always stays, so the inode remains valid.  Files must not be
+ * open while they are truncated, as their extent maps would go stale.
+ */
+int cpmTruncate(struct cpmInode *ino, off_t length) {
+	struct cpmSuperBlock *sb = ino->sb;
+	unsigned char name[8], ext[3];
+	int user, extcap, ptrs, i;
+
+	if (!S_ISREG(ino->mode) || ino->ino >= (ino_t)sb->maxdir) {
+		boo = "not a regular file";
+		return -1;
+	}
+	if ((ino->mode & 0222) == 0) {
+		boo = "permission denied";
+		return -1;
+	}
+	if (length < 0 || length > ino->size) {
+		boo = "invalid argument";
+		return -1;
+	}
+	if (length == ino->size) {
+		return 0;
+	}
+	extcap = (sb->size <= 256 ? 16 : 8) * sb->blksiz;
+	if (extcap > 16384) {
+		extcap = 16384 * sb->extents;
+	}
+	ptrs = (sb->size <= 256 ? 16 : 8);
+	user = sb->dir[ino->ino].status;
+	memcpy(name, sb->dir[ino->ino].name, 8);
+	memcpy(ext, sb->dir[ino->ino].ext, 3);
+	for (i = findFileExtent(sb, user, name, ext, 0, -1); i != -1;
+		i = findFileExtent(sb, user, name, ext, i + 1, -1)) {
+		struct PhysDirectoryEntry *e = sb->dir + i;
+		off_t base = (off_t)(EXTENT(e->extnol, e->extnoh) / sb->extents) * extcap;
+		int keep, last;
+
+		if (extentEnd(sb, i) <= length) {
+			continue;
+		}
+		if (base >= length && i != (int)ino->ino) {
+			e->status = 0xe5;
+			continue;
+		}
+		/* the new end is in this extent, or it is the first one */
+		keep = (base >= length ? 0 : (int)((length - base + sb->blksiz - 1) / sb->blksiz));
+		if (sb->size > 256) {
+			memset(e->pointers + 2 * keep, 0, 2 * (ptrs - keep));
+		} else {
+			memset(e->pointers + keep, 0, ptrs - keep);
+		}
+		last = (length ? (length - 1) / 16384 : 0);
+		e->extnol = EXTENTL(last);
+		e->extnoh = EXTENTH(last);
+		e->blkcnt = (length ? ((length - 1) % 16384) / 128 + 1 : 0);
+		if (sb->type & CPMFS_EXACT_SIZE) {
+			e->lrc = (128 - (length % 128)) & 0x7F;
+		} else {
+			e->lrc = length % 128;
+		}
+	}
+	ino->size = length;
+	clockTime(&ino->mtime);
+	updateTimeStamps(ino, ino->ino);
+	updateDsStamps(ino, ino->ino);
+	sb->dirtyDirectory = 1;
+	alvInit(sb);
+	return 0;
+}
+
 /*
  * cpmClose -- close
  */
 int cpmClose(struct cpmFile *file) {
+	free(file->extent);
+	file->extent = NULL;
+	file->extents = 0;
 	return 0;
 }
 
@@ -2131,9 +3172,9 @@ int cpmCreat(struct cpmInode *dir, char const *fname, struct cpmInode *ino, mode
 	ino->mode = s_ifreg | mode;
 	ino->size = 0;
 
-	time(&ino->atime);
-	time(&ino->mtime);
-	time(&ino->ctime);
+	clockTime(&ino->atime);
+	clockTime(&ino->mtime);
+	clockTime(&ino->ctime);
 	ino->sb = dir->sb;
 	if (ino->sb->type & CPMFS_HAS_XFCBS) {
 		/* regardless of cmakexfcbs, if XFCB exists then use it. */
@@ -2226,6 +3267,71 @@ int cpmAttrSet(struct cpmInode *ino, cpm_attr_t attrib) {
 	return 0;
 }
 
+/*
+ * cpmAttrSetAll -- change the attributes of all files matching any pattern
+ *
+ * The attributes of every extent of the files become (attributes & keep)
+ * | set, done in one pass over the directory.  Returns the number of
+ * directory entries changed.
+ */
+int cpmAttrSetAll(const struct cpmInode *dir, int patterns, char *const pattern[], cpm_attr_t keep, cpm_attr_t set) {
+	struct cpmSuperBlock *drive;
+	struct cpmPattern *compiled;
+	char name[2 + 8 + 1 + 3 + 1];
+	int maxuser, changed, i, j;
+
+	if (!S_ISDIR(dir->mode)) {
+		boo = "No such file";
+		return -1;
+	}
+	drive = dir->sb;
+	if ((compiled = malloc(sizeof(struct cpmPattern) * (patterns ? patterns : 1))) == NULL) {
+		boo = strerror(errno);
+		return -1;
+	}
+	for (j = 0; j < patterns; ++j) {
+		cpmPatternCompile(&compiled[j], pattern[j]);
+	}
+	maxuser = (drive->type & CPMFS_HI_USER ? 31 : 15);
+	for (changed = i = 0; i < drive->maxdir; ++i) {
+		struct PhysDirectoryEntry *e = drive->dir + i;
+		cpm_attr_t attrib = 0;
+
+		if (e->status > maxuser) {
+			continue;
+		}
+		unixName(drive, e, name);
+		for (j = 0; j < patterns && !cpmPatternMatch(&compiled[j], name); ++j);
+		if (j == patterns) {
+			continue;
+		}
+		/* F1-F4 are bits 0-3, R/O, SYS and ARCV bits 8-10 */
+		for (j = 0; j < 4; ++j) {
+			if (e->name[j] & 0x80) {
+				attrib |= CPM_ATTR_F1 << j;
+			}
+		}
+		for (j = 0; j < 3; ++j) {
+			if (e->ext[j] & 0x80) {
+				attrib |= CPM_ATTR_RO << j;
+			}
+		}
+		attrib = (attrib & keep) | set;
+		for (j = 0; j < 8; ++j) {
+			e->name[j] = (e->name[j] & 0x7f) | (j < 4 && (attrib & (CPM_ATTR_F1 << j)) ? 0x80 : 0);
+		}
+		for (j = 0; j < 3; ++j) {
+			e->ext[j] = (e->ext[j] & 0x7f) | (attrib & (CPM_ATTR_RO << j) ? 0x80 : 0);
+		}
+		++changed;
+	}
+	free(compiled);
+	if (changed) {
+		drive->dirtyDirectory = 1;
+	}
+	return changed;
+}
+
 /*
  * cpmChmod -- set CP/M r/o & sys
  */
@@ -2245,7 +3351,7 @@ int cpmChmod(struct cpmInode *ino, mode_t mode) {
 void cpmUtime(struct cpmInode *ino, struct utimbuf *times) {
 	ino->atime = times->actime;
 	ino->mtime = times->modtime;
-	time(&ino->ctime);
+	clockTime(&ino->ctime);
 	updateTimeStamps(ino, ino->ino);
 	updateDsStamps(ino, ino->ino);
 }
@@ -72,6 +72,8 @@ struct cpmFile {
 	mode_t mode;
 	off_t pos;
 	struct cpmInode *ino;
+	int *extent;                  /* directory entry of each physical extent, -1 if none */
+	int extents;                  /* number of entries in extent, 0 if none */
 };
 
 struct cpmDirent {
@@ -81,6 +83,14 @@ struct cpmDirent {
 	char name[2 + 8 + 1 + 3 + 1]; /* 00foobarxy.zzy\0 */
 };
 
+/* A wildcard pattern compiled by cpmPatternCompile */
+struct cpmPattern {
+	char user[2];                 /* user number digits, '?' matches any */
+	int fields;                   /* compare name and extension by field */
+	char field[8 + 3];            /* lower case or '?', '*' ends a field, '\0' pads */
+	char glob[256];               /* otherwise the lower case pattern */
+};
+
 struct cpmStat {
 	ino_t ino;
 	mode_t mode;
@@ -90,6 +100,21 @@ struct cpmStat {
 	time_t ctime;
 };
 
+/* A run of bytes of a file, as mapped by cpmFileMap */
+struct cpmFileRun {
+	off_t logical;                /* offset in the file */
+	off_t length;                 /* bytes */
+	int block;                    /* block of the first byte, -1 in a hole */
+	off_t physical;               /* offset of the first byte in the image, -1 in a hole */
+};
+
+/* One file of the table made by cpmStatAll */
+struct cpmDirStat {
+	char name[2 + 8 + 1 + 3 + 1]; /* as returned by cpmReaddir */
+	struct cpmInode ino;          /* as returned by cpmNamei */
+	int extents;                  /* directory entries used */
+};
+
 /* Note: CPMFS_HI_USER should be split for systems with user numbers
  * up to 31 and CP/M 3, which uses them, but for password entries and
  * not for files.
@@ -124,6 +149,18 @@ struct dsDate {
 	char checksum;
 };
 
+/* Counters kept if a tool is run with --stats or CPMTOOLS_STATS */
+struct cpmStats {
+	struct DeviceStats dev;
+	unsigned long findFileExtentCalls;
+	unsigned long entriesScanned;  /* by findFileExtent */
+	unsigned long alvInits;
+	unsigned long dirSyncs;        /* directory written back */
+	unsigned long dsSyncs;         /* DateStamper file written back */
+	long long start;               /* when the file system was read */
+	int json;
+};
+
 struct cpmSuperBlock {
 	struct Device dev;
 	int uppercase;
@@ -156,6 +193,7 @@ struct cpmSuperBlock {
 	int dirtyDirectory;
 	struct dsDate *ds;
 	int dirtyDs;
+	struct cpmStats *stats;       /* NULL if no statistics are wanted */
 };
 
 struct cpmStatFS {
@@ -173,29 +211,42 @@ extern char const cmd[];
 extern char const *boo;
 
 int match(char const *a, char const *pattern);
+void cpmPatternCompile(struct cpmPattern *p, char const *pattern);
+int cpmPatternMatch(const struct cpmPattern *p, char const *name);
 void cpmglob(int opti, int argc, char *const argv[], struct cpmInode *root, int *gargc, char ***gargv);
 void cpmglobfree(char **dirent, int entries);
 
+int cpmStatsArgs(int argc, char *argv[]);
 int cpmReadSuper(struct cpmSuperBlock *drive, struct cpmInode *root, const char *format, int uppercase);
 int cpmNamei(const struct cpmInode *dir, const char *filename, struct cpmInode *i);
 void cpmStatFS(const struct cpmInode *ino, struct cpmStatFS *buf);
 int cpmUnlink(const struct cpmInode *dir, const char *fname);
+int cpmUnlinkAll(const struct cpmInode *dir, int patterns, char *const pattern[]);
 int cpmRename(const struct cpmInode *dir, const char *old, const char *newname);
 int cpmOpendir(struct cpmInode *dir, struct cpmFile *dirp);
 int cpmReaddir(struct cpmFile *dir, struct cpmDirent *ent);
 void cpmStat(const struct cpmInode *ino, struct cpmStat *buf);
+int cpmStatAll(const struct cpmInode *dir, struct cpmDirStat **files);
 int cpmAttrGet(struct cpmInode *ino, cpm_attr_t *attrib);
 int cpmAttrSet(struct cpmInode *ino, cpm_attr_t attrib);
+int cpmAttrSetAll(const struct cpmInode *dir, int patterns, char *const pattern[], cpm_attr_t keep, cpm_attr_t set);
 int cpmChmod(struct cpmInode *ino, mode_t mode);
 int cpmOpen(struct cpmInode *ino, struct cpmFile *file, mode_t mode);
 ssize_t cpmRead(struct cpmFile *file, char *buf, size_t count);
 ssize_t cpmWrite(struct cpmFile *file, const char *buf, size_t count);
+off_t cpmLseek(struct cpmFile *file, off_t offset, int whence);
+ssize_t cpmPread(struct cpmFile *file, char *buf, size_t count, off_t offset);
+ssize_t cpmPwrite(struct cpmFile *file, const char *buf, size_t count, off_t offset);
+int cpmFileMap(struct cpmInode *ino, struct cpmFileRun **runs);
+int cpmTruncate(struct cpmInode *ino, off_t length);
 int cpmClose(struct cpmFile *file);
 int cpmCreat(struct cpmInode *dir, const char *fname, struct cpmInode *ino, mode_t mode);
 void cpmUtime(struct cpmInode *ino, struct utimbuf *times);
 int cpmSync(struct cpmSuperBlock *sb);
 void cpmUmount(struct cpmSuperBlock *sb);
 int cpmCheckDs(struct cpmSuperBlock *sb);
+void cpmSetClock(time_t t);
+unsigned char *cpmFormat(const struct cpmSuperBlock *drive, const char *label, const char *bootTracks, int timeStamps, size_t *length);
 
 #ifdef __cplusplus
 }
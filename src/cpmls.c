@@ -14,6 +14,40 @@ static const char *const month[12] = {
 	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
 };
 
+/* all files, made by cpmStatAll when first needed and sorted by name */
+static struct cpmDirStat *files;
+static int nfiles = -1;
+
+/*
+ * filecmp -- compare two files by name
+ */
+static int filecmp(const void *a, const void *b) {
+	return strcmp(((const struct cpmDirStat *)a)->name, ((const struct cpmDirStat *)b)->name);
+}
+
+/*
+ * statFile -- get the inode of a listed file
+ */
+static void statFile(struct cpmInode *root, const char *name, struct cpmInode *file) {
+	struct cpmDirStat key, *found = NULL;
+
+	if (nfiles == -1) {
+		nfiles = cpmStatAll(root, &files);
+		if (nfiles > 0) {
+			qsort(files, nfiles, sizeof(struct cpmDirStat), filecmp);
+		}
+	}
+	if (nfiles > 0 && strlen(name) < sizeof(key.name)) {
+		strcpy(key.name, name);
+		found = bsearch(&key, files, nfiles, sizeof(struct cpmDirStat), filecmp);
+	}
+	if (found) {
+		*file = found->ino;
+	} else {
+		cpmNamei(root, name, file);
+	}
+}
+
 /*
  * namecmp -- compare two entries 
  */
@@ -166,7 +200,7 @@ static void oldddir(struct cpmSuperBlock *sb, char **dirent, int entries, struct
 					putchar(' ');
 				}
 
-				cpmNamei(ino, dirent[i], &file);
+				statFile(ino, dirent[i], &file);
 				cpmStat(&file, &statbuf);
 				printf(" %5.1ldK", (long)(statbuf.size + buf.f_bsize - 1) /
 					buf.f_bsize * (buf.f_bsize / 1024));
@@ -222,7 +256,7 @@ static void old3dir(struct cpmSuperBlock *sb, char **dirent, int entries, struct
 		for (i = 0; i < entries; ++i) {
 			if (dirent[i][0] == u10 && dirent[i][1] == u1) {
 				++count;
-				cpmNamei(ino, dirent[i], &file);
+				statFile(ino, dirent[i], &file);
 				cpmStat(&file, &statbuf);
 				cpmAttrGet(&file, &attrib);
 				if (announce == 1) {
@@ -339,7 +373,7 @@ static void ls(struct cpmSuperBlock *sb, char **dirent, int entries, struct cpmI
 					}
 					any = 1;
 					if (iflag || l) {
-						cpmNamei(ino, dirent[i], &file);
+						statFile(ino, dirent[i], &file);
 						cpmStat(&file, &statbuf);
 					}
 					if (iflag) {
@@ -411,7 +445,7 @@ static void lsattr(struct cpmSuperBlock *sb, char **dirent, int entries, struct
 					}
 					any = 1;
 
-					cpmNamei(ino, dirent[i], &file);
+					statFile(ino, dirent[i], &file);
 					cpmStat(&file, &statbuf);
 					cpmAttrGet(&file, &attrib);
 
@@ -455,6 +489,7 @@ int main(int argc, char *argv[]) {
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "cT:f:ih?dDFlAuU")) != EOF) {
 		switch (c) {
 		case 'f':
@@ -538,6 +573,7 @@ int main(int argc, char *argv[]) {
 		ls(&super, gargv, gargc, &root, style == 4, changetime, inode, unsorted);
 	}
 	cpmglobfree(gargv, gargc);
+	free(files);
 	cpmUmount(&super);
 	exit(0);
 }
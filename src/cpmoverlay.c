@@ -0,0 +1,56 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "getopt_.h"
+#include "device.h"
+
+const char cmd[] = "cpmoverlay";
+
+static void usage(void) {
+	fprintf(stderr, "Usage: %s create image delta\n", cmd);
+	fprintf(stderr, "       %s [-v] commit delta\n", cmd);
+	fprintf(stderr, "       %s discard delta\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *err = NULL;
+	long sectors;
+	int c, verbose = 0;
+
+	while ((c = getopt(argc, argv, "vh?")) != EOF) {
+		switch (c) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		case '?':
+			usage();
+			break;
+		}
+	}
+	if (optind >= argc) {
+		usage();
+	}
+	if (strcmp(argv[optind], "create") == 0 && argc - optind == 3) {
+		err = Overlay_create(argv[optind + 2], argv[optind + 1]);
+	} else if (strcmp(argv[optind], "commit") == 0 && argc - optind == 2) {
+		err = Overlay_commit(argv[optind + 1], &sectors);
+		if (err == NULL && verbose) {
+			printf("%ld sectors committed\n", sectors);
+		}
+	} else if (strcmp(argv[optind], "discard") == 0 && argc - optind == 2) {
+		err = Overlay_discard(argv[optind + 1]);
+	} else {
+		usage();
+	}
+	if (err) {
+		fprintf(stderr, "%s: can not %s %s: %s\n", cmd, argv[optind], argv[argc - 1], err);
+		exit(1);
+	}
+	exit(0);
+}
@@ -17,15 +17,14 @@ int main(int argc, char *argv[]) {
 	const char *format;
 	const char *devopts = NULL;
 	int uppercase = 0;
-	int c, i, usage = 0, exitcode = 0;
+	int c, usage = 0, exitcode = 0;
 	struct cpmSuperBlock drive;
 	struct cpmInode root;
-	int gargc;
-	char **gargv;
 
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "T:f:uh?")) != EOF) {
 		switch (c) {
 		case 'T':
@@ -62,12 +61,9 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "%s: cannot read superblock (%s)\n", cmd, boo);
 		exit(1);
 	}
-	cpmglob(optind, argc, argv, &root, &gargc, &gargv);
-	for (i = 0; i < gargc; ++i) {
-		if (cpmUnlink(&root, gargv[i]) == -1) {
-			fprintf(stderr, "%s: can not erase %s: %s\n", cmd, gargv[i], boo);
-			exitcode = 1;
-		}
+	if (cpmUnlinkAll(&root, argc - optind, argv + optind) == -1) {
+		fprintf(stderr, "%s: can not erase files: %s\n", cmd, boo);
+		exitcode = 1;
 	}
 	cpmUmount(&drive);
 	exit(exitcode);
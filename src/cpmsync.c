@@ -0,0 +1,393 @@
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "getopt_.h"
+#include "cpmfs.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+const char cmd[] = "cpmsync";
+static int content = 0;
+static int dryrun = 0;
+static int verbose = 0;
+
+/* A regular file of the host directory */
+struct hostFile {
+	char name[2 + 8 + 1 + 3 + 1]; /* 00foobarxy.zzy\0 */
+	char *path;
+	struct stat st;
+};
+
+/*
+ * hostcmp -- compare two host files by their CP/M name
+ */
+static int hostcmp(const void *a, const void *b) {
+	return strcmp(((const struct hostFile *)a)->name, ((const struct hostFile *)b)->name);
+}
+
+/*
+ * hostsort -- sort host files by their CP/M name, then by their own
+ */
+static int hostsort(const void *a, const void *b) {
+	int cmp = hostcmp(a, b);
+
+	return (cmp ? cmp : strcmp(((const struct hostFile *)a)->path, ((const struct hostFile *)b)->path));
+}
+
+/*
+ * cpmName -- tell if a host file name has the 8.3 shape of a CP/M name
+ */
+static int cpmName(const char *name) {
+	const char *dot = strchr(name, '.');
+
+	if (dot == NULL) {
+		return strlen(name) <= 8;
+	}
+	return dot - name <= 8 && strchr(dot + 1, '.') == NULL && strlen(dot + 1) <= 3;
+}
+
+/*
+ * filecmp -- compare two image files by name
+ */
+static int filecmp(const void *a, const void *b) {
+	return strcmp(((const struct cpmDirStat *)a)->name, ((const struct cpmDirStat *)b)->name);
+}
+
+/*
+ * readHost -- list the regular files of a directory under their CP/M names
+ */
+static int readHost(const char *dir, int user, struct hostFile **files) {
+	DIR *d;
+	struct dirent *de;
+	int n = 0, capacity = 0;
+
+	*files = NULL;
+	if ((d = opendir(dir)) == NULL) {
+		fprintf(stderr, "%s: can not open %s: %s\n", cmd, dir, strerror(errno));
+		exit(1);
+	}
+	while ((de = readdir(d))) {
+		struct hostFile *f;
+		char *s;
+
+		if (n == capacity) {
+			capacity = (capacity ? 2 * capacity : 64);
+			if ((*files = realloc(*files, capacity * sizeof(struct hostFile))) == NULL) {
+				fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+				exit(1);
+			}
+		}
+		f = *files + n;
+		if ((f->path = malloc(strlen(dir) + strlen(de->d_name) + 2)) == NULL) {
+			fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+			exit(1);
+		}
+		sprintf(f->path, "%s/%s", dir, de->d_name);
+		if (stat(f->path, &f->st) == -1 || !S_ISREG(f->st.st_mode)) {
+			free(f->path);
+			continue;
+		}
+		if (de->d_name[0] == '.') {
+			free(f->path);
+			continue;
+		}
+		if (!cpmName(de->d_name)) {
+			fprintf(stderr, "%s: skipping %s: not a CP/M file name\n", cmd, f->path);
+			free(f->path);
+			continue;
+		}
+		/* the name cpmStatAll would return */
+		sprintf(f->name, "%02d", user);
+		strcpy(f->name + 2, de->d_name);
+		for (s = f->name + 2; *s; ++s) {
+			*s = (*s == ',' ? '/' : tolower((unsigned char)*s));
+		}
+		++n;
+	}
+	closedir(d);
+	if (n) {
+		int i, j;
+
+		qsort(*files, n, sizeof(struct hostFile), hostsort);
+		/* names that differ in case only are one CP/M file, the first is taken */
+		for (i = j = 1; i < n; ++i) {
+			if (strcmp((*files)[i].name, (*files)[j - 1].name) == 0) {
+				fprintf(stderr, "%s: skipping %s: same CP/M name as %s\n", cmd, (*files)[i].path, (*files)[j - 1].path);
+				free((*files)[i].path);
+			} else {
+				(*files)[j++] = (*files)[i];
+			}
+		}
+		n = j;
+	}
+	return n;
+}
+
+/*
+ * before -- tell if a file was modified before another one
+ *
+ * Host files modified before the image was written were seen by the last
+ * update, so a change since then can not hide in the minute of a stamp.
+ */
+static int before(const struct stat *a, const struct stat *b) {
+#ifdef __linux__
+	if (a->st_mtim.tv_sec == b->st_mtim.tv_sec) {
+		return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec;
+	}
+#endif
+	return a->st_mtime < b->st_mtime;
+}
+
+/*
+ * putFile -- print what is done to a file when asked to
+ */
+static void putFile(int status, const char *name) {
+	if (verbose || dryrun) {
+		printf("%c %d:%s\n", status, (name[0] - '0') * 10 + name[1] - '0', name + 2);
+	}
+}
+
+/*
+ * update -- write the blocks of a file that differ from the host file
+ *
+ * Blocks are written in place, so the file keeps its extents, and the
+ * file is truncated if the host file got shorter.  Returns 1 if the file
+ * changed, 0 if not and -1 on errors.
+ */
+static int update(struct cpmInode *ino, const struct hostFile *host) {
+	struct cpmFile file;
+	size_t len = ino->sb->blksiz;
+	char *hbuf, *ibuf;
+	off_t pos;
+	ssize_t got;
+	int fd, changed = 0;
+
+	if (cpmOpen(ino, &file, dryrun ? O_RDONLY : O_WRONLY) == -1) {
+		fprintf(stderr, "%s: can not open %s: %s\n", cmd, host->name, boo);
+		return -1;
+	}
+	if ((fd = open(host->path, O_RDONLY | O_BINARY)) == -1) {
+		fprintf(stderr, "%s: can not open %s: %s\n", cmd, host->path, strerror(errno));
+		cpmClose(&file);
+		return -1;
+	}
+	if ((hbuf = malloc(2 * len)) == NULL) {
+		fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+		exit(1);
+	}
+	ibuf = hbuf + len;
+	for (pos = 0; changed != -1; pos += got) {
+		ssize_t res = 0;
+
+		/* a whole block, unless at the end of the file */
+		for (got = 0; got < (ssize_t)len && (res = read(fd, hbuf + got, len - got)) > 0; got += res);
+		if (res == -1) {
+			fprintf(stderr, "%s: can not read %s: %s\n", cmd, host->path, strerror(errno));
+			changed = -1;
+		}
+		if (got <= 0 || changed == -1) {
+			break;
+		}
+		if (pos + got <= ino->size && cpmPread(&file, ibuf, got, pos) == got
+			&& memcmp(hbuf, ibuf, got) == 0) {
+			continue;
+		}
+		changed = 1;
+		if (dryrun) {
+			break;
+		}
+		if (cpmPwrite(&file, hbuf, got, pos) != got) {
+			fprintf(stderr, "%s: can not write %s: %s\n", cmd, host->name, boo);
+			changed = -1;
+		}
+	}
+	cpmClose(&file);
+	close(fd);
+	free(hbuf);
+	if (changed != -1 && ino->size > host->st.st_size) {
+		changed = 1;
+		if (!dryrun && cpmTruncate(ino, host->st.st_size) == -1) {
+			fprintf(stderr, "%s: can not truncate %s: %s\n", cmd, host->name, boo);
+			changed = -1;
+		}
+	}
+	return changed;
+}
+
+int main(int argc, char *argv[]) {
+	const char *err;
+	const char *image, *dir;
+	const char *format;
+	const char *devopts = NULL;
+	int c, i, usage = 0, user = 0, exitcode = 0;
+	struct cpmInode root;
+	struct cpmSuperBlock super;
+	struct cpmDirStat *files;
+	struct hostFile *host;
+	struct stat written;
+	char **gone;
+	int nfiles, nhost, ngone;
+
+	if (!(format = getenv("CPMTOOLSFMT"))) {
+		format = FORMAT;
+	}
+	argc = cpmStatsArgs(argc, argv);
+	while ((c = getopt(argc, argv, "T:f:cnvh?")) != EOF) {
+		switch (c) {
+		case 'T':
+			devopts = optarg;
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 'c':
+			content = 1;
+			break;
+		case 'n':
+			dryrun = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		case '?':
+			usage = 1;
+			break;
+		}
+	}
+	if (optind == argc - 3) {
+		const char *u = argv[argc - 1];
+
+		if (isdigit(u[0]) && u[1] == ':' && u[2] == '\0') {
+			user = u[0] - '0';
+		} else if (isdigit(u[0]) && isdigit(u[1]) && u[2] == ':' && u[3] == '\0') {
+			user = 10 * (u[0] - '0') + u[1] - '0';
+		} else {
+			usage = 1;
+		}
+	} else if (optind != argc - 2) {
+		usage = 1;
+	}
+
+	if (usage) {
+		fprintf(stderr, "Usage: %s [-f format] [-c] [-n] [-v] image directory [user:]\n", cmd);
+		exit(1);
+	}
+	image = argv[optind];
+	dir = argv[optind + 1];
+	nhost = readHost(dir, user, &host);
+	if (stat(image, &written) == -1 || !S_ISREG(written.st_mode)) {
+		/* no time to go by, so all contents are compared */
+		memset(&written, 0, sizeof(written));
+	}
+	err = Device_open(&super.dev, image, dryrun ? O_RDONLY : O_RDWR, devopts);
+	if (err) {
+		fprintf(stderr, "%s: cannot open %s (%s)\n", cmd, image, err);
+		exit(1);
+	}
+	if (cpmReadSuper(&super, &root, format, 0) == -1) {
+		fprintf(stderr, "%s: cannot read superblock (%s)\n", cmd, boo);
+		exit(1);
+	}
+	if ((nfiles = cpmStatAll(&root, &files)) == -1) {
+		fprintf(stderr, "%s: cannot read directory (%s)\n", cmd, boo);
+		exit(1);
+	}
+	qsort(files, nfiles, sizeof(struct cpmDirStat), filecmp);
+
+	/* remove the files of the user that are gone, in one go to free their space first */
+	if ((gone = malloc((nfiles ? nfiles : 1) * sizeof(char *))) == NULL) {
+		fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+		exit(1);
+	}
+	for (ngone = i = 0; i < nfiles; ++i) {
+		struct hostFile key;
+		char *name = files[i].name;
+
+		if ((name[0] - '0') * 10 + name[1] - '0' != user || strcmp(name, "00!!!time&.dat") == 0) {
+			/* another user, or the time stamps of DateStamper */
+			continue;
+		}
+		strcpy(key.name, name);
+		if (nhost == 0 || bsearch(&key, host, nhost, sizeof(struct hostFile), hostcmp) == NULL) {
+			putFile('-', name);
+			/* as a pattern of the form user:name */
+			if ((gone[ngone] = malloc(3 + 8 + 1 + 3 + 1)) == NULL) {
+				fprintf(stderr, "%s: %s\n", cmd, strerror(errno));
+				exit(1);
+			}
+			sprintf(gone[ngone++], "%d:%s", user, name + 2);
+		}
+	}
+	if (ngone && !dryrun && cpmUnlinkAll(&root, ngone, gone) == -1) {
+		fprintf(stderr, "%s: can not remove files: %s\n", cmd, boo);
+		exitcode = 1;
+	}
+	for (i = 0; i < ngone; ++i) {
+		free(gone[i]);
+	}
+	free(gone);
+
+	/* create new files and update changed ones */
+	for (i = 0; i < nhost; ++i) {
+		struct cpmDirStat key, *found = NULL;
+		struct cpmInode ino;
+		int changed;
+
+		strcpy(key.name, host[i].name);
+		if (nfiles) {
+			found = bsearch(&key, files, nfiles, sizeof(struct cpmDirStat), filecmp);
+		}
+		if (found) {
+			ino = found->ino;
+			if (!content && ino.size == host[i].st.st_size && ino.mtime != 0
+				&& ino.mtime / 60 == host[i].st.st_mtime / 60 && before(&host[i].st, &written)) {
+				/* time stamps only keep the minute */
+				continue;
+			}
+		} else {
+			putFile('+', host[i].name);
+			if (dryrun) {
+				continue;
+			}
+			if (cpmCreat(&root, host[i].name, &ino, 0666) == -1) {
+				fprintf(stderr, "%s: can not create %s: %s\n", cmd, host[i].name, boo);
+				exitcode = 1;
+				continue;
+			}
+		}
+		if ((changed = update(&ino, host + i)) == -1) {
+			exitcode = 1;
+			continue;
+		}
+		if (found && changed) {
+			putFile('M', host[i].name);
+		}
+		if (!dryrun && (changed || ino.mtime / 60 != host[i].st.st_mtime / 60)) {
+			struct utimbuf times;
+
+			times.actime = host[i].st.st_atime;
+			times.modtime = host[i].st.st_mtime;
+			cpmUtime(&ino, &times);
+		}
+	}
+	for (i = 0; i < nhost; ++i) {
+		free(host[i].path);
+	}
+	free(host);
+	free(files);
+	/* the directory is written once, here */
+	cpmUmount(&super);
+	exit(exitcode);
+}
@@ -0,0 +1,76 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "getopt_.h"
+#include "device.h"
+
+const char cmd[] = "cpmzimg";
+
+/* The largest chunk, in KiB; a reader keeps a few in memory */
+#define ZIMG_MAX_CHUNK 16384
+
+#ifdef HAVE_ZLIB_H
+int main(int argc, char *argv[]) {
+	const char *err;
+	int c, usage = 0, decompress = 0;
+	int level = -1;
+	unsigned chunkSize = 64 * 1024;
+	long value;
+	char *end;
+
+	while ((c = getopt(argc, argv, "c:dl:h?")) != EOF) {
+		switch (c) {
+		case 'c':
+			value = strtol(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' || value <= 0 || value > ZIMG_MAX_CHUNK) {
+				usage = 1;
+			} else {
+				chunkSize = value * 1024;
+			}
+			break;
+		case 'd':
+			decompress = 1;
+			break;
+		case 'l':
+			value = strtol(optarg, &end, 0);
+			level = value;
+			if (*optarg == '\0' || *end != '\0' || value < 0 || value > 9) {
+				usage = 1;
+			}
+			break;
+		case 'h':
+		case '?':
+			usage = 1;
+			break;
+		}
+	}
+	if (optind != (argc - 2)) {
+		usage = 1;
+	}
+
+	if (usage) {
+		fprintf(stderr, "Usage: %s [-c chunk-KiB] [-l level] image container\n", cmd);
+		fprintf(stderr, "       %s -d container image\n", cmd);
+		exit(1);
+	}
+	if (decompress) {
+		err = Zimg_decompress(argv[optind], argv[optind + 1]);
+	} else {
+		err = Zimg_compress(argv[optind], argv[optind + 1], chunkSize, level);
+	}
+	if (err) {
+		fprintf(stderr, "%s: can not convert %s: %s\n", cmd, argv[optind], err);
+		exit(1);
+	}
+	exit(0);
+}
+#else
+int main(int argc, char *argv[]) {
+	fprintf(stderr, "%s: built without zlib\n", cmd);
+	exit(1);
+}
+#endif
@@ -0,0 +1,697 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "device.h"
+
+/* Number of leading bytes of an image passed to the probe functions */
+#define PROBE_LENGTH 32
+
+/*
+ * The driver table.  When no driver is named, the first one whose probe
+ * accepts the image and that manages to open it is used, so specialised
+ * drivers come first and the generic one last.
+ */
+static const struct DeviceDriver *const drivers[] = {
+#ifdef HAVE_LIBDSK_H
+	&libdskDriver,
+#endif
+	&memDriver,
+#ifdef HAVE_ZLIB_H
+	&zimgDriver,
+#endif
+#ifdef _WIN32
+	&win32Driver,
+#else
+	&dedupDriver,
+	&overlayDriver,
+	&mmapDriver,
+	&posixDriver,
+#endif
+	NULL
+};
+
+/*
+ * The driver for -T arguments that do not name a driver, which keeps the
+ * old libdsk type and option syntax working.
+ */
+#if defined(HAVE_LIBDSK_H)
+#define COMPAT_DRIVER (&libdskDriver)
+#elif defined(_WIN32)
+#define COMPAT_DRIVER (&win32Driver)
+#else
+#define COMPAT_DRIVER (&posixDriver)
+#endif
+
+/*
+ * lookupDriver -- find the driver named by a driver[:options] argument
+ */
+static const struct DeviceDriver *lookupDriver(const char *deviceOpts, const char **opts) {
+	size_t len;
+	int i;
+
+	len = strcspn(deviceOpts, ":");
+	for (i = 0; drivers[i]; ++i) {
+		if (strlen(drivers[i]->name) == len && strncmp(drivers[i]->name, deviceOpts, len) == 0) {
+			*opts = (deviceOpts[len] == ':' ? deviceOpts + len + 1 : NULL);
+			return drivers[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * autoOpen -- open an image with the first driver that wants it
+ */
+static const char *autoOpen(struct Device *self, const char *filename, int mode) {
+	struct stat st, *stp = NULL;
+	unsigned char head[PROBE_LENGTH];
+	size_t headLength = 0;
+	const char *err = "no device driver accepts the image";
+	int i;
+
+	if (stat(filename, &st) == 0) {
+		stp = &st;
+		if (S_ISREG(st.st_mode)) {
+			int fd;
+			ssize_t res;
+
+			fd = open(filename, O_RDONLY);
+			if (fd != -1) {
+				res = read(fd, head, sizeof(head));
+				headLength = (res > 0 ? res : 0);
+				close(fd);
+			}
+		}
+	}
+	for (i = 0; drivers[i]; ++i) {
+		if (drivers[i]->probe && !drivers[i]->probe(filename, mode, stp, head, headLength)) {
+			continue;
+		}
+		self->driver = drivers[i];
+		err = drivers[i]->open(self, filename, mode, NULL);
+		if (err == NULL) {
+			return NULL;
+		}
+	}
+	return err;
+}
+
+/*
+ * Device_clock -- monotonic clock in nanoseconds
+ */
+long long Device_clock(void) {
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return (long long)clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * The driver* functions call the driver and keep the statistics.
+ */
+
+/*
+ * driverRead -- read a sector through the driver
+ */
+static const char *driverRead(const struct Device *self, int track, int sector, unsigned char *buf) {
+	const char *err;
+	long long start;
+
+	if (self->stats == NULL) {
+		return self->driver->readSector(self, track, sector, buf);
+	}
+	start = Device_clock();
+	err = self->driver->readSector(self, track, sector, buf);
+	self->stats->ioNanos += Device_clock() - start;
+	++self->stats->reads;
+	self->stats->bytesRead += self->secLength;
+	return err;
+}
+
+/*
+ * driverWrite -- write a sector through the driver
+ */
+static const char *driverWrite(const struct Device *self, int track, int sector, const unsigned char *buf) {
+	const char *err;
+	long long start;
+
+	if (self->stats == NULL) {
+		return self->driver->writeSector(self, track, sector, buf);
+	}
+	start = Device_clock();
+	err = self->driver->writeSector(self, track, sector, buf);
+	self->stats->ioNanos += Device_clock() - start;
+	++self->stats->writes;
+	self->stats->bytesWritten += self->secLength;
+	return err;
+}
+
+/*
+ * driverQueueRead -- queue reading a sector, or read it if the driver can not queue
+ */
+static const char *driverQueueRead(const struct Device *self, int track, int sector, unsigned char *buf) {
+	const char *err;
+	long long start;
+
+	if (self->driver->queueRead == NULL) {
+		return driverRead(self, track, sector, buf);
+	}
+	if (self->stats == NULL) {
+		return self->driver->queueRead(self, track, sector, buf);
+	}
+	start = Device_clock();
+	err = self->driver->queueRead(self, track, sector, buf);
+	self->stats->ioNanos += Device_clock() - start;
+	++self->stats->reads;
+	self->stats->bytesRead += self->secLength;
+	return err;
+}
+
+/*
+ * driverQueueWrite -- queue writing a sector, or write it if the driver can not queue
+ */
+static const char *driverQueueWrite(const struct Device *self, int track, int sector, const unsigned char *buf) {
+	const char *err;
+	long long start;
+
+	if (self->driver->queueWrite == NULL) {
+		return driverWrite(self, track, sector, buf);
+	}
+	if (self->stats == NULL) {
+		return self->driver->queueWrite(self, track, sector, buf);
+	}
+	start = Device_clock();
+	err = self->driver->queueWrite(self, track, sector, buf);
+	self->stats->ioNanos += Device_clock() - start;
+	++self->stats->writes;
+	self->stats->bytesWritten += self->secLength;
+	return err;
+}
+
+/*
+ * driverComplete -- wait for the queued transfers of the driver
+ */
+static const char *driverComplete(const struct Device *self) {
+	const char *err;
+	long long start;
+
+	if (self->driver->complete == NULL) {
+		return NULL;
+	}
+	if (self->stats == NULL) {
+		return self->driver->complete(self);
+	}
+	start = Device_clock();
+	err = self->driver->complete(self);
+	self->stats->ioNanos += Device_clock() - start;
+	return err;
+}
+
+/* Default size of the sector cache in KiB, CPMTOOLS_CACHE overrides it */
+#define CACHE_KIB 256
+
+/*
+ * Sectors are kept in a size-bounded LRU cache between the file system
+ * and the driver.  Writes only dirty the cached copy, which goes back to
+ * the device when it is evicted or by Device_sync and Device_close, so
+ * directory sectors written by every cpmWrite and cpmClose reach the
+ * device once.  Drivers that keep the image in memory or cache it
+ * themselves, like the track cache of libdsk, are not cached again.
+ */
+struct CacheEntry {
+	long lsect;                     /* track * sectrk + sector, -1 if free */
+	int dirty;
+	unsigned char *buf;             /* caller buffer of a queued read */
+	struct CacheEntry *prev, *next; /* LRU list, most recent first */
+	struct CacheEntry *hnext;       /* hash chain */
+	unsigned char *data;
+};
+
+struct SectorCache {
+	int entries;
+	unsigned hashMask;
+	struct CacheEntry **hash;
+	struct CacheEntry *table;
+	struct CacheEntry *head, *tail;
+	unsigned char *data;
+	int pending;                    /* queued reads not yet completed */
+	struct CacheEntry **queued;
+	unsigned long hits, misses;
+};
+
+/*
+ * cacheUnlink -- take an entry out of the LRU list
+ */
+static void cacheUnlink(struct SectorCache *c, struct CacheEntry *e) {
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		c->head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		c->tail = e->prev;
+	}
+}
+
+/*
+ * cacheTouch -- make an entry the most recently used one
+ */
+static void cacheTouch(struct SectorCache *c, struct CacheEntry *e) {
+	if (c->head == e) {
+		return;
+	}
+	cacheUnlink(c, e);
+	e->prev = NULL;
+	e->next = c->head;
+	c->head->prev = e;
+	c->head = e;
+}
+
+/*
+ * cacheLookup -- find the entry of a sector, NULL if it is not cached
+ */
+static struct CacheEntry *cacheLookup(const struct SectorCache *c, long lsect) {
+	struct CacheEntry *e;
+
+	for (e = c->hash[lsect & c->hashMask]; e && e->lsect != lsect; e = e->hnext);
+	return e;
+}
+
+/*
+ * cacheForget -- drop an entry from the hash and make it the next victim
+ */
+static void cacheForget(struct SectorCache *c, struct CacheEntry *e) {
+	struct CacheEntry **p;
+
+	for (p = &c->hash[e->lsect & c->hashMask]; *p != e; p = &(*p)->hnext);
+	*p = e->hnext;
+	e->lsect = -1;
+	e->dirty = 0;
+	e->buf = NULL;
+	if (c->tail != e) {
+		cacheUnlink(c, e);
+		e->next = NULL;
+		e->prev = c->tail;
+		c->tail->next = e;
+		c->tail = e;
+	}
+}
+
+/*
+ * cacheAlloc -- get an entry for a sector, writing back the victim
+ *
+ * The least recently used entry without a queued read is reused.  *entry
+ * is set to NULL if all entries wait for queued reads.
+ */
+static const char *cacheAlloc(const struct Device *self, long lsect, struct CacheEntry **entry) {
+	struct SectorCache *c = self->sectorCache;
+	struct CacheEntry *e;
+
+	for (e = c->tail; e && e->buf; e = e->prev);
+	*entry = e;
+	if (e == NULL) {
+		return NULL;
+	}
+	if (e->lsect != -1) {
+		if (e->dirty) {
+			const char *err;
+
+			err = driverWrite(self, e->lsect / self->sectrk, e->lsect % self->sectrk, e->data);
+			if (err) {
+				*entry = NULL;
+				return err;
+			}
+		}
+		cacheForget(c, e);
+	}
+	e->lsect = lsect;
+	e->hnext = c->hash[lsect & c->hashMask];
+	c->hash[lsect & c->hashMask] = e;
+	cacheTouch(c, e);
+	return NULL;
+}
+
+/*
+ * cacheFlush -- write back all dirty sectors
+ */
+static const char *cacheFlush(const struct Device *self) {
+	struct SectorCache *c = self->sectorCache;
+	struct CacheEntry *e;
+	const char *err = NULL, *cerr;
+
+	for (e = c->head; e && err == NULL; e = e->next) {
+		if (e->dirty) {
+			err = driverQueueWrite(self, e->lsect / self->sectrk, e->lsect % self->sectrk, e->data);
+		}
+	}
+	cerr = driverComplete(self);
+	if (err == NULL) {
+		err = cerr;
+	}
+	if (err == NULL) {
+		for (e = c->head; e; e = e->next) {
+			e->dirty = 0;
+		}
+	}
+	return err;
+}
+
+/*
+ * cacheFree -- write back and release the cache
+ */
+static const char *cacheFree(struct Device *self) {
+	struct SectorCache *c = self->sectorCache;
+	const char *err;
+
+	if (c == NULL) {
+		return NULL;
+	}
+	err = cacheFlush(self);
+	free(c->queued);
+	free(c->hash);
+	free(c->table);
+	free(c->data);
+	free(c);
+	self->sectorCache = NULL;
+	return err;
+}
+
+/*
+ * cacheInit -- set up the cache for the current geometry, if wanted
+ */
+static void cacheInit(struct Device *self) {
+	struct SectorCache *c;
+	const char *size;
+	long kib = CACHE_KIB;
+	int i;
+
+	self->sectorCache = NULL;
+	if ((size = getenv("CPMTOOLS_CACHE"))) {
+		kib = strtol(size, NULL, 0);
+	}
+	if (self->driver->inCore || kib <= 0 || self->secLength <= 0 || kib * 1024 / self->secLength < 1) {
+		return;
+	}
+	if ((c = malloc(sizeof(struct SectorCache))) == NULL) {
+		return;
+	}
+	memset(c, 0, sizeof(struct SectorCache));
+	c->entries = kib * 1024 / self->secLength;
+	for (c->hashMask = 1; c->hashMask < (unsigned)c->entries; c->hashMask <<= 1);
+	c->hash = calloc(c->hashMask, sizeof(struct CacheEntry *));
+	--c->hashMask;
+	c->table = calloc(c->entries, sizeof(struct CacheEntry));
+	c->queued = malloc(c->entries * sizeof(struct CacheEntry *));
+	c->data = malloc((size_t)c->entries * self->secLength);
+	if (c->hash == NULL || c->table == NULL || c->queued == NULL || c->data == NULL) {
+		/* run uncached rather than fail */
+		free(c->queued);
+		free(c->hash);
+		free(c->table);
+		free(c->data);
+		free(c);
+		return;
+	}
+	for (i = 0; i < c->entries; ++i) {
+		c->table[i].lsect = -1;
+		c->table[i].data = c->data + (size_t)i * self->secLength;
+		c->table[i].prev = (i ? &c->table[i - 1] : NULL);
+		c->table[i].next = (i + 1 < c->entries ? &c->table[i + 1] : NULL);
+	}
+	c->head = &c->table[0];
+	c->tail = &c->table[c->entries - 1];
+	self->sectorCache = c;
+}
+
+/*
+ * Device_open -- Open an image file
+ */
+const char *Device_open(struct Device *self, const char *filename, int mode, const char *deviceOpts) {
+	const char *opts;
+
+	self->opened = 0;
+	self->driver = NULL;
+	self->sectorCache = NULL;
+	self->stats = NULL;
+	self->direct = 0;
+	self->priv = NULL;
+	if (deviceOpts == NULL || strcmp(deviceOpts, "auto") == 0) {
+		return autoOpen(self, filename, mode);
+	}
+	self->driver = lookupDriver(deviceOpts, &opts);
+	if (self->driver == NULL) {
+		self->driver = COMPAT_DRIVER;
+		opts = deviceOpts;
+	}
+	return self->driver->open(self, filename, mode, opts);
+}
+
+/*
+ * Device_setGeometry -- Set disk geometry
+ */
+const char *Device_setGeometry(struct Device *self, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	const char *err;
+
+	if (!self->opened) {
+		/* no image yet, as for mkfs.cpm: just remember the geometry */
+		self->secLength = secLength;
+		self->sectrk = sectrk;
+		self->tracks = tracks;
+		self->offset = offset;
+		return NULL;
+	}
+	err = cacheFree(self);
+	if (err) {
+		return err;
+	}
+	err = self->driver->setGeometry(self, secLength, sectrk, tracks, offset, libdskGeometry);
+	if (err == NULL) {
+		cacheInit(self);
+	}
+	return err;
+}
+
+/*
+ * Device_close -- Close an image file
+ */
+const char *Device_close(struct Device *self) {
+	const char *err, *cerr;
+	long long start = 0;
+
+	if (self->stats) {
+		start = Device_clock();
+	}
+	err = cacheFree(self);
+	cerr = self->driver->close(self);
+	if (self->stats) {
+		self->stats->ioNanos += Device_clock() - start;
+	}
+	return (err ? err : cerr);
+}
+
+/*
+ * Device_sync -- write back buffered sectors
+ */
+const char *Device_sync(struct Device *self) {
+	const char *err;
+	long long start = 0;
+
+	if (self->stats) {
+		start = Device_clock();
+	}
+	err = (self->sectorCache ? cacheFlush(self) : NULL);
+	if (err == NULL) {
+		err = self->driver->sync(self);
+	}
+	if (self->stats) {
+		self->stats->ioNanos += Device_clock() - start;
+	}
+	return err;
+}
+
+/*
+ * Device_readSector -- read a physical sector
+ */
+const char *Device_readSector(const struct Device *self, int track, int sector, unsigned char *buf) {
+	struct SectorCache *c = self->sectorCache;
+	struct CacheEntry *e;
+	long lsect;
+	const char *err;
+
+	if (c == NULL) {
+		return driverRead(self, track, sector, buf);
+	}
+	lsect = (long)track * self->sectrk + sector;
+	e = cacheLookup(c, lsect);
+	if (e && e->buf == NULL) {
+		++c->hits;
+		cacheTouch(c, e);
+		memcpy(buf, e->data, self->secLength);
+		return NULL;
+	}
+	++c->misses;
+	if (e == NULL) {
+		err = cacheAlloc(self, lsect, &e);
+		if (err) {
+			return err;
+		}
+	} else {
+		e = NULL; /* a queued read is still on its way */
+	}
+	if (e == NULL) {
+		return driverRead(self, track, sector, buf);
+	}
+	err = driverRead(self, track, sector, e->data);
+	if (err) {
+		cacheForget(c, e);
+		return err;
+	}
+	memcpy(buf, e->data, self->secLength);
+	return NULL;
+}
+
+/*
+ * Device_writeSector -- write physical sector
+ */
+const char *Device_writeSector(const struct Device *self, int track, int sector, const unsigned char *buf) {
+	struct SectorCache *c = self->sectorCache;
+	struct CacheEntry *e;
+	long lsect;
+	const char *err;
+
+	if (c == NULL) {
+		return driverWrite(self, track, sector, buf);
+	}
+	lsect = (long)track * self->sectrk + sector;
+	e = cacheLookup(c, lsect);
+	if (e == NULL) {
+		err = cacheAlloc(self, lsect, &e);
+		if (err) {
+			return err;
+		}
+	} else if (e->buf) {
+		e = NULL;
+	}
+	if (e == NULL) {
+		return driverWrite(self, track, sector, buf);
+	}
+	cacheTouch(c, e);
+	memcpy(e->data, buf, self->secLength);
+	e->dirty = 1;
+	return NULL;
+}
+
+/*
+ * Device_queueRead -- queue reading a physical sector
+ */
+const char *Device_queueRead(const struct Device *self, int track, int sector, unsigned char *buf) {
+	struct SectorCache *c = self->sectorCache;
+	struct CacheEntry *e;
+	long lsect;
+	const char *err;
+
+	if (self->driver->queueRead == NULL) {
+		return Device_readSector(self, track, sector, buf);
+	}
+	if (c == NULL) {
+		return driverQueueRead(self, track, sector, buf);
+	}
+	lsect = (long)track * self->sectrk + sector;
+	e = cacheLookup(c, lsect);
+	if (e && e->buf == NULL) {
+		++c->hits;
+		cacheTouch(c, e);
+		memcpy(buf, e->data, self->secLength);
+		return NULL;
+	}
+	++c->misses;
+	if (e == NULL) {
+		err = cacheAlloc(self, lsect, &e);
+		if (err) {
+			return err;
+		}
+	} else {
+		e = NULL;
+	}
+	if (e == NULL) {
+		return driverQueueRead(self, track, sector, buf);
+	}
+	/* read into the cache, Device_complete copies to the caller */
+	e->buf = buf;
+	c->queued[c->pending++] = e;
+	return driverQueueRead(self, track, sector, e->data);
+}
+
+/*
+ * Device_queueWrite -- queue writing a physical sector
+ */
+const char *Device_queueWrite(const struct Device *self, int track, int sector, const unsigned char *buf) {
+	if (self->sectorCache) {
+		/* the write only goes to the cache */
+		return Device_writeSector(self, track, sector, buf);
+	}
+	return driverQueueWrite(self, track, sector, buf);
+}
+
+/*
+ * Device_complete -- wait for all queued transfers
+ */
+const char *Device_complete(const struct Device *self) {
+	struct SectorCache *c = self->sectorCache;
+	const char *err;
+	int i;
+
+	err = driverComplete(self);
+	if (c) {
+		for (i = 0; i < c->pending; ++i) {
+			struct CacheEntry *e = c->queued[i];
+
+			if (err) {
+				/* which transfer failed is unknown, so trust none */
+				cacheForget(c, e);
+			} else {
+				memcpy(e->buf, e->data, self->secLength);
+				e->buf = NULL;
+			}
+		}
+		c->pending = 0;
+	}
+	return err;
+}
+
+/*
+ * Device_rawFd -- the image file, if its bytes are the sectors
+ */
+int Device_rawFd(const struct Device *self) {
+	if (!self->opened || !self->driver->raw || self->direct) {
+		return -1;
+	}
+	if (self->sectorCache && cacheFlush(self)) {
+		return -1;
+	}
+	return self->fd;
+}
+
+/*
+ * Device_cacheStats -- sector cache hits and misses
+ */
+void Device_cacheStats(const struct Device *self, unsigned long *hits, unsigned long *misses) {
+	if (self->sectorCache) {
+		*hits = self->sectorCache->hits;
+		*misses = self->sectorCache->misses;
+	} else {
+		*hits = *misses = 0;
+	}
+}
@@ -8,8 +8,50 @@
 #define CPMDRV_WINNT 2 /* Windows NT floppy drive accessed via CreateFile */
 #endif
 
+struct Device;
+struct stat;
+
+/*
+ * A device driver implements sector I/O for one kind of image.  All
+ * drivers are linked into every tool and Device_open picks one at run
+ * time, either by name or by looking at the image.
+ */
+struct DeviceDriver {
+	const char *name;
+	int inCore;   /* sectors are in memory already or the driver caches
+	                 them itself, do not cache them again */
+	int raw;      /* sectors are the bytes of the image file at fd */
+	/* does the driver want this image when none was named?  head holds
+	 * the first bytes of a regular file, st is NULL if stat failed */
+	int (*probe)(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength);
+	const char *(*open)(struct Device *self, const char *filename, int mode, const char *deviceOpts);
+	const char *(*setGeometry)(struct Device *self, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry);
+	const char *(*close)(struct Device *self);
+	const char *(*sync)(struct Device *self);
+	const char *(*readSector)(const struct Device *self, int track, int sector, unsigned char *buf);
+	const char *(*writeSector)(const struct Device *self, int track, int sector, const unsigned char *buf);
+	/* optional batching, NULL if transfers are done right away */
+	const char *(*queueRead)(const struct Device *self, int track, int sector, unsigned char *buf);
+	const char *(*queueWrite)(const struct Device *self, int track, int sector, const unsigned char *buf);
+	const char *(*complete)(const struct Device *self);
+};
+
+/* I/O statistics, kept only if a tool asks for them */
+struct DeviceStats {
+	unsigned long reads, writes;             /* sectors transferred by the driver */
+	unsigned long long bytesRead, bytesWritten;
+	unsigned long syscalls;                  /* system calls of the driver */
+	long long ioNanos;                       /* wall time spent in the driver */
+};
+
+/* count system calls of a driver */
+#define DEVICE_SYSCALLS(dev, n) ((dev)->stats ? (void)((dev)->stats->syscalls += (n)) : (void)0)
+
 struct Device {
+	const struct DeviceDriver *driver;
 	int opened;
+	struct SectorCache *sectorCache; /* LRU sector cache, see device.c */
+	struct DeviceStats *stats;       /* NULL if not wanted */
 
 	int secLength;
 	int tracks;
@@ -24,12 +66,75 @@ struct Device {
 	HANDLE hdisk;
 #endif
 	int fd;
+	int direct;            /* O_DIRECT was asked for, so fd is no plain file */
+	void *priv;            /* state of the driver, allocated by its open */
 };
 
+#ifdef HAVE_LIBDSK_H
+extern const struct DeviceDriver libdskDriver;
+#endif
+#ifdef _WIN32
+extern const struct DeviceDriver win32Driver;
+#else
+extern const struct DeviceDriver posixDriver;
+extern const struct DeviceDriver mmapDriver;
+extern const struct DeviceDriver overlayDriver;
+extern const struct DeviceDriver dedupDriver;
+#endif
+extern const struct DeviceDriver memDriver;
+#ifdef HAVE_ZLIB_H
+extern const struct DeviceDriver zimgDriver;
+#endif
+
 const char *Device_open(struct Device *self, const char *filename, int mode, const char *deviceOpts);
 const char *Device_setGeometry(struct Device *self, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry);
 const char *Device_close(struct Device *self);
+const char *Device_sync(struct Device *self);
 const char *Device_readSector(const struct Device *self, int track, int sector, unsigned char *buf);
 const char *Device_writeSector(const struct Device *self, int track, int sector, const unsigned char *buf);
 
+/* Batched sector I/O: transfers are queued and only guaranteed to be done
+ * after Device_complete, which returns the first error of the batch.
+ * Drivers without asynchronous I/O perform them right away.  Transfers
+ * in one batch must not overlap.
+ */
+const char *Device_queueRead(const struct Device *self, int track, int sector, unsigned char *buf);
+const char *Device_queueWrite(const struct Device *self, int track, int sector, const unsigned char *buf);
+const char *Device_complete(const struct Device *self);
+
+/* The image file of a device whose sectors are its bytes, for copying
+ * them without the driver, or -1.  Cached sectors are written back first.
+ */
+int Device_rawFd(const struct Device *self);
+
+/* Sector cache statistics, both 0 if the device is not cached */
+void Device_cacheStats(const struct Device *self, unsigned long *hits, unsigned long *misses);
+
+#ifndef _WIN32
+/* Deltas of the overlay driver: make one on top of an image, write its
+ * sectors to the image below, or forget them.
+ */
+const char *Overlay_create(const char *delta, const char *base);
+const char *Overlay_commit(const char *delta, long *sectors);
+const char *Overlay_discard(const char *delta);
+
+/* Images in a content-addressed store, read by the dedup driver */
+struct DedupStats {
+	unsigned long chunks, stored;              /* chunks read, new in the store */
+	unsigned long long bytes, storedBytes;
+};
+
+const char *Dedup_ingest(const char *image, const char *manifest, unsigned chunkSize, struct DedupStats *stats);
+const char *Dedup_restore(const char *manifest, const char *image);
+#endif
+
+#ifdef HAVE_ZLIB_H
+/* Containers of the zimg driver: convert from and to raw images */
+const char *Zimg_compress(const char *image, const char *container, unsigned chunkSize, int level);
+const char *Zimg_decompress(const char *container, const char *image);
+#endif
+
+/* Monotonic clock in nanoseconds for the statistics */
+long long Device_clock(void);
+
 #endif
@@ -0,0 +1,728 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * The dedup driver reads and writes images kept in a content-addressed
+ * store.  An image is cut into chunks, every chunk is stored once under
+ * its SHA-256 in the blocks directory of the store, and a manifest next
+ * to that directory lists the hashes of the chunks of one image, so
+ * images that share system tracks, programs or empty blocks share the
+ * chunks.  Tools open the manifest as the image.
+ *
+ * The manifest is text: the magic line, "chunk" and "size" lines giving
+ * the chunk size and image size, then one hash per chunk in hex.  A
+ * chunk with hash H is the file blocks/H[0..1]/H[2..63].
+ *
+ * Written chunks are hashed and stored when they leave the cache or by
+ * Device_sync, which also replaces the manifest.  Chunks are never
+ * removed, since other images may use them.
+ */
+#define DEDUP_MAGIC "CPMDEDUP 1\n"
+#define DEDUP_HASH 32
+
+/* Chunks kept in memory */
+#define DEDUP_CACHE 16
+
+/*
+ * SHA-256, FIPS 180-4
+ */
+struct Sha256 {
+	unsigned long state[8];
+	unsigned long long length;
+	unsigned char block[64];
+	int used;
+};
+
+static const unsigned long sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) ((((x) >> (n)) | ((x) << (32 - (n)))) & 0xffffffff)
+
+static void sha256Block(struct Sha256 *s, const unsigned char *p) {
+	unsigned long w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		w[i] = ((unsigned long)p[4 * i] << 24) | ((unsigned long)p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+	}
+	for (; i < 64; ++i) {
+		unsigned long s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		unsigned long s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+		w[i] = (w[i - 16] + s0 + w[i - 7] + s1) & 0xffffffff;
+	}
+	a = s->state[0], b = s->state[1], c = s->state[2], d = s->state[3];
+	e = s->state[4], f = s->state[5], g = s->state[6], h = s->state[7];
+	for (i = 0; i < 64; ++i) {
+		t1 = (h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i]) & 0xffffffff;
+		t2 = ((ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c))) & 0xffffffff;
+		h = g, g = f, f = e, e = (d + t1) & 0xffffffff;
+		d = c, c = b, b = a, a = (t1 + t2) & 0xffffffff;
+	}
+	s->state[0] = (s->state[0] + a) & 0xffffffff;
+	s->state[1] = (s->state[1] + b) & 0xffffffff;
+	s->state[2] = (s->state[2] + c) & 0xffffffff;
+	s->state[3] = (s->state[3] + d) & 0xffffffff;
+	s->state[4] = (s->state[4] + e) & 0xffffffff;
+	s->state[5] = (s->state[5] + f) & 0xffffffff;
+	s->state[6] = (s->state[6] + g) & 0xffffffff;
+	s->state[7] = (s->state[7] + h) & 0xffffffff;
+}
+
+static void sha256Init(struct Sha256 *s) {
+	static const unsigned long init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->state, init, sizeof(init));
+	s->length = 0;
+	s->used = 0;
+}
+
+static void sha256Update(struct Sha256 *s, const unsigned char *p, size_t n) {
+	s->length += n;
+	while (n > 0) {
+		size_t take = (64 - s->used < n ? 64 - s->used : n);
+
+		if (s->used == 0 && n >= 64) {
+			sha256Block(s, p);
+			take = 64;
+		} else {
+			memcpy(s->block + s->used, p, take);
+			if ((s->used += take) == 64) {
+				sha256Block(s, s->block);
+				s->used = 0;
+			}
+		}
+		p += take;
+		n -= take;
+	}
+}
+
+static void sha256Final(struct Sha256 *s, unsigned char *hash) {
+	unsigned long long bits = s->length * 8;
+	unsigned char pad[72];
+	size_t n = (s->used < 56 ? 56 - s->used : 120 - s->used);
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i) {
+		pad[n + i] = bits >> (56 - 8 * i);
+	}
+	sha256Update(s, pad, n + 8);
+	for (i = 0; i < 32; ++i) {
+		hash[i] = s->state[i / 4] >> (24 - 8 * (i % 4));
+	}
+}
+
+/*
+ * The store
+ */
+struct DedupChunk {
+	long chunk;               /* -1 if free */
+	int dirty;
+	unsigned long used;       /* for LRU replacement */
+	unsigned char *data;
+};
+
+struct Dedup {
+	int writable;
+	char *manifest;
+	char *store;              /* directory of the manifest */
+	unsigned chunkSize;
+	off_t imageSize;
+	long chunks;
+	unsigned char *hash;      /* DEDUP_HASH bytes per chunk */
+	int dirty;                /* manifest changed since the last sync */
+	unsigned long clock;
+	struct DedupChunk cache[DEDUP_CACHE];
+};
+
+/*
+ * dedupPath -- name of the file of a chunk, made relative to the store
+ */
+static void dedupPath(const char *store, const unsigned char *hash, char *path, size_t size) {
+	static const char hex[] = "0123456789abcdef";
+	char name[2 * DEDUP_HASH + 1];
+	int i;
+
+	for (i = 0; i < DEDUP_HASH; ++i) {
+		name[2 * i] = hex[hash[i] >> 4];
+		name[2 * i + 1] = hex[hash[i] & 0xf];
+	}
+	name[2 * DEDUP_HASH] = '\0';
+	snprintf(path, size, "%s/blocks/%.2s/%s", store, name, name + 2);
+}
+
+/*
+ * dedupStore -- store a chunk under its hash, unless it is there already
+ */
+static const char *dedupStore(const char *store, const unsigned char *data, unsigned length, unsigned char *hash, int *stored) {
+	struct Sha256 sha;
+	char path[4096], tmp[4096 + 32];
+	struct stat st;
+	const char *err = NULL;
+	unsigned i;
+	int fd;
+
+	sha256Init(&sha);
+	sha256Update(&sha, data, length);
+	sha256Final(&sha, hash);
+	*stored = 0;
+	dedupPath(store, hash, path, sizeof(path));
+	if (stat(path, &st) == 0) {
+		return NULL;
+	}
+	/* the prefix directory, then a private name linked into place, so
+	 * parallel writers of the same chunk neither clash nor see a part */
+	snprintf(tmp, sizeof(tmp), "%s/blocks", store);
+	mkdir(tmp, 0777);
+	snprintf(tmp, sizeof(tmp), "%.*s", (int)(strrchr(path, '/') - path), path);
+	mkdir(tmp, 0777);
+	/* read-only as far as the umask allows, since chunks never change; the
+	 * buffer address tells apart threads of one process */
+	for (i = 0;; ++i) {
+		snprintf(tmp, sizeof(tmp), "%s.%ld.%lx.%u", path, (long)getpid(), (unsigned long)tmp, i);
+		if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0444)) != -1) {
+			break;
+		}
+		if (errno != EEXIST) {
+			return strerror(errno);
+		}
+	}
+	if (write(fd, data, length) != (ssize_t)length) {
+		err = strerror(errno);
+	}
+	if (close(fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	if (err == NULL) {
+		if (link(tmp, path) == 0) {
+			*stored = 1;
+		} else if (errno != EEXIST) {
+			err = strerror(errno);
+		}
+	}
+	unlink(tmp);
+	return err;
+}
+
+/*
+ * dedupLoad -- read a chunk from the store
+ */
+static const char *dedupLoad(const char *store, const unsigned char *hash, unsigned char *data, unsigned length) {
+	char path[4096];
+	ssize_t res;
+	int fd;
+
+	dedupPath(store, hash, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+		return strerror(errno);
+	}
+	res = read(fd, data, length);
+	close(fd);
+	if (res != (ssize_t)length) {
+		return (res == -1 ? strerror(errno) : "dedup chunk too short");
+	}
+	return NULL;
+}
+
+/*
+ * dedupWriteManifest -- replace the manifest of an image
+ */
+static const char *dedupWriteManifest(const char *manifest, unsigned chunkSize, off_t imageSize, long chunks, const unsigned char *hash) {
+	char tmp[4096];
+	const char *err = NULL;
+	FILE *fp;
+	long i;
+	int j;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", manifest);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		return strerror(errno);
+	}
+	fprintf(fp, "%schunk %u\nsize %lld\n", DEDUP_MAGIC, chunkSize, (long long)imageSize);
+	for (i = 0; i < chunks; ++i) {
+		for (j = 0; j < DEDUP_HASH; ++j) {
+			fprintf(fp, "%02x", hash[i * DEDUP_HASH + j]);
+		}
+		putc('\n', fp);
+	}
+	if (ferror(fp)) {
+		err = strerror(errno);
+	}
+	if (fclose(fp) == EOF && err == NULL) {
+		err = strerror(errno);
+	}
+	if (err == NULL && rename(tmp, manifest) == -1) {
+		err = strerror(errno);
+	}
+	if (err) {
+		unlink(tmp);
+	}
+	return err;
+}
+
+/*
+ * dedupReadManifest -- read the manifest of an image
+ */
+static const char *dedupReadManifest(struct Dedup *d) {
+	char line[128];
+	long long size;
+	FILE *fp;
+	long i;
+	int j;
+
+	if ((fp = fopen(d->manifest, "r")) == NULL) {
+		return strerror(errno);
+	}
+	if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, DEDUP_MAGIC)
+		|| fscanf(fp, "chunk %u\nsize %lld\n", &d->chunkSize, &size) != 2 || d->chunkSize == 0 || size < 0) {
+		fclose(fp);
+		return "not a dedup manifest";
+	}
+	d->imageSize = size;
+	d->chunks = (size + d->chunkSize - 1) / d->chunkSize;
+	if ((d->hash = malloc(d->chunks * DEDUP_HASH + 1)) == NULL) {
+		fclose(fp);
+		return strerror(errno);
+	}
+	for (i = 0; i < d->chunks; ++i) {
+		if (fgets(line, sizeof(line), fp) == NULL || strlen(line) < 2 * DEDUP_HASH) {
+			fclose(fp);
+			return "dedup manifest too short";
+		}
+		for (j = 0; j < DEDUP_HASH; ++j) {
+			unsigned byte;
+
+			if (sscanf(line + 2 * j, "%2x", &byte) != 1) {
+				fclose(fp);
+				return "invalid hash in dedup manifest";
+			}
+			d->hash[i * DEDUP_HASH + j] = byte;
+		}
+	}
+	fclose(fp);
+	return NULL;
+}
+
+/*
+ * dedupFree -- release an image of the store
+ */
+static void dedupFree(struct Dedup *d) {
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE; ++i) {
+		free(d->cache[i].data);
+	}
+	free(d->hash);
+	free(d->manifest);
+	free(d->store);
+	free(d);
+}
+
+/*
+ * dedupGrow -- extend an image by chunks of zeros
+ */
+static const char *dedupGrow(struct Dedup *d, long chunks) {
+	unsigned char *hash, *zero, zeroHash[DEDUP_HASH];
+	const char *err;
+	int stored;
+
+	if (chunks <= d->chunks) {
+		return NULL;
+	}
+	if ((hash = realloc(d->hash, chunks * DEDUP_HASH)) == NULL) {
+		return strerror(errno);
+	}
+	d->hash = hash;
+	if ((zero = calloc(d->chunkSize, 1)) == NULL) {
+		return strerror(errno);
+	}
+	err = dedupStore(d->store, zero, d->chunkSize, zeroHash, &stored);
+	free(zero);
+	if (err) {
+		return err;
+	}
+	for (; d->chunks < chunks; ++d->chunks) {
+		memcpy(d->hash + d->chunks * DEDUP_HASH, zeroHash, DEDUP_HASH);
+	}
+	d->dirty = 1;
+	return NULL;
+}
+
+/*
+ * dedupFlush -- store a changed chunk
+ */
+static const char *dedupFlush(const struct Device *this, struct DedupChunk *e) {
+	struct Dedup *d = this->priv;
+	const char *err;
+	int stored;
+
+	if ((err = dedupGrow(d, e->chunk + 1))) {
+		return err;
+	}
+	DEVICE_SYSCALLS(this, 5);
+	if ((err = dedupStore(d->store, e->data, d->chunkSize, d->hash + e->chunk * DEDUP_HASH, &stored))) {
+		return err;
+	}
+	e->dirty = 0;
+	d->dirty = 1;
+	return NULL;
+}
+
+/*
+ * dedupChunk -- get a chunk into the cache
+ */
+static const char *dedupChunk(const struct Device *this, long chunk, struct DedupChunk **entry) {
+	struct Dedup *d = this->priv;
+	struct DedupChunk *e, *lru = NULL;
+	const char *err;
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE; ++i) {
+		e = &d->cache[i];
+		if (e->chunk == chunk) {
+			e->used = ++d->clock;
+			*entry = e;
+			return NULL;
+		}
+		if (lru == NULL || e->used < lru->used) {
+			lru = e;
+		}
+	}
+	if (lru->dirty && (err = dedupFlush(this, lru))) {
+		return err;
+	}
+	lru->chunk = -1;
+	if (chunk < d->chunks) {
+		DEVICE_SYSCALLS(this, 3);
+		if ((err = dedupLoad(d->store, d->hash + chunk * DEDUP_HASH, lru->data, d->chunkSize))) {
+			return err;
+		}
+	} else {
+		memset(lru->data, 0, d->chunkSize);
+	}
+	lru->chunk = chunk;
+	lru->used = ++d->clock;
+	*entry = lru;
+	return NULL;
+}
+
+/*
+ * dedupTransfer -- copy bytes of the image, which may span chunks
+ */
+static const char *dedupTransfer(const struct Device *this, off_t pos, unsigned char *buf, int length, int write) {
+	struct Dedup *d = this->priv;
+	struct DedupChunk *e;
+	const char *err;
+
+	if (write && pos + length > d->imageSize) {
+		d->imageSize = pos + length;
+		d->dirty = 1;
+	}
+	while (length > 0) {
+		unsigned at = pos % d->chunkSize;
+		int n = (d->chunkSize - at < (unsigned)length ? (int)(d->chunkSize - at) : length);
+
+		if (!write && pos >= d->imageSize) {
+			/* beyond the end of the image */
+			memset(buf, 0, length);
+			return NULL;
+		}
+		if ((err = dedupChunk(this, pos / d->chunkSize, &e))) {
+			return err;
+		}
+		if (write) {
+			memcpy(e->data + at, buf, n);
+			e->dirty = 1;
+		} else {
+			memcpy(buf, e->data + at, n);
+		}
+		pos += n;
+		buf += n;
+		length -= n;
+	}
+	return NULL;
+}
+
+/*
+ * dedupProbe -- take manifests
+ */
+static int dedupProbe(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength) {
+	return (headLength >= strlen(DEDUP_MAGIC) && memcmp(head, DEDUP_MAGIC, strlen(DEDUP_MAGIC)) == 0);
+}
+
+/*
+ * dedupNew -- set up an image of a store in memory
+ */
+static const char *dedupNew(const char *manifest, struct Dedup **dp) {
+	struct Dedup *d;
+	char *slash;
+
+	if ((d = malloc(sizeof(struct Dedup))) == NULL) {
+		return strerror(errno);
+	}
+	memset(d, 0, sizeof(struct Dedup));
+	d->manifest = strdup(manifest);
+	d->store = strdup(manifest);
+	if (d->manifest == NULL || d->store == NULL) {
+		dedupFree(d);
+		return strerror(errno);
+	}
+	if ((slash = strrchr(d->store, '/'))) {
+		*slash = '\0';
+	} else {
+		strcpy(d->store, ".");
+	}
+	*dp = d;
+	return NULL;
+}
+
+/*
+ * dedupOpen -- Open an image of a store
+ */
+static const char *dedupOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+	struct Dedup *d;
+	const char *err;
+	int i;
+
+	if (deviceOpts != NULL) {
+		return "dedup driver accepts no options";
+	}
+	this->opened = 0;
+	if ((err = dedupNew(filename, &d))) {
+		return err;
+	}
+	if ((err = dedupReadManifest(d)) == NULL) {
+		for (i = 0; i < DEDUP_CACHE; ++i) {
+			d->cache[i].chunk = -1;
+			if ((d->cache[i].data = malloc(d->chunkSize)) == NULL) {
+				err = strerror(errno);
+			}
+		}
+	}
+	if (err) {
+		dedupFree(d);
+		return err;
+	}
+	d->writable = ((mode & O_ACCMODE) != O_RDONLY);
+	this->priv = d;
+	this->opened = 1;
+	return NULL;
+}
+
+/*
+ * dedupSetGeometry -- Set disk geometry
+ */
+static const char *dedupSetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	this->secLength = secLength;
+	this->sectrk = sectrk;
+	this->tracks = tracks;
+	this->offset = offset;
+	return NULL;
+}
+
+/*
+ * dedupSync -- store changed chunks and replace the manifest
+ */
+static const char *dedupSync(struct Device *this) {
+	struct Dedup *d = this->priv;
+	const char *err;
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE; ++i) {
+		if (d->cache[i].dirty && (err = dedupFlush(this, &d->cache[i]))) {
+			return err;
+		}
+	}
+	if (d->dirty) {
+		DEVICE_SYSCALLS(this, 3);
+		if ((err = dedupWriteManifest(d->manifest, d->chunkSize, d->imageSize, d->chunks, d->hash))) {
+			return err;
+		}
+		d->dirty = 0;
+	}
+	return NULL;
+}
+
+/*
+ * dedupClose -- Sync and close an image of a store
+ */
+static const char *dedupClose(struct Device *this) {
+	const char *err;
+
+	err = dedupSync(this);
+	this->opened = 0;
+	dedupFree(this->priv);
+	this->priv = NULL;
+	return err;
+}
+
+/*
+ * dedupReadSector -- read a physical sector
+ */
+static const char *dedupReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	return dedupTransfer(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, buf, this->secLength, 0);
+}
+
+/*
+ * dedupWriteSector -- write a physical sector
+ */
+static const char *dedupWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	if (!((struct Dedup *)this->priv)->writable) {
+		return strerror(EBADF);
+	}
+	return dedupTransfer(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, (unsigned char *)buf, this->secLength, 1);
+}
+
+const struct DeviceDriver dedupDriver = {
+	"dedup",
+	1,
+	0,
+	dedupProbe,
+	dedupOpen,
+	dedupSetGeometry,
+	dedupClose,
+	dedupSync,
+	dedupReadSector,
+	dedupWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
+
+/*
+ * Dedup_ingest -- store an image, writing its manifest; the counters of
+ * stats are increased.  Safe to call from several threads at once.
+ */
+const char *Dedup_ingest(const char *image, const char *manifest, unsigned chunkSize, struct DedupStats *stats) {
+	struct Dedup *d;
+	unsigned char *data;
+	const char *err;
+	ssize_t res = 0;
+	int fd, stored;
+
+	if (chunkSize == 0) {
+		return "invalid chunk size";
+	}
+	if ((err = dedupNew(manifest, &d))) {
+		return err;
+	}
+	d->chunkSize = chunkSize;
+	if ((data = malloc(chunkSize)) == NULL) {
+		dedupFree(d);
+		return strerror(errno);
+	}
+	if ((fd = open(image, O_RDONLY | O_BINARY)) == -1) {
+		err = strerror(errno);
+	}
+	while (err == NULL) {
+		unsigned done = 0;
+		unsigned char *hash;
+
+		while (done < chunkSize && (res = read(fd, data + done, chunkSize - done)) > 0) {
+			done += res;
+		}
+		if (res == -1) {
+			err = strerror(errno);
+			break;
+		}
+		if (done == 0) {
+			break;
+		}
+		/* the tail of the last chunk is stored as zeros */
+		memset(data + done, 0, chunkSize - done);
+		if ((hash = realloc(d->hash, (d->chunks + 1) * DEDUP_HASH)) == NULL) {
+			err = strerror(errno);
+			break;
+		}
+		d->hash = hash;
+		if ((err = dedupStore(d->store, data, chunkSize, d->hash + d->chunks * DEDUP_HASH, &stored)) == NULL) {
+			++d->chunks;
+			d->imageSize += done;
+			stats->chunks += 1;
+			stats->bytes += chunkSize;
+			if (stored) {
+				stats->stored += 1;
+				stats->storedBytes += chunkSize;
+			}
+		}
+		if (done < chunkSize) {
+			break;
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	if (err == NULL) {
+		err = dedupWriteManifest(d->manifest, d->chunkSize, d->imageSize, d->chunks, d->hash);
+	}
+	free(data);
+	dedupFree(d);
+	return err;
+}
+
+/*
+ * Dedup_restore -- write an image of a store to a raw image
+ */
+const char *Dedup_restore(const char *manifest, const char *image) {
+	struct Dedup *d;
+	unsigned char *data = NULL;
+	const char *err;
+	long chunk;
+	int fd = -1;
+
+	if ((err = dedupNew(manifest, &d))) {
+		return err;
+	}
+	if ((err = dedupReadManifest(d)) == NULL && (data = malloc(d->chunkSize)) == NULL) {
+		err = strerror(errno);
+	}
+	if (err == NULL && (fd = open(image, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) == -1) {
+		err = strerror(errno);
+	}
+	for (chunk = 0; err == NULL && chunk < d->chunks; ++chunk) {
+		off_t pos = (off_t)chunk * d->chunkSize;
+		size_t length = (d->imageSize - pos < d->chunkSize ? d->imageSize - pos : d->chunkSize);
+
+		if ((err = dedupLoad(d->store, d->hash + chunk * DEDUP_HASH, data, d->chunkSize)) == NULL
+			&& write(fd, data, length) != (ssize_t)length) {
+			err = strerror(errno);
+		}
+	}
+	if (fd != -1 && close(fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	free(data);
+	dedupFree(d);
+	return err;
+}
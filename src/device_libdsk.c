@@ -7,6 +7,155 @@
 
 #include "device.h"
 
+/*
+ * Sectors are transferred a whole logical track at a time and kept in
+ * core, because every single-sector call to a real FDC may cost a full
+ * revolution.  Written sectors are only marked dirty and go back to the
+ * disk in libdskSync or libdskClose.
+ */
+struct TrackCache {
+	int tracks;              /* logical tracks covered by the cache */
+	int trkbytes;            /* bytes per logical track */
+	int noTrackRead;         /* driver does not implement dsk_ltread */
+	unsigned char **data;    /* track buffers, NULL if not loaded */
+	unsigned char **dirty;   /* per-sector dirty flags of each track */
+};
+
+/*
+ * trackCacheFlush -- write back all dirty sectors
+ */
+static const char *trackCacheFlush(const struct Device *this) {
+	struct TrackCache *c = this->priv;
+	int track, sector;
+	dsk_err_t e;
+
+	if (c == NULL) {
+		return NULL;
+	}
+	for (track = 0; track < c->tracks; ++track) {
+		if (c->data[track] == NULL) {
+			continue;
+		}
+		for (sector = 0; sector < (int)this->geom.dg_sectors; ++sector) {
+			if (c->dirty[track][sector]) {
+				DEVICE_SYSCALLS(this, 1);
+				e = dsk_lwrite(this->dev, &this->geom,
+					c->data[track] + sector * this->geom.dg_secsize,
+					track * this->geom.dg_sectors + sector);
+				if (e) {
+					return dsk_strerror(e);
+				}
+				c->dirty[track][sector] = 0;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * trackCacheFree -- flush and release the track cache
+ */
+static const char *trackCacheFree(struct Device *this) {
+	struct TrackCache *c = this->priv;
+	const char *err;
+	int track;
+
+	if (c == NULL) {
+		return NULL;
+	}
+	err = trackCacheFlush(this);
+	for (track = 0; track < c->tracks; ++track) {
+		free(c->data[track]);
+		free(c->dirty[track]);
+	}
+	free(c->data);
+	free(c->dirty);
+	free(c);
+	this->priv = NULL;
+	return err;
+}
+
+/*
+ * trackCacheInit -- set up an empty track cache for the current geometry
+ */
+static void trackCacheInit(struct Device *this) {
+	struct TrackCache *c;
+
+	this->priv = NULL;
+	if (!this->opened || this->geom.dg_secsize != (size_t)this->secLength) {
+		return;
+	}
+	c = malloc(sizeof(struct TrackCache));
+	if (c == NULL) {
+		return;
+	}
+	c->tracks = this->geom.dg_cylinders * this->geom.dg_heads;
+	c->trkbytes = this->geom.dg_sectors * this->geom.dg_secsize;
+	c->noTrackRead = 0;
+	c->data = calloc(c->tracks, sizeof(unsigned char *));
+	c->dirty = calloc(c->tracks, sizeof(unsigned char *));
+	if (c->tracks <= 0 || c->data == NULL || c->dirty == NULL) {
+		free(c->data);
+		free(c->dirty);
+		free(c);
+		return;
+	}
+	this->priv = c;
+}
+
+/*
+ * trackCacheLoad -- get the buffer of a logical track, reading it if needed
+ */
+static unsigned char *trackCacheLoad(const struct Device *this, int track) {
+	struct TrackCache *c = this->priv;
+	unsigned char *buf;
+	dsk_err_t e = DSK_ERR_NOTIMPL;
+	int sector;
+
+	if (c == NULL || track < 0 || track >= c->tracks) {
+		return NULL;
+	}
+	if (c->data[track]) {
+		return c->data[track];
+	}
+	buf = malloc(c->trkbytes);
+	c->dirty[track] = calloc(this->geom.dg_sectors, 1);
+	if (buf == NULL || c->dirty[track] == NULL) {
+		free(buf);
+		free(c->dirty[track]);
+		c->dirty[track] = NULL;
+		return NULL;
+	}
+	if (!c->noTrackRead) {
+		DEVICE_SYSCALLS(this, 1);
+		e = dsk_ltread(this->dev, &this->geom, buf, track);
+		if (e == DSK_ERR_NOTIMPL) {
+			c->noTrackRead = 1;
+		}
+	}
+	if (e) {
+		/* no track read: fetch the sectors in ascending logical
+		 * order; libdsk maps them to physical sector IDs, so with an
+		 * interleaved format this is not the order they pass under
+		 * the head, but each sector is still read only once
+		 */
+		for (sector = 0; sector < (int)this->geom.dg_sectors; ++sector) {
+			DEVICE_SYSCALLS(this, 1);
+			e = dsk_lread(this->dev, &this->geom,
+				buf + sector * this->geom.dg_secsize,
+				track * this->geom.dg_sectors + sector);
+			if (e) {
+				free(buf);
+				free(c->dirty[track]);
+				c->dirty[track] = NULL;
+				return NULL;
+			}
+		}
+	}
+	c->data[track] = buf;
+	return buf;
+}
+
 static const char *lookupFormat(DSK_GEOMETRY *geom, const char *name) {
 	dsk_format_t fmt = FMT_180K;
 	const char *fname;
@@ -22,14 +171,51 @@ static const char *lookupFormat(DSK_GEOMETRY *geom, const char *name) {
 }
 
 /*
- * Device_open -- Open an image file 
+ * Signatures of the disk image containers libdsk understands, checked
+ * against the start of a regular file.
+ */
+static const struct {
+	const char *magic;
+	size_t length;
+} signatures[] = {
+	{ "MV - CPC", 8 },          /* CPCEMU DSK */
+	{ "EXTENDED CPC DSK", 16 }, /* extended CPCEMU DSK */
+	{ "TD", 2 },                /* Teledisk */
+	{ "td", 2 },                /* Teledisk, advanced compression */
+	{ "IMD ", 4 },              /* ImageDisk */
+	{ "ACT Apricot", 11 },      /* Apricot disk image */
+	{ "LBS\001", 4 },           /* LDBS */
+	{ NULL, 0 }
+};
+
+/*
+ * libdskProbe -- take devices and image containers, leave raw images
+ */
+static int libdskProbe(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength) {
+	int i;
+
+	if (st == NULL || !S_ISREG(st->st_mode)) {
+		/* floppy drives and other devices need a real FDC driver */
+		return 1;
+	}
+	for (i = 0; signatures[i].magic; ++i) {
+		if (headLength >= signatures[i].length && memcmp(head, signatures[i].magic, signatures[i].length) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * libdskOpen -- Open an image file 
  */
-const char *Device_open(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+static const char *libdskOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
 	char *format;
 	char driverName[80];
 	const char *boo;
 	dsk_err_t e;
 
+	this->priv = NULL;
 	/* Assume driver name & format name both fit in 80 characters, rather than
 	 * malloccing the exact size */
 	if (deviceOpts == NULL) {
@@ -62,11 +248,15 @@ const char *Device_open(struct Device *this, const char *filename, int mode, con
 }
 
 /*
- * Device_setGeometry -- Set disk geometry 
+ * libdskSetGeometry -- Set disk geometry 
  */
-const char *Device_setGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
-	char *boo;
+static const char *libdskSetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	const char *boo;
 
+	boo = (this->opened ? trackCacheFree(this) : NULL);
+	if (boo) {
+		return boo;
+	}
 	this->secLength = secLength;
 	this->sectrk = sectrk;
 	this->tracks = tracks;
@@ -75,13 +265,18 @@ const char *Device_setGeometry(struct Device *this, int secLength, int sectrk, i
 	this->offset = offset;
 	/* If a geometry is named in diskdefs, use it */
 	if (libdskGeometry && libdskGeometry[0]) {
-		return lookupFormat(&this->geom, libdskGeometry);
+		boo = lookupFormat(&this->geom, libdskGeometry);
+		if (boo == NULL) {
+			trackCacheInit(this);
+		}
+		return boo;
 	}
 
 	this->geom.dg_secsize   = secLength;
 	this->geom.dg_sectors   = sectrk;
 	/* Did the autoprobe guess right about the number of sectors & cylinders? */
 	if (this->geom.dg_cylinders * this->geom.dg_heads == tracks) {
+		trackCacheInit(this);
 		return NULL;
 	}
 	/* Otherwise we guess: <= 43 tracks: single-sided. Else double. This
@@ -93,33 +288,84 @@ const char *Device_setGeometry(struct Device *this, int secLength, int sectrk, i
 		this->geom.dg_cylinders = tracks / 2;
 		this->geom.dg_heads     = 2;
 	}
+	trackCacheInit(this);
 	return NULL;
 }
 
 /*
- * Device_close -- Close an image file 
+ * libdskClose -- Close an image file 
  */
-const char *Device_close(struct Device *this) {
+static const char *libdskClose(struct Device *this) {
+	const char *err;
 	dsk_err_t e;
+
+	err = trackCacheFree(this);
 	this->opened = 0;
 	e = dsk_close(&this->dev);
+	if (err) {
+		return err;
+	}
 	return (e ? dsk_strerror(e) : NULL);
 }
 
 /*
- * Device_readSector -- read a physical sector 
+ * libdskSync -- write back dirty cached sectors
+ */
+static const char *libdskSync(struct Device *this) {
+	return trackCacheFlush(this);
+}
+
+/*
+ * libdskReadSector -- read a physical sector 
  */
-const char *Device_readSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+static const char *libdskReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	dsk_lsect_t lsect;
+	unsigned char *trk;
 	dsk_err_t e;
-	e = dsk_lread(this->dev, &this->geom, buf, (track * this->sectrk) + sector + this->offset / this->secLength);
+
+	lsect = (track * this->sectrk) + sector + this->offset / this->secLength;
+	trk = trackCacheLoad(this, lsect / this->geom.dg_sectors);
+	if (trk) {
+		memcpy(buf, trk + (lsect % this->geom.dg_sectors) * this->geom.dg_secsize, this->secLength);
+		return NULL;
+	}
+	DEVICE_SYSCALLS(this, 1);
+	e = dsk_lread(this->dev, &this->geom, buf, lsect);
 	return (e ? dsk_strerror(e) : NULL);
 }
 
 /*
- * Device_writeSector -- write physical sector 
+ * libdskWriteSector -- write physical sector 
  */
-const char *Device_writeSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+static const char *libdskWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	dsk_lsect_t lsect;
+	unsigned char *trk;
 	dsk_err_t e;
-	e = dsk_lwrite(this->dev, &this->geom, buf, (track * this->sectrk) + sector + this->offset / this->secLength);
+
+	lsect = (track * this->sectrk) + sector + this->offset / this->secLength;
+	trk = trackCacheLoad(this, lsect / this->geom.dg_sectors);
+	if (trk) {
+		memcpy(trk + (lsect % this->geom.dg_sectors) * this->geom.dg_secsize, buf, this->secLength);
+		((struct TrackCache *)this->priv)->dirty[lsect / this->geom.dg_sectors][lsect % this->geom.dg_sectors] = 1;
+		return NULL;
+	}
+	DEVICE_SYSCALLS(this, 1);
+	e = dsk_lwrite(this->dev, &this->geom, buf, lsect);
 	return (e ? dsk_strerror(e) : NULL);
 }
+
+const struct DeviceDriver libdskDriver = {
+	"libdsk",
+	1,
+	0,
+	libdskProbe,
+	libdskOpen,
+	libdskSetGeometry,
+	libdskClose,
+	libdskSync,
+	libdskReadSector,
+	libdskWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
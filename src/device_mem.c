@@ -0,0 +1,224 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * The mem driver is a RAM disk: the whole image is read into the heap on
+ * open, all sector I/O is a memcpy and the image is written back in one
+ * piece by Device_sync and Device_close.  A missing image is created
+ * when opened with O_CREAT and grows to the size of the geometry.  Only
+ * as much is written back as the file had or sectors were written, so
+ * building an image leaves the same file as writing it sector by sector.
+ */
+struct MemImage {
+	unsigned char *data;  /* the image */
+	off_t size;           /* bytes allocated */
+	off_t length;         /* bytes to write back */
+	int dirty;            /* written to since the last save */
+};
+
+/*
+ * memProbe -- never picked unless named
+ */
+static int memProbe(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength) {
+	return 0;
+}
+
+/*
+ * memGrow -- make room for size bytes of image, zero filled
+ */
+static const char *memGrow(struct MemImage *m, off_t size) {
+	unsigned char *data;
+
+	if (size <= m->size) {
+		return NULL;
+	}
+	data = realloc(m->data, size);
+	if (data == NULL) {
+		return strerror(errno);
+	}
+	memset(data + m->size, 0, size - m->size);
+	m->data = data;
+	m->size = size;
+	return NULL;
+}
+
+/*
+ * memSave -- write the image back to the file
+ */
+static const char *memSave(const struct Device *this) {
+	struct MemImage *m = this->priv;
+	off_t done;
+	ssize_t res;
+
+	if (!m->dirty) {
+		return NULL;
+	}
+	DEVICE_SYSCALLS(this, 1);
+	if (lseek(this->fd, 0, SEEK_SET) == -1) {
+		return strerror(errno);
+	}
+	for (done = 0; done < m->length; done += res) {
+		DEVICE_SYSCALLS(this, 1);
+		res = write(this->fd, m->data + done, m->length - done);
+		if (res == -1) {
+			return strerror(errno);
+		}
+	}
+	m->dirty = 0;
+	return NULL;
+}
+
+/*
+ * memOpen -- Load an image file
+ */
+static const char *memOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+	struct MemImage *m;
+	struct stat st;
+	const char *err;
+	off_t done;
+	ssize_t res;
+
+	if (deviceOpts != NULL) {
+		return "mem driver accepts no options";
+	}
+	this->opened = 0;
+	this->fd = open(filename, mode | O_BINARY, 0666);
+	if (this->fd == -1) {
+		return strerror(errno);
+	}
+	m = malloc(sizeof(struct MemImage));
+	if (m == NULL) {
+		err = strerror(errno);
+		close(this->fd);
+		return err;
+	}
+	memset(m, 0, sizeof(struct MemImage));
+	if (fstat(this->fd, &st) == -1) {
+		err = strerror(errno);
+		goto fail;
+	}
+	err = memGrow(m, st.st_size);
+	if (err) {
+		goto fail;
+	}
+	for (done = 0; done < st.st_size; done += res) {
+		res = read(this->fd, m->data + done, st.st_size - done);
+		if (res == -1) {
+			err = strerror(errno);
+			goto fail;
+		}
+		if (res == 0) {
+			break;
+		}
+	}
+	m->length = done;
+	this->priv = m;
+	this->opened = 1;
+	return NULL;
+
+fail:
+	free(m->data);
+	free(m);
+	close(this->fd);
+	return err;
+}
+
+/*
+ * memSetGeometry -- Set disk geometry and make room for the whole image
+ */
+static const char *memSetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	this->secLength = secLength;
+	this->sectrk = sectrk;
+	this->tracks = tracks;
+	this->offset = offset;
+	return memGrow(this->priv, offset + (off_t)tracks * sectrk * secLength);
+}
+
+/*
+ * memClose -- Save and close an image file
+ */
+static const char *memClose(struct Device *this) {
+	const char *err;
+
+	err = memSave(this);
+	this->opened = 0;
+	free(((struct MemImage *)this->priv)->data);
+	free(this->priv);
+	this->priv = NULL;
+	if (close(this->fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	return err;
+}
+
+/*
+ * memSync -- Save the image
+ */
+static const char *memSync(struct Device *this) {
+	return memSave(this);
+}
+
+/*
+ * memReadSector -- read a physical sector
+ */
+static const char *memReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	const struct MemImage *m = this->priv;
+	off_t pos;
+
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	pos = (off_t)(sector + track * this->sectrk) * this->secLength + this->offset;
+	assert(pos + this->secLength <= m->size);
+	memcpy(buf, m->data + pos, this->secLength);
+	return NULL;
+}
+
+/*
+ * memWriteSector -- write physical sector
+ */
+static const char *memWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	struct MemImage *m = this->priv;
+	off_t pos;
+
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	pos = (off_t)(sector + track * this->sectrk) * this->secLength + this->offset;
+	assert(pos + this->secLength <= m->size);
+	memcpy(m->data + pos, buf, this->secLength);
+	if (pos + this->secLength > m->length) {
+		m->length = pos + this->secLength;
+	}
+	m->dirty = 1;
+	return NULL;
+}
+
+const struct DeviceDriver memDriver = {
+	"mem",
+	1,
+	0,
+	memProbe,
+	memOpen,
+	memSetGeometry,
+	memClose,
+	memSync,
+	memReadSector,
+	memWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
@@ -0,0 +1,178 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "device.h"
+
+/*
+ * The mmap driver maps a raw image file and copies sectors out of and
+ * into the page cache without any system call.  Sectors beyond the end of
+ * the mapping, which only a write may create, fall back to pread/pwrite.
+ */
+
+/* The mapped image */
+struct Mapping {
+	unsigned char *data;
+	off_t length;
+};
+
+/*
+ * mmapProbe -- take read-only regular files that are not empty
+ */
+static int mmapProbe(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength) {
+	/* A writable image may have to grow, which a mapping can not. */
+	return (st && S_ISREG(st->st_mode) && st->st_size > 0 && (mode & O_ACCMODE) == O_RDONLY);
+}
+
+/*
+ * mmapOpen -- Open an image file
+ */
+static const char *mmapOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+	struct Mapping *m;
+	struct stat st;
+	int prot;
+
+	if (deviceOpts != NULL) {
+		return "mmap driver accepts no options";
+	}
+	this->opened = 0;
+	if ((m = calloc(1, sizeof(struct Mapping))) == NULL) {
+		return strerror(errno);
+	}
+	this->fd = open(filename, mode);
+	if (this->fd == -1) {
+		const char *err = strerror(errno);
+
+		free(m);
+		return err;
+	}
+	if (fstat(this->fd, &st) == -1) {
+		const char *err = strerror(errno);
+
+		close(this->fd);
+		free(m);
+		return err;
+	}
+	if (st.st_size > 0) {
+		prot = ((mode & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE);
+		m->data = mmap(NULL, st.st_size, prot, MAP_SHARED, this->fd, 0);
+		if (m->data == MAP_FAILED) {
+			const char *err = strerror(errno);
+
+			close(this->fd);
+			free(m);
+			return err;
+		}
+		m->length = st.st_size;
+	}
+	this->priv = m;
+	this->opened = 1;
+	return NULL;
+}
+
+/*
+ * mmapSetGeometry -- Set disk geometry
+ */
+static const char *mmapSetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	this->secLength = secLength;
+	this->sectrk = sectrk;
+	this->tracks = tracks;
+	this->offset = offset;
+	return NULL;
+}
+
+/*
+ * mmapClose -- Close an image file
+ */
+static const char *mmapClose(struct Device *this) {
+	struct Mapping *m = this->priv;
+
+	this->opened = 0;
+	if (m->data) {
+		munmap(m->data, m->length);
+	}
+	free(m);
+	this->priv = NULL;
+	return ((close(this->fd) == -1) ? strerror(errno) : NULL);
+}
+
+/*
+ * mmapSync -- write back buffered sectors (the mapping is the page cache)
+ */
+static const char *mmapSync(struct Device *this) {
+	return NULL;
+}
+
+/*
+ * mmapReadSector -- read a physical sector
+ */
+static const char *mmapReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	const struct Mapping *m = this->priv;
+	off_t pos;
+	ssize_t res;
+
+	assert(this);
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	assert(buf);
+	pos = (off_t)(sector + track * this->sectrk) * this->secLength + this->offset;
+	if (pos + this->secLength <= m->length) {
+		memcpy(buf, m->data + pos, this->secLength);
+		return NULL;
+	}
+	DEVICE_SYSCALLS(this, 1);
+	res = pread(this->fd, buf, this->secLength, pos);
+	if (res == -1) {
+		return strerror(errno);
+	}
+	if (res != this->secLength) {
+		memset(buf + res, 0, this->secLength - res); /* hit end of disk image */
+	}
+	return NULL;
+}
+
+/*
+ * mmapWriteSector -- write physical sector
+ */
+static const char *mmapWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	const struct Mapping *m = this->priv;
+	off_t pos;
+
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	pos = (off_t)(sector + track * this->sectrk) * this->secLength + this->offset;
+	if (pos + this->secLength <= m->length) {
+		memcpy(m->data + pos, buf, this->secLength);
+		return NULL;
+	}
+	DEVICE_SYSCALLS(this, 1);
+	if (pwrite(this->fd, buf, this->secLength, pos) == this->secLength) {
+		return NULL;
+	}
+	return strerror(errno);
+}
+
+const struct DeviceDriver mmapDriver = {
+	"mmap",
+	1,
+	1,
+	mmapProbe,
+	mmapOpen,
+	mmapSetGeometry,
+	mmapClose,
+	mmapSync,
+	mmapReadSector,
+	mmapWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
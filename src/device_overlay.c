@@ -0,0 +1,423 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * The overlay driver puts a delta file on top of an image, which is only
+ * ever opened read-only.  Written sectors go to the delta and are read
+ * from there from then on, all others come from the image below.  The
+ * image below may be an overlay itself, so overlays stack.
+ *
+ * A delta starts with a text header naming the image below and the
+ * geometry, which is recorded when the delta is first used.  A bitmap of
+ * the sectors in the delta follows, then the sectors at the position of
+ * their number, so the delta is a sparse file of just the changed sectors.
+ */
+#define OVERLAY_MAGIC "CPMOVL 1\n"
+#define OVERLAY_HEADER 4096
+
+struct Overlay {
+	struct Device below;      /* the image below */
+	char base[OVERLAY_HEADER];
+	int writable;
+	unsigned char *present;   /* bitmap of the sectors in the delta */
+	long sectors;
+	off_t data;               /* position of sector 0 in the delta */
+	int dirty;                /* bitmap changed since the last sync */
+};
+
+/* Geometry of a delta as recorded in its header */
+struct OverlayGeometry {
+	int secLength, sectrk, tracks;
+	long long offset;
+	char libdskGeometry[64];  /* empty if none */
+};
+
+/*
+ * overlayReadHeader -- read the header of a delta
+ */
+static const char *overlayReadHeader(int fd, char *base, struct OverlayGeometry *g) {
+	char header[OVERLAY_HEADER + 1];
+	char *line, *end;
+	ssize_t res;
+
+	res = pread(fd, header, OVERLAY_HEADER, 0);
+	if (res == -1) {
+		return strerror(errno);
+	}
+	header[res] = '\0';
+	if (strncmp(header, OVERLAY_MAGIC, strlen(OVERLAY_MAGIC))) {
+		return "not an overlay";
+	}
+	memset(g, 0, sizeof(struct OverlayGeometry));
+	*base = '\0';
+	for (line = header + strlen(OVERLAY_MAGIC); *line; line = end + 1) {
+		if ((end = strchr(line, '\n')) == NULL) {
+			break;
+		}
+		*end = '\0';
+		if (strncmp(line, "base ", 5) == 0) {
+			strcpy(base, line + 5);
+		} else if (strncmp(line, "geometry ", 9) == 0) {
+			if (sscanf(line + 9, "%d %d %d %lld", &g->secLength, &g->sectrk, &g->tracks, &g->offset) != 4
+				|| g->secLength <= 0 || g->sectrk <= 0 || g->tracks <= 0) {
+				return "invalid overlay geometry";
+			}
+		} else if (strncmp(line, "libdsk ", 7) == 0) {
+			snprintf(g->libdskGeometry, sizeof(g->libdskGeometry), "%s", line + 7);
+		}
+	}
+	if (*base == '\0') {
+		return "overlay names no image";
+	}
+	return NULL;
+}
+
+/*
+ * overlayWriteHeader -- write the header of a delta
+ */
+static const char *overlayWriteHeader(int fd, const char *base, const struct OverlayGeometry *g) {
+	char header[OVERLAY_HEADER];
+	int len;
+
+	memset(header, 0, sizeof(header));
+	len = snprintf(header, sizeof(header), "%sbase %s\n", OVERLAY_MAGIC, base);
+	if (len < (int)sizeof(header) && g && g->secLength) {
+		len += snprintf(header + len, sizeof(header) - len, "geometry %d %d %d %lld\n",
+			g->secLength, g->sectrk, g->tracks, g->offset);
+		if (len < (int)sizeof(header) && *g->libdskGeometry) {
+			len += snprintf(header + len, sizeof(header) - len, "libdsk %s\n", g->libdskGeometry);
+		}
+	}
+	if (len >= (int)sizeof(header)) {
+		return "image name too long for an overlay";
+	}
+	if (pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+		return strerror(errno);
+	}
+	return NULL;
+}
+
+/*
+ * overlayLayout -- bitmap size and data position for a geometry
+ */
+static void overlayLayout(const struct OverlayGeometry *g, long *sectors, off_t *data) {
+	size_t bytes;
+
+	*sectors = (long)g->tracks * g->sectrk;
+	bytes = (*sectors + 7) / 8;
+	*data = OVERLAY_HEADER + ((bytes + OVERLAY_HEADER - 1) / OVERLAY_HEADER) * OVERLAY_HEADER;
+}
+
+/*
+ * overlayReadBitmap -- read the bitmap of a delta, missing bytes are 0
+ */
+static const char *overlayReadBitmap(int fd, long sectors, unsigned char **present) {
+	size_t bytes = (sectors + 7) / 8;
+	ssize_t res;
+
+	if ((*present = calloc(bytes ? bytes : 1, 1)) == NULL) {
+		return strerror(errno);
+	}
+	if ((res = pread(fd, *present, bytes, OVERLAY_HEADER)) == -1) {
+		free(*present);
+		*present = NULL;
+		return strerror(errno);
+	}
+	return NULL;
+}
+
+/*
+ * overlayProbe -- take deltas
+ */
+static int overlayProbe(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength) {
+	return (headLength >= strlen(OVERLAY_MAGIC) && memcmp(head, OVERLAY_MAGIC, strlen(OVERLAY_MAGIC)) == 0);
+}
+
+/*
+ * overlayOpen -- Open a delta and the image below
+ */
+static const char *overlayOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+	struct Overlay *o;
+	struct OverlayGeometry g;
+	const char *err;
+
+	if (deviceOpts != NULL) {
+		return "overlay driver accepts no options";
+	}
+	this->opened = 0;
+	if ((o = malloc(sizeof(struct Overlay))) == NULL) {
+		return strerror(errno);
+	}
+	memset(o, 0, sizeof(struct Overlay));
+	o->writable = ((mode & O_ACCMODE) != O_RDONLY);
+	this->fd = open(filename, (o->writable ? O_RDWR : O_RDONLY) | O_BINARY);
+	if (this->fd == -1) {
+		err = strerror(errno);
+		free(o);
+		return err;
+	}
+	if ((err = overlayReadHeader(this->fd, o->base, &g)) == NULL) {
+		/* the image below is never written, but may be an overlay */
+		err = Device_open(&o->below, o->base, O_RDONLY, NULL);
+	}
+	if (err) {
+		close(this->fd);
+		free(o);
+		return err;
+	}
+	this->priv = o;
+	this->opened = 1;
+	return NULL;
+}
+
+/*
+ * overlaySetGeometry -- Set disk geometry, which a delta keeps once used
+ */
+static const char *overlaySetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	struct Overlay *o = this->priv;
+	struct OverlayGeometry g;
+	char base[OVERLAY_HEADER];
+	const char *err;
+
+	if ((err = overlayReadHeader(this->fd, base, &g))) {
+		return err;
+	}
+	if (g.secLength == 0) {
+		g.secLength = secLength;
+		g.sectrk = sectrk;
+		g.tracks = tracks;
+		g.offset = offset;
+		snprintf(g.libdskGeometry, sizeof(g.libdskGeometry), "%s", libdskGeometry ? libdskGeometry : "");
+		if (o->writable && (err = overlayWriteHeader(this->fd, o->base, &g))) {
+			return err;
+		}
+	} else if (g.secLength != secLength || g.sectrk != sectrk || g.tracks != tracks || g.offset != offset) {
+		return "overlay was made with another geometry";
+	}
+	if ((err = Device_setGeometry(&o->below, secLength, sectrk, tracks, offset, libdskGeometry))) {
+		return err;
+	}
+	free(o->present);
+	overlayLayout(&g, &o->sectors, &o->data);
+	if ((err = overlayReadBitmap(this->fd, o->sectors, &o->present))) {
+		return err;
+	}
+	this->secLength = secLength;
+	this->sectrk = sectrk;
+	this->tracks = tracks;
+	this->offset = offset;
+	return NULL;
+}
+
+/*
+ * overlaySync -- write the bitmap
+ */
+static const char *overlaySync(struct Device *this) {
+	struct Overlay *o = this->priv;
+	size_t bytes = (o->sectors + 7) / 8;
+
+	if (!o->dirty) {
+		return NULL;
+	}
+	DEVICE_SYSCALLS(this, 1);
+	if (pwrite(this->fd, o->present, bytes, OVERLAY_HEADER) != (ssize_t)bytes) {
+		return strerror(errno);
+	}
+	o->dirty = 0;
+	return NULL;
+}
+
+/*
+ * overlayClose -- Write the bitmap and close the delta and the image below
+ */
+static const char *overlayClose(struct Device *this) {
+	struct Overlay *o = this->priv;
+	const char *err, *berr;
+
+	err = overlaySync(this);
+	berr = Device_close(&o->below);
+	this->opened = 0;
+	if (close(this->fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	free(o->present);
+	free(o);
+	this->priv = NULL;
+	return (err ? err : berr);
+}
+
+/*
+ * overlayReadSector -- read a physical sector from the delta or below
+ */
+static const char *overlayReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	struct Overlay *o = this->priv;
+	long lsect;
+	ssize_t res;
+
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	lsect = (long)track * this->sectrk + sector;
+	if (!(o->present[lsect / 8] & (1 << (lsect % 8)))) {
+		return Device_readSector(&o->below, track, sector, buf);
+	}
+	DEVICE_SYSCALLS(this, 1);
+	res = pread(this->fd, buf, this->secLength, o->data + (off_t)lsect * this->secLength);
+	if (res == -1) {
+		return strerror(errno);
+	}
+	if (res != this->secLength) {
+		return "overlay too short";
+	}
+	return NULL;
+}
+
+/*
+ * overlayWriteSector -- write a physical sector to the delta
+ */
+static const char *overlayWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	struct Overlay *o = this->priv;
+	long lsect;
+
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	lsect = (long)track * this->sectrk + sector;
+	DEVICE_SYSCALLS(this, 1);
+	if (pwrite(this->fd, buf, this->secLength, o->data + (off_t)lsect * this->secLength) != this->secLength) {
+		return strerror(errno);
+	}
+	if (!(o->present[lsect / 8] & (1 << (lsect % 8)))) {
+		o->present[lsect / 8] |= 1 << (lsect % 8);
+		o->dirty = 1;
+	}
+	return NULL;
+}
+
+const struct DeviceDriver overlayDriver = {
+	"overlay",
+	0,
+	0,
+	overlayProbe,
+	overlayOpen,
+	overlaySetGeometry,
+	overlayClose,
+	overlaySync,
+	overlayReadSector,
+	overlayWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
+
+/*
+ * Overlay_create -- make an empty delta on top of an image
+ */
+const char *Overlay_create(const char *delta, const char *base) {
+	char path[PATH_MAX];
+	const char *err;
+	int fd;
+
+	if (realpath(base, path) == NULL) {
+		return strerror(errno);
+	}
+	if ((fd = open(delta, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666)) == -1) {
+		return strerror(errno);
+	}
+	err = overlayWriteHeader(fd, path, NULL);
+	if (close(fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	if (err) {
+		unlink(delta);
+	}
+	return err;
+}
+
+/*
+ * Overlay_discard -- forget the sectors of a delta
+ */
+const char *Overlay_discard(const char *delta) {
+	struct OverlayGeometry g;
+	char base[OVERLAY_HEADER];
+	const char *err;
+	int fd;
+
+	if ((fd = open(delta, O_RDWR | O_BINARY)) == -1) {
+		return strerror(errno);
+	}
+	if ((err = overlayReadHeader(fd, base, &g)) == NULL && ftruncate(fd, OVERLAY_HEADER) == -1) {
+		err = strerror(errno);
+	}
+	if (close(fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	return err;
+}
+
+/*
+ * Overlay_commit -- write the sectors of a delta to the image below and
+ * discard them, *sectors is set to their number
+ */
+const char *Overlay_commit(const char *delta, long *sectors) {
+	struct OverlayGeometry g;
+	struct Device below;
+	char base[OVERLAY_HEADER];
+	unsigned char *present = NULL, *buf = NULL;
+	const char *err, *cerr;
+	long count, lsect;
+	off_t data;
+	int fd;
+
+	*sectors = 0;
+	if ((fd = open(delta, O_RDONLY | O_BINARY)) == -1) {
+		return strerror(errno);
+	}
+	if ((err = overlayReadHeader(fd, base, &g)) || g.secLength == 0) {
+		/* a delta that was never used has nothing to commit */
+		close(fd);
+		return err;
+	}
+	overlayLayout(&g, &count, &data);
+	if ((err = overlayReadBitmap(fd, count, &present)) == NULL && (buf = malloc(g.secLength)) == NULL) {
+		err = strerror(errno);
+	}
+	if (err == NULL && (err = Device_open(&below, base, O_RDWR, NULL)) == NULL) {
+		err = Device_setGeometry(&below, g.secLength, g.sectrk, g.tracks, g.offset, *g.libdskGeometry ? g.libdskGeometry : NULL);
+		for (lsect = 0; err == NULL && lsect < count; ++lsect) {
+			if (!(present[lsect / 8] & (1 << (lsect % 8)))) {
+				continue;
+			}
+			if (pread(fd, buf, g.secLength, data + (off_t)lsect * g.secLength) != g.secLength) {
+				err = "overlay too short";
+			} else if ((err = Device_writeSector(&below, lsect / g.sectrk, lsect % g.sectrk, buf)) == NULL) {
+				++*sectors;
+			}
+		}
+		cerr = Device_close(&below);
+		if (err == NULL) {
+			err = cerr;
+		}
+	}
+	free(present);
+	free(buf);
+	close(fd);
+	if (err == NULL) {
+		err = Overlay_discard(delta);
+	}
+	return err;
+}
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
 #include "config.h"
 
 #include <assert.h>
@@ -8,41 +11,403 @@
 
 #include "device.h"
 
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__linux__)
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_URING
+#endif
+#endif
+
+#ifdef USE_URING
+/* Queue depth of the ring; a full queue is reaped before queueing more */
+#define URING_ENTRIES 64
+
+/* Least buffer alignment for O_DIRECT transfers */
+#define DIRECT_ALIGN 4096
+
+struct UringOp {
+	struct iovec iov;
+	unsigned char *buf;    /* caller buffer */
+	off_t pos;
+	int write;
+};
+
+struct Uring {
+	int fd;
+	void *sqmap;
+	size_t sqmapLen;
+	void *cqmap;
+	size_t cqmapLen;
+	struct io_uring_sqe *sqes;
+	size_t sqesLen;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned queued;        /* prepared, but not yet submitted */
+	unsigned pending;       /* not yet reaped, including queued */
+	int odirect;            /* O_DIRECT is in effect, use bounce buffers */
+	int bounceLen;          /* size of each bounce buffer */
+	unsigned char *bounce;  /* URING_ENTRIES aligned bounce buffers */
+	struct UringOp ops[URING_ENTRIES];
+};
+
+/*
+ * uringFree -- tear down the ring
+ */
+static void uringFree(struct Uring *u) {
+	if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+		munmap(u->sqes, u->sqesLen);
+	}
+	if (u->cqmap != NULL && u->cqmap != MAP_FAILED && u->cqmap != u->sqmap) {
+		munmap(u->cqmap, u->cqmapLen);
+	}
+	if (u->sqmap != NULL && u->sqmap != MAP_FAILED) {
+		munmap(u->sqmap, u->sqmapLen);
+	}
+	if (u->fd != -1) {
+		close(u->fd);
+	}
+	free(u->bounce);
+	free(u);
+}
+
+/*
+ * uringSetup -- create a ring, or return NULL if io_uring is unavailable
+ */
+static struct Uring *uringSetup(void) {
+	struct io_uring_params p;
+	struct Uring *u;
+
+	u = calloc(1, sizeof(struct Uring));
+	if (u == NULL) {
+		return NULL;
+	}
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd == -1) {
+		uringFree(u);
+		return NULL;
+	}
+	u->sqmapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqmapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqmapLen > u->sqmapLen) {
+			u->sqmapLen = u->cqmapLen;
+		}
+	}
+	u->sqmap = mmap(NULL, u->sqmapLen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqmap == MAP_FAILED) {
+		uringFree(u);
+		return NULL;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cqmap = u->sqmap;
+	} else {
+		u->cqmap = mmap(NULL, u->cqmapLen, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cqmap == MAP_FAILED) {
+			uringFree(u);
+			return NULL;
+		}
+	}
+	u->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqesLen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		uringFree(u);
+		return NULL;
+	}
+	u->sqHead = (unsigned *)((char *)u->sqmap + p.sq_off.head);
+	u->sqTail = (unsigned *)((char *)u->sqmap + p.sq_off.tail);
+	u->sqMask = (unsigned *)((char *)u->sqmap + p.sq_off.ring_mask);
+	u->sqArray = (unsigned *)((char *)u->sqmap + p.sq_off.array);
+	u->cqHead = (unsigned *)((char *)u->cqmap + p.cq_off.head);
+	u->cqTail = (unsigned *)((char *)u->cqmap + p.cq_off.tail);
+	u->cqMask = (unsigned *)((char *)u->cqmap + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cqmap + p.cq_off.cqes);
+	return u;
+}
+
+/*
+ * uringBuffered -- repeat a transfer that O_DIRECT refused without it
+ *
+ * The alignment of the device was guessed wrong, so O_DIRECT is switched
+ * off for good and the transfer is done right away.
+ */
+static int uringBuffered(const struct Device *this, struct UringOp *op) {
+	struct Uring *u = this->priv;
+	int flags;
+	ssize_t res;
+
+	u->odirect = 0;
+	DEVICE_SYSCALLS(this, 3);
+	if ((flags = fcntl(this->fd, F_GETFL)) != -1) {
+		fcntl(this->fd, F_SETFL, flags & ~O_DIRECT);
+	}
+	if (op->write) {
+		res = pwrite(this->fd, op->iov.iov_base, this->secLength, op->pos);
+	} else {
+		res = pread(this->fd, op->iov.iov_base, this->secLength, op->pos);
+	}
+	return (res == -1 ? -errno : (int)res);
+}
+
+/*
+ * uringComplete -- submit all queued transfers and reap every completion
+ */
+static const char *uringComplete(const struct Device *this) {
+	struct Uring *u = this->priv;
+	const char *err = NULL;
+
+	while (u->pending) {
+		unsigned head;
+		int res;
+
+		res = syscall(__NR_io_uring_enter, u->fd, u->queued, u->pending,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		DEVICE_SYSCALLS(this, 1);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return strerror(errno);
+		}
+		u->queued -= res;
+		head = *u->cqHead;
+		while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cqMask];
+			struct UringOp *op = &u->ops[cqe->user_data];
+			int result = cqe->res;
+
+			if (result == -EINVAL && op->iov.iov_base != op->buf) {
+				result = uringBuffered(this, op);
+			}
+			if (result < 0) {
+				if (err == NULL) {
+					err = strerror(-result);
+				}
+			} else if (op->write) {
+				if (result != this->secLength && err == NULL) {
+					err = "short write";
+				}
+			} else {
+				if (result < this->secLength) {
+					/* hit end of disk image */
+					memset((unsigned char *)op->iov.iov_base + result, 0,
+						this->secLength - result);
+				}
+				if (op->iov.iov_base != op->buf) {
+					memcpy(op->buf, op->iov.iov_base, this->secLength);
+				}
+			}
+			++head;
+			--u->pending;
+		}
+		__atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+	}
+	return err;
+}
+
+/*
+ * uringQueue -- queue one sector transfer
+ */
+static const char *uringQueue(const struct Device *this, off_t pos, unsigned char *buf, int write) {
+	struct Uring *u = this->priv;
+	struct io_uring_sqe *sqe;
+	struct UringOp *op;
+	unsigned tail, slot;
+
+	if (u->pending == URING_ENTRIES) {
+		const char *err = uringComplete(this);
+
+		if (err) {
+			return err;
+		}
+	}
+	slot = u->pending;
+	op = &u->ops[slot];
+	op->buf = buf;
+	op->pos = pos;
+	op->write = write;
+	op->iov.iov_len = this->secLength;
+	if (u->odirect) {
+		op->iov.iov_base = u->bounce + slot * u->bounceLen;
+		if (write) {
+			memcpy(op->iov.iov_base, buf, this->secLength);
+		}
+	} else {
+		op->iov.iov_base = buf;
+	}
+	sqe = &u->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = this->fd;
+	sqe->off = pos;
+	sqe->addr = (unsigned long)&op->iov;
+	sqe->len = 1;
+	sqe->user_data = slot;
+	tail = *u->sqTail;
+	u->sqArray[tail & *u->sqMask] = slot;
+	__atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+	++u->queued;
+	++u->pending;
+	return NULL;
+}
+
+/*
+ * directAlign -- the logical block size O_DIRECT transfers must align to
+ */
+static int directAlign(int fd) {
+	struct stat st;
+	int size;
+
+	if (fstat(fd, &st) == -1) {
+		return -1;
+	}
+#ifdef BLKSSZGET
+	if (S_ISBLK(st.st_mode)) {
+		return (ioctl(fd, BLKSSZGET, &size) == -1 ? -1 : size);
+	}
+#endif
+	/* files: the block size of the file system, which may be more than needed */
+	size = st.st_blksize;
+	return (size > 0 ? size : -1);
+}
+
+/*
+ * uringDirect -- switch O_DIRECT on if requested and the geometry permits
+ */
+static void uringDirect(struct Device *this) {
+	struct Uring *u = this->priv;
+	int flags, align;
+
+	free(u->bounce);
+	u->bounce = NULL;
+	u->odirect = 0;
+	flags = fcntl(this->fd, F_GETFL);
+	if (flags == -1) {
+		return;
+	}
+	if (!this->direct || (align = directAlign(this->fd)) == -1
+		|| this->secLength % align || this->offset % align) {
+		fcntl(this->fd, F_SETFL, flags & ~O_DIRECT);
+		return;
+	}
+	if (align < DIRECT_ALIGN) {
+		align = DIRECT_ALIGN;
+	}
+	u->bounceLen = ((this->secLength + align - 1) / align) * align;
+	if (posix_memalign((void **)&u->bounce, align, URING_ENTRIES * u->bounceLen)) {
+		u->bounce = NULL;
+		return;
+	}
+	if (fcntl(this->fd, F_SETFL, flags | O_DIRECT) == -1) {
+		/* file system does not support it, stay buffered */
+		free(u->bounce);
+		u->bounce = NULL;
+		return;
+	}
+	u->odirect = 1;
+}
+#endif
+
 /*
- * Device_open -- Open an image file 
+ * posixOpen -- Open an image file
  */
-const char *Device_open(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
-	if (deviceOpts != NULL) {
-		return "POSIX driver accepts no options (build compiled without libdsk)";
+static const char *posixOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+	int sync = 0;
+
+	this->direct = 0;
+	this->priv = NULL;
+	while (deviceOpts != NULL && *deviceOpts) {
+		size_t len = strcspn(deviceOpts, ",");
+
+		if (len == 4 && strncmp(deviceOpts, "sync", 4) == 0) {
+			sync = 1;
+		} else if (len == 6 && strncmp(deviceOpts, "direct", 6) == 0) {
+			this->direct = 1;
+		} else {
+			return "POSIX driver only accepts the options sync and direct";
+		}
+		deviceOpts += len;
+		if (*deviceOpts == ',') {
+			++deviceOpts;
+		}
 	}
 	this->fd = open(filename, mode);
 	this->opened = (this->fd == -1 ? 0 : 1);
-	return ((this->fd == -1) ? strerror(errno) : NULL);
+	if (this->fd == -1) {
+		return strerror(errno);
+	}
+#ifdef USE_URING
+	if (!sync) {
+		/* the ring is all the state of the driver, NULL without it */
+		this->priv = uringSetup();
+	}
+#else
+	(void)sync;
+#endif
+	return NULL;
 }
 
 /*
- * Device_setGeometry -- Set disk geometry 
+ * posixSetGeometry -- Set disk geometry
  */
-const char *Device_setGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+static const char *posixSetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
 	this->secLength = secLength;
 	this->sectrk = sectrk;
 	this->tracks = tracks;
 	this->offset = offset;
+#ifdef USE_URING
+	if (this->opened && this->priv) {
+		const char *err = uringComplete(this);
+
+		if (err) {
+			return err;
+		}
+		uringDirect(this);
+	}
+#endif
 	return NULL;
 }
 
 /*
- * Device_close -- Close an image file 
+ * posixClose -- Close an image file
  */
-const char *Device_close(struct Device *this) {
+static const char *posixClose(struct Device *this) {
+	const char *err = NULL;
+
+#ifdef USE_URING
+	if (this->priv) {
+		err = uringComplete(this);
+		uringFree(this->priv);
+		this->priv = NULL;
+	}
+#endif
 	this->opened = 0;
-	return ((close(this->fd) == -1) ? strerror(errno) : NULL);
+	if (close(this->fd) == -1) {
+		return strerror(errno);
+	}
+	return err;
+}
+
+/*
+ * posixSync -- write back buffered sectors (nothing is buffered here)
+ */
+static const char *posixSync(struct Device *this) {
+	return NULL;
 }
 
 /*
- * Device_readSector -- read a physical sector 
+ * posixReadSector -- read a physical sector
  */
-const char *Device_readSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+static const char *posixReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
 	int res;
 
 	assert(this);
@@ -51,6 +416,14 @@ const char *Device_readSector(const struct Device *this, int track, int sector,
 	assert(track >= 0);
 	assert(track < this->tracks);
 	assert(buf);
+#ifdef USE_URING
+	if (this->priv && ((struct Uring *)this->priv)->odirect) {
+		const char *err = uringQueue(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, buf, 0);
+
+		return (err ? err : uringComplete(this));
+	}
+#endif
+	DEVICE_SYSCALLS(this, 2);
 	if (lseek(this->fd, (off_t)(((sector + track * this->sectrk)*this->secLength) + this->offset), SEEK_SET) == -1) {
 		return strerror(errno);
 	}
@@ -67,13 +440,21 @@ const char *Device_readSector(const struct Device *this, int track, int sector,
 }
 
 /*
- * Device_writeSector -- write physical sector 
+ * posixWriteSector -- write physical sector
  */
-const char *Device_writeSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+static const char *posixWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
 	assert(sector >= 0);
 	assert(sector < this->sectrk);
 	assert(track >= 0);
 	assert(track < this->tracks);
+#ifdef USE_URING
+	if (this->priv && ((struct Uring *)this->priv)->odirect) {
+		const char *err = uringQueue(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, (unsigned char *)buf, 1);
+
+		return (err ? err : uringComplete(this));
+	}
+#endif
+	DEVICE_SYSCALLS(this, 2);
 	if (lseek(this->fd, (off_t)(((sector + track * this->sectrk)*this->secLength) + this->offset), SEEK_SET) == -1) {
 		return strerror(errno);
 	}
@@ -82,3 +463,64 @@ const char *Device_writeSector(const struct Device *this, int track, int sector,
 	}
 	return strerror(errno);
 }
+
+/*
+ * posixQueueRead -- queue reading a physical sector
+ */
+static const char *posixQueueRead(const struct Device *this, int track, int sector, unsigned char *buf) {
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	assert(buf);
+#ifdef USE_URING
+	if (this->priv) {
+		return uringQueue(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, buf, 0);
+	}
+#endif
+	return posixReadSector(this, track, sector, buf);
+}
+
+/*
+ * posixQueueWrite -- queue writing a physical sector
+ */
+static const char *posixQueueWrite(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+#ifdef USE_URING
+	if (this->priv) {
+		return uringQueue(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, (unsigned char *)buf, 1);
+	}
+#endif
+	return posixWriteSector(this, track, sector, buf);
+}
+
+/*
+ * posixComplete -- wait for all queued transfers
+ */
+static const char *posixComplete(const struct Device *this) {
+#ifdef USE_URING
+	if (this->priv) {
+		return uringComplete(this);
+	}
+#endif
+	return NULL;
+}
+
+const struct DeviceDriver posixDriver = {
+	"posix",
+	0,
+	1,
+	NULL,
+	posixOpen,
+	posixSetGeometry,
+	posixClose,
+	posixSync,
+	posixReadSector,
+	posixWriteSector,
+	posixQueueRead,
+	posixQueueWrite,
+	posixComplete
+};
@@ -254,10 +254,10 @@ static int w32mode(int mode) {
 }
 
 
-/* Device_open -- Open an image file */
-const char *Device_open(struct Device *sb, const char *filename, int mode, const char *deviceOpts) {
+/* win32Open -- Open an image file */
+static const char *win32Open(struct Device *sb, const char *filename, int mode, const char *deviceOpts) {
 	if (deviceOpts != NULL) {
-		return "Win32 driver accepts no options (build compiled without libdsk)";
+		return "Win32 driver accepts no options";
 	}
 	/* Windows 95/NT: floppy drives using handles */
 	if (strlen(filename) == 2 && filename[1] == ':') {  /* Drive name */
@@ -367,8 +367,8 @@ const char *Device_open(struct Device *sb, const char *filename, int mode, const
 	return NULL;
 }
 
-/* Device_setGeometry -- Set disk geometry */
-const char *Device_setGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+/* win32SetGeometry -- Set disk geometry */
+static const char *win32SetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
 	int n;
 
 	this->secLength = secLength;
@@ -428,8 +428,8 @@ const char *Device_setGeometry(struct Device *this, int secLength, int sectrk, i
 	return NULL;
 }
 
-/* Device_close -- Close an image file */
-const char *Device_close(struct Device *sb) {
+/* win32Close -- Close an image file */
+static const char *win32Close(struct Device *sb) {
 	sb->opened = 0;
 	switch (sb->drvtype) {
 	case CPMDRV_WIN95:
@@ -453,8 +453,13 @@ const char *Device_close(struct Device *sb) {
 	return NULL;
 }
 
-/* Device_readSector -- read a physical sector */
-const char *Device_readSector(const struct Device *drive, int track, int sector, unsigned char *buf) {
+/* win32Sync -- write back buffered sectors (nothing is buffered here) */
+static const char *win32Sync(struct Device *drive) {
+	return NULL;
+}
+
+/* win32ReadSector -- read a physical sector */
+static const char *win32ReadSector(const struct Device *drive, int track, int sector, unsigned char *buf) {
 	int res;
 	off_t offset;
 
@@ -554,8 +559,8 @@ const char *Device_readSector(const struct Device *drive, int track, int sector,
 	return NULL;
 }
 
-/* Device_writeSector -- write physical sector */
-const char *Device_writeSector(const struct Device *drive, int track, int sector, const unsigned char *buf) {
+/* win32WriteSector -- write physical sector */
+static const char *win32WriteSector(const struct Device *drive, int track, int sector, const unsigned char *buf) {
 	off_t offset;
 	int res;
 
@@ -646,3 +651,19 @@ const char *Device_writeSector(const struct Device *drive, int track, int sector
 	}
 	return strerror(errno);
 }
+
+const struct DeviceDriver win32Driver = {
+	"win32",
+	0,
+	0,
+	NULL,
+	win32Open,
+	win32SetGeometry,
+	win32Close,
+	win32Sync,
+	win32ReadSector,
+	win32WriteSector,
+	NULL,
+	NULL,
+	NULL
+};
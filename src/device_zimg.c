@@ -0,0 +1,584 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device.h"
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * The zimg driver reads and writes images in a container of chunks of
+ * the image, compressed one by one with zlib.  An index at the end of the
+ * container gives the position and length of every chunk, so only the
+ * chunks holding the sectors asked for are read and inflated.  The most
+ * recently used chunks are kept inflated in memory.
+ *
+ * A changed chunk is compressed again when it leaves the cache and
+ * appended to the container, and Device_sync appends a new index and
+ * points the header to it.  Chunks of zeros are not stored at all and
+ * chunks that do not compress are stored as they are.  The space of
+ * replaced chunks is only reclaimed by converting the container again.
+ *
+ * The header is ZIMG_HEADER bytes: the magic, the chunk size (4 bytes),
+ * 4 reserved bytes, the image size, the number of chunks and the position
+ * of the index (8 bytes each).  An index entry is the position (8 bytes)
+ * and length (4 bytes) of a chunk.  All numbers are little endian.
+ */
+#define ZIMG_MAGIC "CPMZIMG1"
+#define ZIMG_HEADER 64
+#define ZIMG_ENTRY 12
+
+/* Chunks kept inflated */
+#define ZIMG_CACHE 16
+
+struct ZChunk {
+	long chunk;               /* -1 if free */
+	int dirty;
+	unsigned long used;       /* for LRU replacement */
+	unsigned char *data;
+};
+
+struct ZImage {
+	int writable;
+	unsigned chunkSize;
+	off_t imageSize;
+	long chunks;              /* entries in the index */
+	off_t *position;
+	unsigned *length;         /* 0 for a chunk of zeros */
+	off_t end;                /* end of the container, chunks go here */
+	int dirty;                /* index changed since the last sync */
+	unsigned long clock;
+	struct ZChunk cache[ZIMG_CACHE];
+	unsigned char *packed;    /* a compressed chunk */
+};
+
+static void put32(unsigned char *p, unsigned long v) {
+	int i;
+
+	for (i = 0; i < 4; ++i, v >>= 8) {
+		p[i] = v & 0xff;
+	}
+}
+
+static void put64(unsigned char *p, unsigned long long v) {
+	int i;
+
+	for (i = 0; i < 8; ++i, v >>= 8) {
+		p[i] = v & 0xff;
+	}
+}
+
+static unsigned long get32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static unsigned long long get64(const unsigned char *p) {
+	return get32(p) | ((unsigned long long)get32(p + 4) << 32);
+}
+
+/*
+ * zimgFree -- release a container in memory
+ */
+static void zimgFree(struct ZImage *z) {
+	int i;
+
+	for (i = 0; i < ZIMG_CACHE; ++i) {
+		free(z->cache[i].data);
+	}
+	free(z->position);
+	free(z->length);
+	free(z->packed);
+	free(z);
+}
+
+/*
+ * zimgNew -- set up an empty container in memory
+ */
+static struct ZImage *zimgNew(unsigned chunkSize) {
+	struct ZImage *z;
+	int i, failed;
+
+	if ((z = malloc(sizeof(struct ZImage))) == NULL) {
+		return NULL;
+	}
+	memset(z, 0, sizeof(struct ZImage));
+	z->chunkSize = chunkSize;
+	z->end = ZIMG_HEADER;
+	z->packed = malloc(compressBound(chunkSize));
+	failed = (z->packed == NULL);
+	for (i = 0; i < ZIMG_CACHE; ++i) {
+		z->cache[i].chunk = -1;
+		z->cache[i].data = malloc(chunkSize);
+		failed |= (z->cache[i].data == NULL);
+	}
+	if (failed) {
+		zimgFree(z);
+		return NULL;
+	}
+	return z;
+}
+
+/*
+ * zimgGrow -- make room in the index for chunks
+ */
+static const char *zimgGrow(struct ZImage *z, long chunks) {
+	off_t *position;
+	unsigned *length;
+
+	if (chunks <= z->chunks) {
+		return NULL;
+	}
+	if ((position = realloc(z->position, chunks * sizeof(off_t))) == NULL) {
+		return strerror(errno);
+	}
+	z->position = position;
+	if ((length = realloc(z->length, chunks * sizeof(unsigned))) == NULL) {
+		return strerror(errno);
+	}
+	z->length = length;
+	memset(z->position + z->chunks, 0, (chunks - z->chunks) * sizeof(off_t));
+	memset(z->length + z->chunks, 0, (chunks - z->chunks) * sizeof(unsigned));
+	z->chunks = chunks;
+	return NULL;
+}
+
+/*
+ * zimgReadIndex -- read the header and index of a container
+ */
+static const char *zimgReadIndex(int fd, struct ZImage **zp) {
+	unsigned char header[ZIMG_HEADER], *index;
+	struct ZImage *z;
+	const char *err;
+	off_t at;
+	long i;
+
+	if (pread(fd, header, ZIMG_HEADER, 0) != ZIMG_HEADER || memcmp(header, ZIMG_MAGIC, 8)) {
+		return "not a zimg container";
+	}
+	if (get32(header + 8) == 0 || (z = zimgNew(get32(header + 8))) == NULL) {
+		return "can not allocate chunk buffers";
+	}
+	z->imageSize = get64(header + 16);
+	at = get64(header + 32);
+	if ((err = zimgGrow(z, get64(header + 24)))) {
+		zimgFree(z);
+		return err;
+	}
+	if ((index = malloc(z->chunks * ZIMG_ENTRY + 1)) == NULL) {
+		zimgFree(z);
+		return strerror(errno);
+	}
+	if (pread(fd, index, z->chunks * ZIMG_ENTRY, at) != z->chunks * ZIMG_ENTRY) {
+		free(index);
+		zimgFree(z);
+		return "zimg index too short";
+	}
+	for (i = 0; i < z->chunks; ++i) {
+		z->position[i] = get64(index + i * ZIMG_ENTRY);
+		z->length[i] = get32(index + i * ZIMG_ENTRY + 8);
+	}
+	free(index);
+	z->end = at + z->chunks * ZIMG_ENTRY;
+	*zp = z;
+	return NULL;
+}
+
+/*
+ * zimgWriteIndex -- append the index and point the header to it
+ */
+static const char *zimgWriteIndex(int fd, struct ZImage *z) {
+	unsigned char header[ZIMG_HEADER], *index;
+	long i;
+
+	if ((index = malloc(z->chunks * ZIMG_ENTRY + 1)) == NULL) {
+		return strerror(errno);
+	}
+	for (i = 0; i < z->chunks; ++i) {
+		put64(index + i * ZIMG_ENTRY, z->position[i]);
+		put32(index + i * ZIMG_ENTRY + 8, z->length[i]);
+	}
+	if (pwrite(fd, index, z->chunks * ZIMG_ENTRY, z->end) != z->chunks * ZIMG_ENTRY) {
+		free(index);
+		return strerror(errno);
+	}
+	free(index);
+	memset(header, 0, sizeof(header));
+	memcpy(header, ZIMG_MAGIC, 8);
+	put32(header + 8, z->chunkSize);
+	put64(header + 16, z->imageSize);
+	put64(header + 24, z->chunks);
+	put64(header + 32, z->end);
+	if (pwrite(fd, header, ZIMG_HEADER, 0) != ZIMG_HEADER) {
+		return strerror(errno);
+	}
+	/* the next chunk must not overwrite the index in use */
+	z->end += z->chunks * ZIMG_ENTRY;
+	z->dirty = 0;
+	return NULL;
+}
+
+/*
+ * zimgInflate -- read a chunk from the container
+ */
+static const char *zimgInflate(int fd, struct ZImage *z, long chunk, unsigned char *data) {
+	uLongf length = z->chunkSize;
+
+	if (chunk >= z->chunks || z->length[chunk] == 0) {
+		memset(data, 0, z->chunkSize);
+		return NULL;
+	}
+	if (z->length[chunk] > compressBound(z->chunkSize)) {
+		return "invalid zimg chunk";
+	}
+	if (pread(fd, z->packed, z->length[chunk], z->position[chunk]) != z->length[chunk]) {
+		return "zimg chunk too short";
+	}
+	if (z->length[chunk] == z->chunkSize) {
+		/* stored as it is */
+		memcpy(data, z->packed, z->chunkSize);
+		return NULL;
+	}
+	if (uncompress(data, &length, z->packed, z->length[chunk]) != Z_OK) {
+		return "corrupt zimg chunk";
+	}
+	memset(data + length, 0, z->chunkSize - length);
+	return NULL;
+}
+
+/*
+ * zimgDeflate -- append a chunk to the container
+ */
+static const char *zimgDeflate(int fd, struct ZImage *z, long chunk, const unsigned char *data, int level) {
+	uLongf length = compressBound(z->chunkSize);
+	const unsigned char *out = z->packed;
+	const char *err;
+	unsigned i;
+
+	if ((err = zimgGrow(z, chunk + 1))) {
+		return err;
+	}
+	for (i = 0; i < z->chunkSize && data[i] == 0; ++i);
+	if (i == z->chunkSize) {
+		z->length[chunk] = 0;
+		z->dirty = 1;
+		return NULL;
+	}
+	if (compress2(z->packed, &length, data, z->chunkSize, level) != Z_OK || length >= z->chunkSize) {
+		out = data;
+		length = z->chunkSize;
+	}
+	if (pwrite(fd, out, length, z->end) != (ssize_t)length) {
+		return strerror(errno);
+	}
+	z->position[chunk] = z->end;
+	z->length[chunk] = length;
+	z->end += length;
+	z->dirty = 1;
+	return NULL;
+}
+
+/*
+ * zimgChunk -- get a chunk into the cache
+ */
+static const char *zimgChunk(const struct Device *this, long chunk, struct ZChunk **entry) {
+	struct ZImage *z = this->priv;
+	struct ZChunk *e, *lru = NULL;
+	const char *err;
+	int i;
+
+	for (i = 0; i < ZIMG_CACHE; ++i) {
+		e = &z->cache[i];
+		if (e->chunk == chunk) {
+			e->used = ++z->clock;
+			*entry = e;
+			return NULL;
+		}
+		if (lru == NULL || e->used < lru->used) {
+			lru = e;
+		}
+	}
+	if (lru->dirty) {
+		DEVICE_SYSCALLS(this, 1);
+		if ((err = zimgDeflate(this->fd, z, lru->chunk, lru->data, Z_DEFAULT_COMPRESSION))) {
+			return err;
+		}
+		lru->dirty = 0;
+	}
+	lru->chunk = -1;
+	DEVICE_SYSCALLS(this, 1);
+	if ((err = zimgInflate(this->fd, z, chunk, lru->data))) {
+		return err;
+	}
+	lru->chunk = chunk;
+	lru->used = ++z->clock;
+	*entry = lru;
+	return NULL;
+}
+
+/*
+ * zimgTransfer -- copy bytes of the image, which may span chunks
+ */
+static const char *zimgTransfer(const struct Device *this, off_t pos, unsigned char *buf, int length, int write) {
+	struct ZImage *z = this->priv;
+	struct ZChunk *e;
+	const char *err;
+
+	if (write && pos + length > z->imageSize) {
+		z->imageSize = pos + length;
+		z->dirty = 1;
+	}
+	while (length > 0) {
+		unsigned at = pos % z->chunkSize;
+		int n = (z->chunkSize - at < (unsigned)length ? (int)(z->chunkSize - at) : length);
+
+		if (!write && pos >= z->imageSize) {
+			/* beyond the end of the image */
+			memset(buf, 0, length);
+			return NULL;
+		}
+		if ((err = zimgChunk(this, pos / z->chunkSize, &e))) {
+			return err;
+		}
+		if (write) {
+			memcpy(e->data + at, buf, n);
+			e->dirty = 1;
+		} else {
+			memcpy(buf, e->data + at, n);
+		}
+		pos += n;
+		buf += n;
+		length -= n;
+	}
+	return NULL;
+}
+
+/*
+ * zimgProbe -- take containers
+ */
+static int zimgProbe(const char *filename, int mode, const struct stat *st, const unsigned char *head, size_t headLength) {
+	return (headLength >= 8 && memcmp(head, ZIMG_MAGIC, 8) == 0);
+}
+
+/*
+ * zimgOpen -- Open a container and read its index
+ */
+static const char *zimgOpen(struct Device *this, const char *filename, int mode, const char *deviceOpts) {
+	struct ZImage *z;
+	const char *err;
+
+	if (deviceOpts != NULL) {
+		return "zimg driver accepts no options";
+	}
+	this->opened = 0;
+	this->fd = open(filename, (mode & O_ACCMODE) | O_BINARY);
+	if (this->fd == -1) {
+		return strerror(errno);
+	}
+	if ((err = zimgReadIndex(this->fd, &z))) {
+		close(this->fd);
+		return err;
+	}
+	z->writable = ((mode & O_ACCMODE) != O_RDONLY);
+	this->priv = z;
+	this->opened = 1;
+	return NULL;
+}
+
+/*
+ * zimgSetGeometry -- Set disk geometry
+ */
+static const char *zimgSetGeometry(struct Device *this, int secLength, int sectrk, int tracks, off_t offset, const char *libdskGeometry) {
+	this->secLength = secLength;
+	this->sectrk = sectrk;
+	this->tracks = tracks;
+	this->offset = offset;
+	return NULL;
+}
+
+/*
+ * zimgSync -- compress changed chunks and write the index
+ */
+static const char *zimgSync(struct Device *this) {
+	struct ZImage *z = this->priv;
+	const char *err;
+	int i;
+
+	for (i = 0; i < ZIMG_CACHE; ++i) {
+		if (z->cache[i].dirty) {
+			DEVICE_SYSCALLS(this, 1);
+			if ((err = zimgDeflate(this->fd, z, z->cache[i].chunk, z->cache[i].data, Z_DEFAULT_COMPRESSION))) {
+				return err;
+			}
+			z->cache[i].dirty = 0;
+		}
+	}
+	if (z->dirty) {
+		DEVICE_SYSCALLS(this, 2);
+		return zimgWriteIndex(this->fd, z);
+	}
+	return NULL;
+}
+
+/*
+ * zimgClose -- Sync and close a container
+ */
+static const char *zimgClose(struct Device *this) {
+	const char *err;
+
+	err = zimgSync(this);
+	this->opened = 0;
+	zimgFree(this->priv);
+	this->priv = NULL;
+	if (close(this->fd) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	return err;
+}
+
+/*
+ * zimgReadSector -- read a physical sector
+ */
+static const char *zimgReadSector(const struct Device *this, int track, int sector, unsigned char *buf) {
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	return zimgTransfer(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, buf, this->secLength, 0);
+}
+
+/*
+ * zimgWriteSector -- write a physical sector
+ */
+static const char *zimgWriteSector(const struct Device *this, int track, int sector, const unsigned char *buf) {
+	assert(sector >= 0);
+	assert(sector < this->sectrk);
+	assert(track >= 0);
+	assert(track < this->tracks);
+	if (!((struct ZImage *)this->priv)->writable) {
+		return strerror(EBADF);
+	}
+	return zimgTransfer(this, (off_t)(sector + track * this->sectrk) * this->secLength + this->offset, (unsigned char *)buf, this->secLength, 1);
+}
+
+const struct DeviceDriver zimgDriver = {
+	"zimg",
+	1,
+	0,
+	zimgProbe,
+	zimgOpen,
+	zimgSetGeometry,
+	zimgClose,
+	zimgSync,
+	zimgReadSector,
+	zimgWriteSector,
+	NULL,
+	NULL,
+	NULL
+};
+
+/*
+ * Zimg_compress -- convert a raw image to a container
+ */
+const char *Zimg_compress(const char *image, const char *container, unsigned chunkSize, int level) {
+	struct ZImage *z;
+	const char *err = NULL;
+	int in, out;
+	long chunk;
+	ssize_t res = 0;
+
+	if (chunkSize == 0 || (z = zimgNew(chunkSize)) == NULL) {
+		return "can not allocate chunk buffers";
+	}
+	if ((in = open(image, O_RDONLY | O_BINARY)) == -1) {
+		zimgFree(z);
+		return strerror(errno);
+	}
+	if ((out = open(container, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) == -1) {
+		err = strerror(errno);
+		close(in);
+		zimgFree(z);
+		return err;
+	}
+	for (chunk = 0; err == NULL; ++chunk) {
+		off_t done = 0;
+
+		while (done < chunkSize && (res = read(in, z->cache[0].data + done, chunkSize - done)) > 0) {
+			done += res;
+		}
+		if (res == -1) {
+			err = strerror(errno);
+		} else if (done) {
+			memset(z->cache[0].data + done, 0, chunkSize - done);
+			err = zimgDeflate(out, z, chunk, z->cache[0].data, level);
+			z->imageSize += done;
+		}
+		if (done < chunkSize) {
+			break;
+		}
+	}
+	if (err == NULL) {
+		err = zimgWriteIndex(out, z);
+	}
+	if (close(out) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	close(in);
+	zimgFree(z);
+	return err;
+}
+
+/*
+ * Zimg_decompress -- convert a container to a raw image, chunks of
+ * zeros become holes
+ */
+const char *Zimg_decompress(const char *container, const char *image) {
+	struct ZImage *z;
+	const char *err;
+	int in, out;
+	long chunk;
+
+	if ((in = open(container, O_RDONLY | O_BINARY)) == -1) {
+		return strerror(errno);
+	}
+	if ((err = zimgReadIndex(in, &z))) {
+		close(in);
+		return err;
+	}
+	if ((out = open(image, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) == -1) {
+		err = strerror(errno);
+		zimgFree(z);
+		close(in);
+		return err;
+	}
+	for (chunk = 0; err == NULL && chunk < z->chunks && (off_t)chunk * z->chunkSize < z->imageSize; ++chunk) {
+		off_t pos = (off_t)chunk * z->chunkSize;
+		size_t length = (z->imageSize - pos < z->chunkSize ? z->imageSize - pos : z->chunkSize);
+
+		if (z->length[chunk] == 0) {
+			continue;
+		}
+		if ((err = zimgInflate(in, z, chunk, z->cache[0].data)) == NULL
+			&& pwrite(out, z->cache[0].data, length, pos) != (ssize_t)length) {
+			err = strerror(errno);
+		}
+	}
+	if (err == NULL && ftruncate(out, z->imageSize) == -1) {
+		err = strerror(errno);
+	}
+	if (close(out) == -1 && err == NULL) {
+		err = strerror(errno);
+	}
+	zimgFree(z);
+	close(in);
+	return err;
+}
+#endif
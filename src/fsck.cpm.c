@@ -582,6 +582,7 @@ int main(int argc, char *argv[]) {
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "T:f:nuh?")) != EOF) {
 		switch (c) {
 		case 'f':
@@ -194,6 +194,7 @@ int main(int argc, char *argv[]) {
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
 	while ((c = getopt(argc, argv, "T:f:uh?")) != EOF) {
 		switch (c) {
 		case 'f':
@@ -849,5 +850,6 @@ int main(int argc, char *argv[]) {
 	} while (ch != 'q');
 
 	term_exit();
+	cpmUmount(&drive);
 	exit(0);
 }
@@ -24,6 +24,10 @@
 #include <winioctl.h>
 #endif
 
+#define HAVE_LINUX_IO_URING_H 1
+
+#define HAVE_ZLIB_H 1
+
 /* #undef HAVE_LIBDSK_H */
 #ifdef HAVE_LIBDSK_H
 #include <libdsk.h>
@@ -1,11 +1,17 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range, SEEK_DATA */
+#endif
 #include "config.h"
 
-#include <ctype.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include "getopt_.h"
 #include "cpmfs.h"
@@ -15,137 +21,247 @@
 
 /*
  * mkfs -- make file system
+ *
+ * The system area is written at once and the image is sized to the whole
+ * file system, so the data area is left a hole in the file.
  */
-static int mkfs(struct cpmSuperBlock *drive, const char *name, const char *format, const char *label, char *bootTracks, int timeStamps, int uppercase) {
-	/* variables */
-	unsigned int i;
-	char buf[128];
-	char firstbuf[128];
+static int mkfs(struct cpmSuperBlock *drive, const char *name, const char *label, char *bootTracks, int timeStamps) {
+	unsigned char *area;
+	size_t length, done;
+	off_t size;
+	ssize_t res = 0;
+	struct stat st;
+	long long start = 0;
 	int fd;
-	unsigned int bytes;
-	unsigned int trkbytes;
-
 
-	/* open image file */
-	fd = open(name, O_BINARY | O_CREAT | O_WRONLY, 0666);
-	if (fd < 0) {
+	if ((area = cpmFormat(drive, label, bootTracks, timeStamps, &length)) == NULL) {
+		return -1;
+	}
+	if (drive->dev.stats) {
+		start = Device_clock();
+	}
+	if ((fd = open(name, O_BINARY | O_CREAT | O_RDWR, 0666)) == -1) {
+		boo = strerror(errno);
+		free(area);
+		return -1;
+	}
+	DEVICE_SYSCALLS(&drive->dev, 3);
+	for (done = 0; done < length && (res = pwrite(fd, area + done, length - done, drive->offset + done)) > 0; done += res) {
+		DEVICE_SYSCALLS(&drive->dev, 1);
+	}
+	free(area);
+	size = drive->offset + (off_t)drive->tracks * drive->sectrk * drive->secLength;
+	if (res == -1 || fstat(fd, &st) == -1
+		|| (S_ISREG(st.st_mode) && st.st_size < size && ftruncate(fd, size) == -1)) {
+		boo = strerror(errno);
+		close(fd);
+		return -1;
+	}
+	if (close(fd) == -1) {
 		boo = strerror(errno);
 		return -1;
 	}
+	if (drive->dev.stats) {
+		drive->dev.stats->writes += done / drive->secLength;
+		drive->dev.stats->bytesWritten += done;
+		drive->dev.stats->ioNanos += Device_clock() - start;
+	}
+	return 0;
+}
 
-	/* write system tracks */
-	/* this initialises only whole tracks, so it skew is not an issue */
-	trkbytes = drive->secLength * drive->sectrk;
-	for (i = 0; i < trkbytes * drive->boottrk; i += drive->secLength) {
-		if (write(fd, bootTracks + i, drive->secLength) != (ssize_t)drive->secLength) {
-			boo = strerror(errno);
-			close(fd);
-			return -1;
+/*
+ * hash -- add bytes to a 64 bit FNV-1a hash
+ */
+static unsigned long long hash(unsigned long long h, const void *data, size_t length) {
+	const unsigned char *p = data;
+
+	while (length--) {
+		h = (h ^ *p++) * 1099511628211ull;
+	}
+	return h;
+}
+
+/*
+ * templateName -- name the template of a file system in the template directory
+ *
+ * The name carries the format and a hash of all that goes into a new file
+ * system, so a changed disk definition does not find an old template.
+ */
+static char *templateName(const char *dir, const char *format, const struct cpmSuperBlock *drive,
+		const char *label, const char *bootTracks, int timeStamps) {
+	unsigned long long h = 14695981039346656037ull;
+	int geometry[12];
+	char *name, *s;
+
+	geometry[0] = drive->secLength;
+	geometry[1] = drive->tracks;
+	geometry[2] = drive->sectrk;
+	geometry[3] = drive->blksiz;
+	geometry[4] = drive->maxdir;
+	geometry[5] = drive->dirblks;
+	geometry[6] = drive->boottrk;
+	geometry[7] = (int)drive->offset;
+	geometry[8] = drive->type;
+	geometry[9] = drive->size;
+	geometry[10] = drive->extents;
+	geometry[11] = timeStamps;
+	h = hash(h, geometry, sizeof(geometry));
+	h = hash(h, drive->skewtab, drive->sectrk * sizeof(int));
+	h = hash(h, bootTracks, (size_t)drive->boottrk * drive->sectrk * drive->secLength);
+	h = hash(h, label, strlen(label) + 1);
+	if ((name = malloc(strlen(dir) + strlen(format) + 23)) == NULL) {
+		return NULL;
+	}
+	sprintf(name, "%s/%s-%016llx", dir, format, h);
+	for (s = name + strlen(dir) + 1; *s; ++s) {
+		if (*s == '/') {
+			*s = '_';
 		}
 	}
-	/* write directory */
-	memset(buf, 0xe5, 128);
-	bytes = drive->maxdir * 32;
-	if (bytes % trkbytes) {
-		bytes = ((bytes + trkbytes) / trkbytes) * trkbytes;
-	}
-	if (timeStamps && (drive->type == CPMFS_P2DOS || drive->type == CPMFS_DR3)) {
-		buf[3 * 32] = 0x21;
-	}
-	memcpy(firstbuf, buf, 128);
-	if (drive->type == CPMFS_DR3) {
-		time_t now;
-		struct tm *t;
-		int min, hour, days;
-
-		firstbuf[0] = 0x20;
-		for (i = 0; i < 11 && *label; ++i, ++label) {
-			firstbuf[1 + i] = toupper(*label & 0x7f);
-		}
-		while (i < 11) {
-			firstbuf[1 + i++] = ' ';
-		}
-		firstbuf[12] = timeStamps ? 0x11 : 0x01; /* label set and first time stamp is creation date */
-		memset(&firstbuf[13], 0, 1 + 2 + 8);
-		if (timeStamps) {
-			int year;
-
-			/* Stamp label. */
-			time(&now);
-			t = localtime(&now);
-			min = ((t->tm_min / 10) << 4) | (t->tm_min % 10);
-			hour = ((t->tm_hour / 10) << 4) | (t->tm_hour % 10);
-			for (year = 1978, days = 0; year < 1900 + t->tm_year; ++year) {
-				days += 365;
-				if (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
-					++days;
-				}
+	return name;
+}
+
+/*
+ * copyRange -- copy a range of one file to the same place in another
+ */
+static int copyRange(int in, int out, off_t pos, off_t length) {
+	char buf[4096];
+	ssize_t res;
+
+	for (; length > 0; length -= res, pos += res) {
+		res = -1;
+#ifdef __linux__
+		/* in the kernel, or as a reflink of the blocks */
+		{
+			loff_t from = pos, to = pos;
+
+			res = copy_file_range(in, &from, out, &to, length, 0);
+		}
+		if (res == -1 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+			return -1;
+		}
+#endif
+		if (res == -1) {
+			if ((res = pread(in, buf, length < (off_t)sizeof(buf) ? length : (off_t)sizeof(buf), pos)) > 0) {
+				res = pwrite(out, buf, res, pos);
+			}
+			if (res == -1) {
+				return -1;
 			}
-			days += t->tm_yday + 1;
-			firstbuf[24] = firstbuf[28] = days & 0xff;
-			firstbuf[25] = firstbuf[29] = days >> 8;
-			firstbuf[26] = firstbuf[30] = hour;
-			firstbuf[27] = firstbuf[31] = min;
 		}
-	}
-	for (i = 0; i < bytes; i += 128) {
-		if (write(fd, i == 0 ? firstbuf : buf, 128) != 128) {
-			boo = strerror(errno);
-			close(fd);
+		if (res == 0) {
+			errno = EIO;
 			return -1;
 		}
 	}
-	/* close image file */
-	if (close(fd) == -1) {
+	return 0;
+}
+
+/*
+ * cloneFile -- copy a template to an image, sharing its blocks if possible
+ *
+ * Without reflinks only the data of the template is copied, so its holes
+ * stay holes in the image.
+ */
+static int cloneFile(struct cpmSuperBlock *drive, const char *from, const char *to) {
+	struct stat st;
+	off_t pos, data, end;
+	int in, out, res = 0;
+
+	if ((in = open(from, O_BINARY | O_RDONLY)) == -1) {
 		boo = strerror(errno);
 		return -1;
 	}
+	if (fstat(in, &st) == -1 || (out = open(to, O_BINARY | O_CREAT | O_TRUNC | O_WRONLY, 0666)) == -1) {
+		boo = strerror(errno);
+		close(in);
+		return -1;
+	}
+	DEVICE_SYSCALLS(&drive->dev, 6);
+	pos = 0;
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		/* all blocks are shared, nothing is left to copy */
+		pos = st.st_size;
+	}
+	DEVICE_SYSCALLS(&drive->dev, 1);
+#endif
+	for (; res == 0 && pos < st.st_size; pos = end) {
+		data = pos;
+		end = st.st_size;
+#ifdef SEEK_DATA
+		if ((data = lseek(in, pos, SEEK_DATA)) == -1) {
+			/* nothing but a hole is left, or no holes are known */
+			data = (errno == ENXIO ? st.st_size : pos);
+		} else if ((end = lseek(in, data, SEEK_HOLE)) == -1) {
+			end = st.st_size;
+		}
+		DEVICE_SYSCALLS(&drive->dev, 2);
+#endif
+		if (data < end) {
+			res = copyRange(in, out, data, end - data);
+		}
+	}
+	if (res == 0 && fstat(out, &st) == 0 && S_ISREG(st.st_mode)) {
+		res = ftruncate(out, pos);
+	}
+	if (res == -1) {
+		boo = strerror(errno);
+	}
+	close(in);
+	if (close(out) == -1 && res == 0) {
+		boo = strerror(errno);
+		res = -1;
+	}
+	return res;
+}
 
-	if (timeStamps && !(drive->type == CPMFS_P2DOS || drive->type == CPMFS_DR3)) {
-		int offset, j;
-		struct cpmInode ino, root;
-		static const char sig[] = "!!!TIME";
-		unsigned int records;
-		struct dsDate *ds;
-		struct cpmSuperBlock super;
-		const char *err;
+/*
+ * mkfsTemplate -- make a file system as a copy of its template, making the
+ * template first if there is none yet
+ */
+static int mkfsTemplate(struct cpmSuperBlock *drive, const char *dir, const char *format, const char *name,
+		const char *label, char *bootTracks, int timeStamps) {
+	char *template, *tmp;
+	int fd, res;
 
-		err = Device_open(&super.dev, name, O_RDWR, NULL);
-		if (err) {
-			fprintf(stderr, "%s: can not open %s (%s)\n", cmd, name, err);
-			exit(1);
+	if ((template = templateName(dir, format, drive, label, bootTracks, timeStamps)) == NULL) {
+		boo = strerror(errno);
+		return -1;
+	}
+	if (access(template, R_OK) == -1) {
+		/* made under a temporary name, so others never see half a template */
+		if ((mkdir(dir, 0777) == -1 && errno != EEXIST)
+			|| (tmp = malloc(strlen(template) + 8)) == NULL) {
+			boo = strerror(errno);
+			free(template);
+			return -1;
 		}
-		cpmReadSuper(&super, &root, format, uppercase);
-
-		records = root.sb->maxdir / 8;
-		ds = malloc(records * 128);
-		if (ds == NULL) {
-			cpmUmount(&super);
+		sprintf(tmp, "%s.XXXXXX", template);
+		if ((fd = mkstemp(tmp)) == -1) {
+			boo = strerror(errno);
+			free(tmp);
+			free(template);
 			return -1;
 		}
-		memset(ds, 0, records * 128);
-		offset = 15;
-		for (i = 0; i < records; i++) {
-			for (j = 0; j < 7; j++, offset += 16) {
-				*((char *)ds + offset) = sig[j];
-			}
-			/* skip checksum byte */
-			offset += 16;
+		close(fd);
+		res = mkfs(drive, tmp, label, bootTracks, timeStamps);
+		if (res == 0 && (chmod(tmp, 0444) == -1 || rename(tmp, template) == -1)) {
+			boo = strerror(errno);
+			res = -1;
 		}
-
-		/* Set things up so cpmSync will generate checksums and write the
-		 * file.
-		 */
-		if (cpmCreat(&root, "00!!!TIME&.DAT", &ino, 0) == -1) {
-			fprintf(stderr, "%s: Unable to create DateStamper file: %s\n", cmd, boo);
+		if (res == -1) {
+			unlink(tmp);
+		}
+		free(tmp);
+		if (res == -1) {
+			free(template);
 			return -1;
 		}
-		root.sb->ds = ds;
-		root.sb->dirtyDs = 1;
-		cpmUmount(&super);
 	}
-
-	return 0;
+	res = cloneFile(drive, template, name);
+	free(template);
+	return res;
 }
 
 const char cmd[] = "mkfs.cpm";
@@ -162,10 +278,30 @@ int main(int argc, char *argv[]) {
 	size_t bootTrackSize, used;
 	char *bootTracks;
 	const char *boot[4] = {NULL, NULL, NULL, NULL};
+	const char *template = NULL;
+	int i, j;
 
 	if (!(format = getenv("CPMTOOLSFMT"))) {
 		format = FORMAT;
 	}
+	argc = cpmStatsArgs(argc, argv);
+	/* take --template out of the arguments, as --stats */
+	for (i = j = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--template") == 0 && i + 1 < argc) {
+			template = argv[++i];
+		} else if (strncmp(argv[i], "--template=", 11) == 0) {
+			template = argv[i] + 11;
+		} else if (strcmp(argv[i], "--") == 0) {
+			while (i < argc) {
+				argv[j++] = argv[i++];
+			}
+			break;
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argv[j] = NULL;
+	argc = j;
 	while ((c = getopt(argc, argv, "b:f:L:tuh?")) != EOF) {
 		switch (c) {
 		case 'b':
@@ -206,7 +342,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (usage) {
-		fprintf(stderr, "Usage: %s [-f format] [-b boot] [-L label] [-t] [-u] image\n", cmd);
+		fprintf(stderr, "Usage: %s [-f format] [-b boot] [-L label] [-t] [-u] [--template directory] image\n", cmd);
 		exit(1);
 	}
 	drive.dev.opened = 0;
@@ -238,10 +374,12 @@ int main(int argc, char *argv[]) {
 		used += size;
 		close(fd);
 	}
-	if (mkfs(&drive, image, format, label, bootTracks, timeStamps, uppercase) == -1) {
+	if ((template ? mkfsTemplate(&drive, template, format, image, label, bootTracks, timeStamps)
+		: mkfs(&drive, image, label, bootTracks, timeStamps)) == -1) {
 		fprintf(stderr, "%s: can not make new file system: %s\n", cmd, boo);
 		exit(1);
-	} else {
-		exit(0);
 	}
+	free(bootTracks);
+	cpmUmount(&drive);
+	exit(0);
 }
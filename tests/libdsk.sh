@@ -0,0 +1,64 @@
+#!/bin/sh
+# Check the track cache of the libdsk driver against libdsk's file-backed
+# raw driver, so no floppy drive is needed.
+#
+# Usage: tests/libdsk.sh [bindir]
+#
+# Exits 77 (skipped) if the tools were built without libdsk.
+
+BIN=`cd ${1:-\`dirname $0\`/../src} && pwd`
+DISKDEFS=`cd \`dirname $0\`/.. && pwd`/diskdefs
+FORMAT=pcw
+DRIVER=libdsk:raw
+WORK=`mktemp -d ${TMPDIR:-/tmp}/cpmtest.XXXXXX`
+trap 'rm -rf "$WORK"' 0
+
+fail() {
+	echo "libdsk: $*" >&2
+	exit 1
+}
+
+cp "$DISKDEFS" "$WORK" || exit 1
+cd "$WORK" || exit 1
+
+$BIN/mkfs.cpm -f $FORMAT image || exit 1
+cp image ref
+if ! $BIN/cpmls -f $FORMAT -T $DRIVER image > out 2>&1; then
+	if grep 'only accepts the options' out > /dev/null; then
+		echo "libdsk: skipped, the tools were built without libdsk"
+		exit 77
+	fi
+	fail "cannot open the image: `cat out`"
+fi
+
+head -c 150000 /dev/urandom > big
+head -c 5000 /dev/urandom > small
+echo hello > text
+
+# writes only dirty the cached tracks, close must write them back
+$BIN/cpmcp -f $FORMAT -T $DRIVER image big small text 0: || fail "cpmcp to the image"
+$BIN/cpmcp -f $FORMAT -T posix ref big small text 0: || fail "cpmcp to the reference"
+cmp image ref > /dev/null || fail "image written through libdsk differs from the reference"
+
+mkdir back
+$BIN/cpmcp -f $FORMAT -T $DRIVER image 0:big 0:small 0:text back || fail "cpmcp from the image"
+for f in big small text; do
+	cmp $f back/$f || fail "$f read back differs"
+done
+
+# reading the big file three times covers more sectors than the disk
+# has, but every track is fetched from libdsk only once
+CPMTOOLS_STATS=json $BIN/cpmcp -f $FORMAT -T $DRIVER image 0:big 0:big 0:big back 2> stats || fail "cpmcp with statistics"
+reads=`sed -n 's/.*"sector_reads": \([0-9]*\).*/\1/p' stats`
+calls=`sed -n 's/.*"device_syscalls": \([0-9]*\).*/\1/p' stats`
+[ -n "$reads" ] && [ -n "$calls" ] || fail "no statistics: `cat stats`"
+[ $reads -gt 360 ] || fail "only $reads sector reads"
+[ $calls -le 360 ] || fail "$calls libdsk calls for $reads sector reads, tracks are not cached"
+
+$BIN/cpmrm -f $FORMAT -T $DRIVER image 0:big || fail "cpmrm"
+$BIN/fsck.cpm -f $FORMAT -n image > /dev/null || fail "fsck.cpm after cpmrm"
+$BIN/cpmls -f $FORMAT -T posix image > out || fail "cpmls"
+grep big out > /dev/null && fail "big is still in the directory"
+
+echo "libdsk: ok"
+exit 0